@@ -0,0 +1,9 @@
+/* The GPIO types used by zone.h, for the host simulation */
+#pragma once
+
+#include <stddef.h>
+#include "sdkconfig.h"
+
+typedef int gpio_num_t;
+
+#define GPIO_NUM_NC (-1)
@@ -0,0 +1,5 @@
+/* The LEDC types used by zone.h, for the host simulation */
+#pragma once
+
+typedef int ledc_channel_t;
+typedef int ledc_timer_t;
@@ -0,0 +1,34 @@
+/* esp_log.h for the host simulation: ESP_LOGx print to stderr above a runtime level */
+#pragma once
+
+#include <stdio.h>
+#include "sdkconfig.h"
+
+typedef enum
+{
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+extern esp_log_level_t g_sim_log_level;
+long long sim_log_timestamp_ms(void);
+
+#define SIM_LOG(level, letter, tag, format, ...)                                                  \
+    do                                                                                            \
+    {                                                                                             \
+        if (g_sim_log_level >= (level))                                                           \
+        {                                                                                         \
+            fprintf(stderr, letter " (%lld) %s: " format "\n", sim_log_timestamp_ms(), tag,        \
+                    ##__VA_ARGS__);                                                               \
+        }                                                                                         \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) SIM_LOG(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) SIM_LOG(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) SIM_LOG(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) SIM_LOG(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) SIM_LOG(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
@@ -0,0 +1,14 @@
+/* Configuration of the host simulation, the defaults of main/Kconfig.projbuild */
+#pragma once
+
+#define CONFIG_LIGHT_FADE_UP_TIME_MS 10000
+#define CONFIG_LIGHT_FADE_DOWN_TIME_MS 10000
+#define CONFIG_LIGHT_BRIGHTNESS_PERCENT 100
+#define CONFIG_LIGHT_OCCUPANCY_HOLD_TIME_S 300
+#define CONFIG_LIGHT_MOTION_DEBOUNCE_MS 50
+#define CONFIG_LIGHT_MOTION_MIN_PULSE_MS 5
+#define CONFIG_LIGHT_MOTION_CONFIRM_PULSES 1
+#define CONFIG_LIGHT_MOTION_CONFIRM_WINDOW_S 10
+#define CONFIG_LIGHT_TIMEZONE "CST6EDT,M3.2.0/2,M11.1.0"
+#define CONFIG_LIGHT_SCHEDULE "08:00-16:00"
+#define CONFIG_LIGHT_UNSYNCED_ACTIVE 1
@@ -0,0 +1,286 @@
+/*******************************************************************************************
+Simulated Light HAL
+
+light_hal.h on a virtual clock. Nothing here runs on its own: the simulation loop sets the
+time, asks for the next instant something is due (a timer or the end of a fade segment) and
+fires it, which posts the same events the ESP32 timers and the LEDC interrupt would.
+
+A PWM channel is modelled as a linear ramp from the duty at the start of a segment to its end
+duty. Stopping a ramp is only possible with fadeStop set, which mirrors
+SOC_LEDC_SUPPORT_FADE_STOP; the ESP32 itself can not, so that is the default.
+
+********************************************************************************************/
+#include "sim_hal.h"
+#include <stddef.h>
+#include "esp_log.h"
+
+#define SIM_TIMER_MAX (2 * ZONE_MAX)
+
+struct light_hal_timer
+{
+    light_hal_timer_cb_t callback;
+    void *arg;
+    int64_t dueUs;                  /* SIM_NEVER while stopped */
+};
+
+typedef struct
+{
+    uint32_t duty;                  /* Duty at fadeStartUs, or the steady duty */
+    uint32_t fadeDuty;
+    int64_t fadeStartUs;
+    int64_t fadeEndUs;              /* SIM_NEVER while no fade is running */
+    sim_led_stats_t stats;
+} sim_led_t;
+
+esp_log_level_t g_sim_log_level = ESP_LOG_WARN;
+
+static int64_t s_now_us;
+static time_t s_start_time;
+static bool s_clock_valid;
+static bool s_fade_stop;
+static sim_rise_hook_t s_rise_hook;
+
+static struct light_hal_timer s_timers[SIM_TIMER_MAX];
+static uint8_t s_timer_count;
+
+static light_event_t s_queue[LIGHT_EVENT_QUEUE_LENGTH];
+static uint32_t s_queue_head;
+static uint32_t s_queue_count;
+
+static int s_sensor_level[ZONE_MAX];
+static sim_led_t s_leds[ZONE_MAX];
+
+static uint32_t ramp_duty(const sim_led_t *led, int64_t atUs)
+{
+    /* Duty of a running ramp at 'atUs' */
+    int64_t length = led->fadeEndUs - led->fadeStartUs;
+    int64_t elapsed = atUs - led->fadeStartUs;
+
+    if ((length <= 0) || (elapsed >= length))
+    {
+        return led->fadeDuty;
+    }
+    return (uint32_t)((int64_t)led->duty + ((int64_t)led->fadeDuty - (int64_t)led->duty) * elapsed / length);
+}
+
+static void notify_rise(uint8_t zone, uint32_t from, uint32_t to)
+{
+    if ((to > from) && (s_rise_hook != NULL))
+    {
+        s_rise_hook(zone);
+    }
+}
+
+void sim_hal_init(time_t startTime, bool fadeStop)
+{
+    /* This function resets the platform to the start of a run, the clock is valid */
+    s_now_us = 0;
+    s_start_time = startTime;
+    s_clock_valid = true;
+    s_fade_stop = fadeStop;
+    s_timer_count = 0;
+    s_queue_head = 0;
+    s_queue_count = 0;
+    for (uint8_t zone = 0; zone < ZONE_MAX; zone++)
+    {
+        s_sensor_level[zone] = 0;
+        s_leds[zone] = (sim_led_t){ .fadeEndUs = SIM_NEVER };
+    }
+}
+
+void sim_hal_set_now(int64_t nowUs)
+{
+    s_now_us = nowUs;
+}
+
+time_t sim_hal_wall_time(void)
+{
+    return s_start_time + (time_t)(s_now_us / 1000000);
+}
+
+void sim_hal_set_clock_valid(bool valid)
+{
+    s_clock_valid = valid;
+}
+
+void sim_hal_set_sensor(uint8_t zone, int level)
+{
+    s_sensor_level[zone] = level;
+}
+
+void sim_hal_set_rise_hook(sim_rise_hook_t hook)
+{
+    s_rise_hook = hook;
+}
+
+int64_t sim_hal_next_due_us(void)
+{
+    /* This function returns when the next timer expires or fade segment ends */
+    int64_t due = SIM_NEVER;
+
+    for (uint8_t i = 0; i < s_timer_count; i++)
+    {
+        due = (s_timers[i].dueUs < due) ? s_timers[i].dueUs : due;
+    }
+    for (uint8_t zone = 0; zone < ZONE_MAX; zone++)
+    {
+        due = (s_leds[zone].fadeEndUs < due) ? s_leds[zone].fadeEndUs : due;
+    }
+    return due;
+}
+
+void sim_hal_fire_due(void)
+{
+    /* This function fires everything due up to now in time order. Each one sees the clock at
+       its own due time, as an interrupt or a timer callback would. */
+    int64_t now = s_now_us;
+    int64_t due;
+
+    while ((due = sim_hal_next_due_us()) <= now)
+    {
+        s_now_us = due;
+        for (uint8_t i = 0; i < s_timer_count; i++)
+        {
+            if (s_timers[i].dueUs == due)
+            {
+                s_timers[i].dueUs = SIM_NEVER;
+                s_timers[i].callback(s_timers[i].arg);
+            }
+        }
+        for (uint8_t zone = 0; zone < ZONE_MAX; zone++)
+        {
+            sim_led_t *led = &s_leds[zone];
+            if (led->fadeEndUs == due)
+            {
+                light_event_t event = {
+                    .type = LIGHT_EVENT_FADE_DONE,
+                    .zone = zone,
+                    .timestamp_us = due,
+                    .value = led->fadeDuty,
+                };
+                led->duty = led->fadeDuty;
+                led->fadeEndUs = SIM_NEVER;
+                light_hal_post_event(&event);
+            }
+        }
+    }
+    s_now_us = now;
+}
+
+bool sim_hal_receive(light_event_t *event)
+{
+    if (s_queue_count == 0)
+    {
+        return false;
+    }
+    *event = s_queue[s_queue_head];
+    s_queue_head = (s_queue_head + 1) % LIGHT_EVENT_QUEUE_LENGTH;
+    s_queue_count--;
+    return true;
+}
+
+uint32_t sim_hal_duty(uint8_t zone)
+{
+    const sim_led_t *led = &s_leds[zone];
+    return (led->fadeEndUs == SIM_NEVER) ? led->duty : ramp_duty(led, s_now_us);
+}
+
+void sim_hal_get_led_stats(uint8_t zone, sim_led_stats_t *stats)
+{
+    *stats = s_leds[zone].stats;
+}
+
+long long sim_log_timestamp_ms(void)
+{
+    return (long long)(s_now_us / 1000);
+}
+
+int64_t light_hal_now_us(void)
+{
+    return s_now_us;
+}
+
+bool light_hal_clock_valid(time_t now)
+{
+    return s_clock_valid;
+}
+
+bool light_hal_post_event(const light_event_t *event)
+{
+    if (s_queue_count == LIGHT_EVENT_QUEUE_LENGTH)
+    {
+        return false;
+    }
+    s_queue[(s_queue_head + s_queue_count) % LIGHT_EVENT_QUEUE_LENGTH] = *event;
+    s_queue_count++;
+    return true;
+}
+
+light_hal_timer_t light_hal_timer_create(light_hal_timer_cb_t callback, void *arg, const char *name)
+{
+    struct light_hal_timer *timer;
+
+    if (s_timer_count == SIM_TIMER_MAX)
+    {
+        ESP_LOGE("sim_hal", "Out of timers for %s", name);
+        return NULL;
+    }
+    timer = &s_timers[s_timer_count++];
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->dueUs = SIM_NEVER;
+    return timer;
+}
+
+void light_hal_timer_start(light_hal_timer_t timer, uint64_t timeoutUs)
+{
+    timer->dueUs = s_now_us + (int64_t)timeoutUs;
+}
+
+void light_hal_timer_stop(light_hal_timer_t timer)
+{
+    timer->dueUs = SIM_NEVER;
+}
+
+int light_hal_sensor_level(uint8_t zone)
+{
+    return s_sensor_level[zone];
+}
+
+void light_hal_led_fade(uint8_t zone, uint32_t duty, uint32_t timeMs)
+{
+    sim_led_t *led = &s_leds[zone];
+    uint32_t from = sim_hal_duty(zone);
+
+    led->duty = from;
+    led->fadeDuty = duty;
+    led->fadeStartUs = s_now_us;
+    led->fadeEndUs = s_now_us + (int64_t)timeMs * 1000;
+    led->stats.fades++;
+    notify_rise(zone, from, duty);
+}
+
+bool light_hal_led_stop(uint8_t zone, uint32_t *duty)
+{
+    sim_led_t *led = &s_leds[zone];
+
+    if (!s_fade_stop)
+    {
+        return false;
+    }
+    led->duty = sim_hal_duty(zone);
+    led->fadeEndUs = SIM_NEVER;
+    *duty = led->duty;
+    return true;
+}
+
+void light_hal_led_set(uint8_t zone, uint32_t duty)
+{
+    sim_led_t *led = &s_leds[zone];
+    uint32_t from = sim_hal_duty(zone);
+
+    led->duty = duty;
+    led->fadeEndUs = SIM_NEVER;
+    led->stats.sets++;
+    notify_rise(zone, from, duty);
+}
@@ -0,0 +1,37 @@
+#ifndef _SIM_HAL_H_
+#define _SIM_HAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "light_hal.h"
+#include "journal.h"
+
+#define SIM_NEVER INT64_MAX
+
+/* Calls into a zone's simulated PWM channel */
+typedef struct
+{
+    uint32_t fades;                 /* Hardware fade segments started */
+    uint32_t sets;                  /* Immediate duty writes */
+} sim_led_stats_t;
+
+/* Called when a zone's duty starts to rise, from a fade start or a write */
+typedef void (*sim_rise_hook_t)(uint8_t zone);
+
+void sim_hal_init(time_t startTime, bool fadeStop);
+void sim_hal_set_now(int64_t nowUs);
+time_t sim_hal_wall_time(void);
+void sim_hal_set_clock_valid(bool valid);
+void sim_hal_set_sensor(uint8_t zone, int level);
+void sim_hal_set_rise_hook(sim_rise_hook_t hook);
+int64_t sim_hal_next_due_us(void);
+void sim_hal_fire_due(void);
+bool sim_hal_receive(light_event_t *event);
+uint32_t sim_hal_duty(uint8_t zone);
+void sim_hal_get_led_stats(uint8_t zone, sim_led_stats_t *stats);
+
+/* Records added to the journal stand-in (sim_journal.c) */
+uint32_t sim_journal_count(journal_type_t type);
+
+#endif /* _SIM_HAL_H_ */
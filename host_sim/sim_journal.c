@@ -0,0 +1,35 @@
+/*******************************************************************************************
+Simulation Journal
+
+Stands in for main/journal.c, which needs the flash partition and RTC memory: the records the
+lighting logic adds are only counted by type, for the report.
+
+********************************************************************************************/
+#include <string.h>
+#include "sim_hal.h"
+
+static uint32_t s_counts[JOURNAL_TYPE_COUNT];
+
+void journal_init(void)
+{
+    memset(s_counts, 0, sizeof(s_counts));
+}
+
+void journal_add(journal_type_t type, uint8_t zone, uint32_t value)
+{
+    s_counts[type]++;
+}
+
+void journal_flush(void)
+{
+}
+
+bool journal_busy(void)
+{
+    return false;
+}
+
+uint32_t sim_journal_count(journal_type_t type)
+{
+    return s_counts[type];
+}
@@ -0,0 +1,549 @@
+/*******************************************************************************************
+Light Automation Simulation
+
+Runs the lighting logic of main/ (light_controller.c, led_fade.c, motion_filter.c, metrics.c,
+occupancy.c, schedule.c) on the simulated HAL with a virtual clock. A PIR trace is replayed through the same event
+queue and dispatch as the lighting task in light_automation_main.c, so a week of events takes
+well under a second.
+
+    light_sim <scenario> [--fade-stop] [--verbose]
+    light_sim --trace <file> [--fade-stop] [--verbose]
+
+The lighting task's own cost is modelled as SIM_DISPATCH_US per event and the interrupt entry
+as SIM_ISR_US. Every run reports
+
+  - motion-to-light latency: from a rising edge on an unlit zone that is inside its schedule
+    window, and long enough to pass the motion filter, to the zone's duty starting to rise,
+    as percentiles,
+  - missed motion: such edges that did not light the zone within SIM_MISS_WINDOW_US, and
+    edges lost to a full event queue,
+  - duty updates: LEDC fade segments and writes issued for the run,
+  - sensor pulses accepted and rejected by the motion filter,
+  - the firmware's own metrics histograms (metrics.c) for the same run,
+  - the records the journal would keep (journal.c is replaced by sim_journal.c).
+
+The exit status is non-zero if motion was missed or dropped, or the 99th percentile latency
+is above its bound: SIM_LATENCY_BOUND_US plus the minimum pulse width with --fade-stop,
+otherwise one fade segment more, which is how long an ESP32 without hardware fade stop takes
+to reverse a fade-down.
+
+********************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "sim_hal.h"
+#include "sim_trace.h"
+#include "light_controller.h"
+#include "led_fade.h"
+#include "metrics.h"
+#include "motion_filter.h"
+#include "occupancy.h"
+#include "schedule.h"
+
+#define SIM_DISPATCH_US 50
+#define SIM_ISR_US 5
+#define SIM_MISS_WINDOW_US 2000000
+#define SIM_LATENCY_BOUND_US (2000 + CONFIG_LIGHT_MOTION_MIN_PULSE_MS * 1000)
+#define SIM_SEGMENT_US ((int64_t)CONFIG_LIGHT_FADE_DOWN_TIME_MS * 1000 / LED_FADE_STEPS)
+#define SIM_NO_EDGE (-1)
+
+#define SIM_S(s) ((int64_t)(s) * 1000000)
+#define SIM_MIN(m) SIM_S((int64_t)(m) * 60)
+#define SIM_HOURS(h) SIM_MIN((int64_t)(h) * 60)
+#define SIM_DAY SIM_HOURS(24)
+
+typedef struct
+{
+    const char *name;
+    const char *description;
+    uint32_t days;
+    uint8_t zones;
+    const char *schedule;
+    uint32_t holdTimeS;
+    uint32_t unsyncedS;             /* The clock is not set for this long after the start */
+    void (*generate)(sim_trace_t *trace, uint8_t zones, uint32_t days);
+} sim_scenario_t;
+
+typedef struct
+{
+    uint32_t edges;
+    uint32_t lightUps;
+    uint32_t ignored;               /* Rising edges on unlit zones outside the schedule */
+    uint32_t missed;
+    uint32_t dropped;
+    uint32_t dispatched;
+    int64_t pendingEdgeUs[ZONE_MAX];
+    int64_t filterChangeUs[ZONE_MAX];   /* Last edge the motion filter takes, see passes_filter() */
+    int64_t *latencies;
+    uint32_t latencyCount;
+    uint32_t latencyCapacity;
+} sim_result_t;
+
+static sim_result_t s_result;
+
+/* Generated traces ------------------------------------------------------------------------ */
+
+static void generate_office(sim_trace_t *trace, uint8_t zones, uint32_t days)
+{
+    /* Weekdays: people in from 08:00 to 12:00 and 13:00 to 17:30, moving every few seconds to
+       two minutes, with the odd meeting that empties a room for longer than the hold time.
+       Weekends: a short cleaning round in the evening, outside the schedule. */
+    uint32_t seed = 0x0FF1CE;
+
+    for (uint32_t day = 0; day < days; day++)
+    {
+        int64_t midnight = day * SIM_DAY;
+        for (uint8_t zone = 0; zone < zones; zone++)
+        {
+            if ((day % 7) >= 5)
+            {
+                sim_trace_add_pulse(trace, zone, midnight + SIM_HOURS(20) + sim_random_range(&seed, 0, SIM_MIN(30)),
+                                    SIM_S(3));
+                continue;
+            }
+            const int64_t blocks[2][2] = { { SIM_HOURS(8), SIM_HOURS(12) }, { SIM_HOURS(13), SIM_MIN(17 * 60 + 30) } };
+            for (int block = 0; block < 2; block++)
+            {
+                int64_t at = midnight + blocks[block][0] + sim_random_range(&seed, 0, SIM_MIN(10));
+                while (at < midnight + blocks[block][1])
+                {
+                    sim_trace_add_pulse(trace, zone, at, sim_random_range(&seed, SIM_S(2), SIM_S(4)));
+                    at += sim_random_range(&seed, SIM_S(5), SIM_S(120));
+                    if (sim_random_range(&seed, 0, 99) < 2)
+                    {
+                        at += sim_random_range(&seed, SIM_MIN(6), SIM_MIN(40));
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void generate_hallway(sim_trace_t *trace, uint8_t zones, uint32_t days)
+{
+    /* Walks down a hallway around the clock: zone after zone a few seconds apart, every twenty
+       seconds to twenty minutes, often while the light behind the last walker fades out */
+    uint32_t seed = 0xCA11;
+    int64_t at = SIM_MIN(1);
+
+    while (at < days * SIM_DAY)
+    {
+        for (uint8_t zone = 0; zone < zones; zone++)
+        {
+            sim_trace_add_pulse(trace, zone, at + zone * SIM_S(4), SIM_S(2));
+        }
+        at += sim_random_range(&seed, SIM_S(20), SIM_MIN(20));
+    }
+}
+
+static void generate_burst(sim_trace_t *trace, uint8_t zones, uint32_t days)
+{
+    /* Every sensor trips in the same instant, every seven minutes */
+    for (int64_t at = SIM_MIN(1); at < days * SIM_DAY; at += SIM_MIN(7))
+    {
+        for (uint8_t zone = 0; zone < zones; zone++)
+        {
+            sim_trace_add_pulse(trace, zone, at, SIM_S(2));
+        }
+    }
+}
+
+static void generate_hourly(sim_trace_t *trace, uint8_t zones, uint32_t days)
+{
+    /* One visit an hour, on the half hour */
+    for (int64_t at = SIM_MIN(30); at < days * SIM_DAY; at += SIM_HOURS(1))
+    {
+        for (uint8_t zone = 0; zone < zones; zone++)
+        {
+            sim_trace_add_pulse(trace, zone, at, SIM_S(3));
+        }
+    }
+}
+
+static const sim_scenario_t s_scenarios[] = {
+    { "office_week", "Four offices on weekday hours for a week across the DST change",
+      7, 4, "Mo-Fr 07:00-19:00", 300, 0, generate_office },
+    { "hallway_week", "Two hallway zones walked through around the clock for a week",
+      7, 2, "00:00-24:00", 30, 0, generate_hallway },
+    { "burst_day", "All eight zones tripped at once every seven minutes for a day",
+      1, ZONE_MAX, "00:00-24:00", 60, 0, generate_burst },
+    { "unsynced_day", "Hourly motion, with the clock not set for the first six hours",
+      1, 1, "08:00-16:00", 300, 6 * 3600, generate_hourly },
+};
+
+/* Measurement ----------------------------------------------------------------------------- */
+
+static void record_latency(int64_t latencyUs)
+{
+    if (s_result.latencyCount == s_result.latencyCapacity)
+    {
+        s_result.latencyCapacity = (s_result.latencyCapacity == 0) ? 1024 : 2 * s_result.latencyCapacity;
+        s_result.latencies = realloc(s_result.latencies, s_result.latencyCapacity * sizeof(int64_t));
+        if (s_result.latencies == NULL)
+        {
+            fprintf(stderr, "Out of memory for latencies\n");
+            exit(2);
+        }
+    }
+    s_result.latencies[s_result.latencyCount++] = latencyUs;
+}
+
+static void rise_hook(uint8_t zone)
+{
+    /* The zone's duty starts to rise: this closes an edge waiting for light */
+    if (s_result.pendingEdgeUs[zone] != SIM_NO_EDGE)
+    {
+        record_latency(light_hal_now_us() - s_result.pendingEdgeUs[zone]);
+        s_result.pendingEdgeUs[zone] = SIM_NO_EDGE;
+        s_result.lightUps++;
+    }
+}
+
+static void check_missed(int64_t nowUs)
+{
+    for (uint8_t zone = 0; zone < ZONE_MAX; zone++)
+    {
+        if ((s_result.pendingEdgeUs[zone] != SIM_NO_EDGE) && (nowUs - s_result.pendingEdgeUs[zone] > SIM_MISS_WINDOW_US))
+        {
+            ESP_LOGW("sim", "Zone %u: motion at %lld ms not lit", zone, (long long)(s_result.pendingEdgeUs[zone] / 1000));
+            s_result.missed++;
+            s_result.pendingEdgeUs[zone] = SIM_NO_EDGE;
+        }
+    }
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    int64_t latencyA = *(const int64_t *)a;
+    int64_t latencyB = *(const int64_t *)b;
+    return (latencyA > latencyB) - (latencyA < latencyB);
+}
+
+static int64_t percentile(uint32_t percent)
+{
+    if (s_result.latencyCount == 0)
+    {
+        return 0;
+    }
+    uint32_t index = (uint32_t)(((uint64_t)s_result.latencyCount * percent + 99) / 100);
+    return s_result.latencies[(index > 0) ? index - 1 : 0];
+}
+
+/* Simulation loop ------------------------------------------------------------------------- */
+
+static bool passes_filter(const sim_trace_t *trace, uint32_t index)
+{
+    /* This function returns whether the motion filter is meant to accept a rising edge: it is
+       not within the debounce of the last edge the filter took, no edge the filter takes
+       ends the pulse before the minimum width, and the line is still high by then */
+    const sim_edge_t *edge = &trace->edges[index];
+    const int64_t debounceUs = (int64_t)CONFIG_LIGHT_MOTION_DEBOUNCE_MS * 1000;
+    const int64_t minPulseUs = (int64_t)CONFIG_LIGHT_MOTION_MIN_PULSE_MS * 1000;
+    int64_t changeUs = edge->atUs;
+    uint8_t level = 1;
+
+    if (edge->atUs - s_result.filterChangeUs[edge->zone] < debounceUs)
+    {
+        return false;
+    }
+    s_result.filterChangeUs[edge->zone] = edge->atUs;
+    if (edge->level != 1)
+    {
+        return false;
+    }
+    for (uint32_t i = index + 1; (i < trace->count) && (trace->edges[i].atUs <= edge->atUs + minPulseUs); i++)
+    {
+        if (trace->edges[i].zone != edge->zone)
+        {
+            continue;
+        }
+        if (trace->edges[i].atUs - changeUs >= debounceUs)
+        {
+            if (trace->edges[i].level == 0)
+            {
+                return false;
+            }
+            changeUs = trace->edges[i].atUs;
+        }
+        level = trace->edges[i].level;
+    }
+    return level == 1;
+}
+
+static void inject_edge(const sim_edge_t *edge, bool expectLight)
+{
+    /* This function plays the sensor ISR for one trace edge */
+    light_event_t event = {
+        .type = LIGHT_EVENT_MOTION,
+        .zone = edge->zone,
+        .timestamp_us = edge->atUs,
+        .value = edge->level,
+    };
+
+    sim_hal_set_sensor(edge->zone, edge->level);
+    s_result.edges++;
+    if ((edge->level == 1) && expectLight && (s_result.pendingEdgeUs[edge->zone] == SIM_NO_EDGE) &&
+        !light_controller_zone_lit(edge->zone))
+    {
+        s_result.pendingEdgeUs[edge->zone] = edge->atUs;
+    }
+    if (!light_hal_post_event(&event))
+    {
+        s_result.dropped++;
+    }
+}
+
+static void dispatch(const light_event_t *event, time_t *nextCheck)
+{
+    /* The switch of lighting_task() without the hour blink */
+    switch (event->type)
+    {
+        case LIGHT_EVENT_MOTION:
+            light_controller_handle_event(event);
+            if ((event->value == 1) && (s_result.pendingEdgeUs[event->zone] != SIM_NO_EDGE) &&
+                !light_controller_zone_active(event->zone))
+            {
+                /* Outside the schedule window, motion is not supposed to light the zone */
+                s_result.pendingEdgeUs[event->zone] = SIM_NO_EDGE;
+                s_result.ignored++;
+            }
+            break;
+        case LIGHT_EVENT_TIME_SYNCED:
+            light_controller_handle_event(event);
+            *nextCheck = light_controller_update(sim_hal_wall_time());
+            break;
+        default:
+            light_controller_handle_event(event);
+            break;
+    }
+    s_result.dispatched++;
+}
+
+static void run(const sim_scenario_t *scenario, const sim_trace_t *trace, int64_t endUs)
+{
+    time_t start = sim_hal_wall_time();
+    int64_t syncUs = (scenario->unsyncedS > 0) ? SIM_S(scenario->unsyncedS) : SIM_NEVER;
+    uint32_t edgeIndex = 0;
+    int64_t nowUs = 0;
+    light_event_t event;
+    time_t nextCheck = light_controller_update(start);
+
+    while (true)
+    {
+        /* Everything that happened up to now reaches the queue in time order */
+        while ((edgeIndex < trace->count) && (trace->edges[edgeIndex].atUs + SIM_ISR_US <= nowUs))
+        {
+            sim_hal_set_now(trace->edges[edgeIndex].atUs + SIM_ISR_US);
+            sim_hal_fire_due();
+            inject_edge(&trace->edges[edgeIndex], passes_filter(trace, edgeIndex));
+            edgeIndex++;
+            sim_hal_set_now(nowUs);
+        }
+        sim_hal_fire_due();
+        if (syncUs <= nowUs)
+        {
+            light_event_t synced = { .type = LIGHT_EVENT_TIME_SYNCED, .timestamp_us = nowUs };
+            sim_hal_set_clock_valid(true);
+            light_hal_post_event(&synced);
+            syncUs = SIM_NEVER;
+        }
+        check_missed(nowUs);
+
+        if (sim_hal_wall_time() >= nextCheck)
+        {
+            nextCheck = light_controller_update(sim_hal_wall_time());
+        }
+
+        if (sim_hal_receive(&event))
+        {
+            /* Waking the task and getting to the handler */
+            nowUs += SIM_DISPATCH_US;
+            sim_hal_set_now(nowUs);
+            dispatch(&event, &nextCheck);
+            continue;
+        }
+
+        /* Idle: the lighting task sleeps until the next stimulus */
+        int64_t next = SIM_S(nextCheck - start);
+        next = (sim_hal_next_due_us() < next) ? sim_hal_next_due_us() : next;
+        next = (syncUs < next) ? syncUs : next;
+        if ((edgeIndex < trace->count) && (trace->edges[edgeIndex].atUs + SIM_ISR_US < next))
+        {
+            next = trace->edges[edgeIndex].atUs + SIM_ISR_US;
+        }
+        if (next >= endUs)
+        {
+            break;
+        }
+        nowUs = (next > nowUs) ? next : nowUs;
+        sim_hal_set_now(nowUs);
+    }
+    sim_hal_set_now(endUs);
+    check_missed(endUs + SIM_MISS_WINDOW_US + 1);
+}
+
+static bool report(const sim_scenario_t *scenario, bool fadeStop, double runtimeS, int64_t endUs)
+{
+    uint32_t fades = 0;
+    uint32_t sets = 0;
+    motion_filter_stats_t filter = { 0 };
+    metrics_snapshot_t snapshot;
+    int64_t bound = fadeStop ? SIM_LATENCY_BOUND_US : SIM_LATENCY_BOUND_US + SIM_SEGMENT_US;
+    bool passed;
+
+    for (uint8_t zone = 0; zone < ZONE_MAX; zone++)
+    {
+        sim_led_stats_t stats;
+        sim_hal_get_led_stats(zone, &stats);
+        fades += stats.fades;
+        sets += stats.sets;
+
+        motion_filter_stats_t zoneFilter;
+        motion_filter_get_stats(zone, &zoneFilter);
+        filter.accepted += zoneFilter.accepted;
+        filter.bounces += zoneFilter.bounces;
+        filter.shortPulses += zoneFilter.shortPulses;
+        filter.unconfirmed += zoneFilter.unconfirmed;
+    }
+    metrics_snapshot(&snapshot, endUs);
+    qsort(s_result.latencies, s_result.latencyCount, sizeof(int64_t), compare_latency);
+    passed = (s_result.missed == 0) && (s_result.dropped == 0) && (percentile(99) <= bound);
+
+    printf("scenario %s%s: %s\n", scenario->name, fadeStop ? " (fade stop)" : "", scenario->description);
+    printf("  simulated %.1f h in %.3f s\n", endUs / 3.6e9, runtimeS);
+    printf("  edges %u, light-ups %u, ignored %u, missed %u, dropped %u\n",
+           s_result.edges, s_result.lightUps, s_result.ignored, s_result.missed, s_result.dropped);
+    printf("  motion-to-light latency us: p50 %lld p90 %lld p99 %lld max %lld (bound %lld)\n",
+           (long long)percentile(50), (long long)percentile(90), (long long)percentile(99),
+           (long long)percentile(100), (long long)bound);
+    printf("  duty updates %u (fade segments %u, writes %u), %.1f per light-up, linear loop %u\n",
+           fades + sets, fades, sets, (s_result.lightUps > 0) ? (double)(fades + sets) / s_result.lightUps : 0.0,
+           2 * g_zone_table[0].maxDuty + 1);
+    printf("  sensor pulses accepted %u, rejected %u bounces, %u short, %u unconfirmed\n",
+           filter.accepted, filter.bounces, filter.shortPulses, filter.unconfirmed);
+    printf("  events dispatched %u\n", s_result.dispatched);
+    printf("  metrics: edge to duty p99 <= %lu us max %lu us, %lu fades p50 <= %lu ms\n",
+           (unsigned long)metrics_percentile(&snapshot.histograms[METRIC_EDGE_TO_DUTY_US], 99),
+           (unsigned long)snapshot.histograms[METRIC_EDGE_TO_DUTY_US].max,
+           (unsigned long)snapshot.counters[METRIC_FADES],
+           (unsigned long)metrics_percentile(&snapshot.histograms[METRIC_FADE_MS], 50));
+    printf("  journal: %lu occupied, %lu hold extensions, %lu vacant, %lu light on, %lu light off\n",
+           (unsigned long)sim_journal_count(JOURNAL_OCCUPIED), (unsigned long)sim_journal_count(JOURNAL_HOLD_EXTENDED),
+           (unsigned long)sim_journal_count(JOURNAL_VACANT), (unsigned long)sim_journal_count(JOURNAL_LIGHT_ON),
+           (unsigned long)sim_journal_count(JOURNAL_LIGHT_OFF));
+    printf("result: %s\n", passed ? "PASS" : "FAIL");
+    return passed;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: light_sim <scenario>|--trace <file> [--fade-stop] [--verbose]\n");
+    for (size_t i = 0; i < sizeof(s_scenarios) / sizeof(s_scenarios[0]); i++)
+    {
+        fprintf(stderr, "  %-14s %s\n", s_scenarios[i].name, s_scenarios[i].description);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const sim_scenario_t *scenario = NULL;
+    sim_scenario_t traceScenario = { 0 };
+    sim_trace_setup_t setup = { 0 };
+    sim_trace_t trace = { 0 };
+    const char *tracePath = NULL;
+    bool fadeStop = false;
+    int64_t endUs;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--fade-stop") == 0)
+        {
+            fadeStop = true;
+        }
+        else if (strcmp(argv[i], "--verbose") == 0)
+        {
+            g_sim_log_level = ESP_LOG_INFO;
+        }
+        else if ((strcmp(argv[i], "--trace") == 0) && (i + 1 < argc))
+        {
+            tracePath = argv[++i];
+        }
+        else
+        {
+            for (size_t j = 0; j < sizeof(s_scenarios) / sizeof(s_scenarios[0]); j++)
+            {
+                scenario = (strcmp(argv[i], s_scenarios[j].name) == 0) ? &s_scenarios[j] : scenario;
+            }
+            if (scenario == NULL)
+            {
+                usage();
+                return 2;
+            }
+        }
+    }
+
+    /* Runs start on Monday 2024-03-04, the week before the DST change, unless a trace says so */
+    setup.start = (struct tm){ .tm_year = 124, .tm_mon = 2, .tm_mday = 4, .tm_isdst = -1 };
+    if (tracePath != NULL)
+    {
+        if (!sim_trace_load(tracePath, &trace, &setup) || (trace.count == 0))
+        {
+            return 2;
+        }
+        traceScenario = (sim_scenario_t){ .name = tracePath, .description = "scripted trace", .zones = ZONE_MAX };
+        scenario = &traceScenario;
+    }
+    else if (scenario == NULL)
+    {
+        usage();
+        return 2;
+    }
+
+    schedule_init(CONFIG_LIGHT_TIMEZONE);
+    sim_hal_init(mktime(&setup.start), fadeStop);
+    sim_hal_set_clock_valid(scenario->unsyncedS == 0);
+    sim_hal_set_rise_hook(rise_hook);
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        led_fade_add(zone, g_zone_table[zone].maxDuty);
+        motion_filter_add(zone);
+        occupancy_add(zone, g_zone_table[zone].holdTimeMs);
+        s_result.pendingEdgeUs[zone] = SIM_NO_EDGE;
+        s_result.filterChangeUs[zone] = -(int64_t)CONFIG_LIGHT_MOTION_DEBOUNCE_MS * 1000;
+    }
+    light_controller_init();
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        const char *rules = (setup.schedule[zone] != NULL) ? setup.schedule[zone] : scenario->schedule;
+        uint32_t holdTimeS = (setup.holdTimeS[zone] != 0) ? setup.holdTimeS[zone] : scenario->holdTimeS;
+        if (rules != NULL)
+        {
+            schedule_set_rules(zone, rules);
+        }
+        if (holdTimeS != 0)
+        {
+            occupancy_set_hold_time(zone, holdTimeS * 1000);
+        }
+    }
+
+    if (tracePath != NULL)
+    {
+        endUs = trace.edges[trace.count - 1].atUs + SIM_HOURS(1);
+    }
+    else
+    {
+        scenario->generate(&trace, scenario->zones, scenario->days);
+        sim_trace_sort(&trace);
+        endUs = scenario->days * SIM_DAY;
+    }
+
+    clock_t begin = clock();
+    run(scenario, &trace, endUs);
+    double runtimeS = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    bool passed = report(scenario, fadeStop, runtimeS, endUs);
+    sim_trace_free(&trace);
+    free(s_result.latencies);
+    return passed ? 0 : 1;
+}
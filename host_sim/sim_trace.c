@@ -0,0 +1,143 @@
+/*******************************************************************************************
+Simulation Traces
+
+PIR traces for the simulation: a sorted list of level changes per zone. They are either
+generated by a scenario or read from a text file, one directive or edge per line:
+
+    # comment
+    start 2024-03-04 09:00          local time at the start of the run
+    schedule <zone> <rules>         schedule rules of a zone, as CONFIG_LIGHT_SCHEDULE
+    hold <zone> <seconds>           occupancy hold time of a zone
+    <seconds> <zone> <level>        sensor level change, seconds from the start
+
+********************************************************************************************/
+#include "sim_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int compare_edges(const void *a, const void *b)
+{
+    const sim_edge_t *edgeA = a;
+    const sim_edge_t *edgeB = b;
+
+    if (edgeA->atUs != edgeB->atUs)
+    {
+        return (edgeA->atUs < edgeB->atUs) ? -1 : 1;
+    }
+    return (int)edgeA->zone - (int)edgeB->zone;
+}
+
+void sim_trace_add_edge(sim_trace_t *trace, uint8_t zone, int64_t atUs, uint8_t level)
+{
+    if (trace->count == trace->capacity)
+    {
+        trace->capacity = (trace->capacity == 0) ? 1024 : 2 * trace->capacity;
+        trace->edges = realloc(trace->edges, trace->capacity * sizeof(sim_edge_t));
+        if (trace->edges == NULL)
+        {
+            fprintf(stderr, "Out of memory for %u edges\n", trace->capacity);
+            exit(2);
+        }
+    }
+    trace->edges[trace->count++] = (sim_edge_t){ .atUs = atUs, .zone = zone, .level = level };
+}
+
+void sim_trace_add_pulse(sim_trace_t *trace, uint8_t zone, int64_t atUs, int64_t widthUs)
+{
+    /* A PIR reports presence as a high pulse */
+    sim_trace_add_edge(trace, zone, atUs, 1);
+    sim_trace_add_edge(trace, zone, atUs + widthUs, 0);
+}
+
+void sim_trace_sort(sim_trace_t *trace)
+{
+    qsort(trace->edges, trace->count, sizeof(sim_edge_t), compare_edges);
+}
+
+void sim_trace_free(sim_trace_t *trace)
+{
+    free(trace->edges);
+    *trace = (sim_trace_t){ 0 };
+}
+
+bool sim_trace_load(const char *path, sim_trace_t *trace, sim_trace_setup_t *setup)
+{
+    /* This function reads a trace file. It returns false on the first line it can not parse. */
+    FILE *file = fopen(path, "r");
+    char line[256];
+    int lineNumber = 0;
+
+    if (file == NULL)
+    {
+        perror(path);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char *text = line + strspn(line, " \t");
+        unsigned zone;
+        unsigned value;
+        double seconds;
+        int consumed;
+        struct tm start = { 0 };
+
+        lineNumber++;
+        text[strcspn(text, "\r\n")] = '\0';
+        if ((*text == '#') || (*text == '\0'))
+        {
+            continue;
+        }
+
+        if (sscanf(text, "start %d-%d-%d %d:%d", &start.tm_year, &start.tm_mon, &start.tm_mday,
+                   &start.tm_hour, &start.tm_min) == 5)
+        {
+            start.tm_year -= 1900;
+            start.tm_mon -= 1;
+            start.tm_isdst = -1;
+            setup->start = start;
+        }
+        else if ((sscanf(text, "schedule %u %n", &zone, &consumed) == 1) && (zone < ZONE_MAX))
+        {
+            snprintf(setup->scheduleText[zone], sizeof(setup->scheduleText[zone]), "%s", text + consumed);
+            setup->schedule[zone] = setup->scheduleText[zone];
+        }
+        else if ((sscanf(text, "hold %u %u", &zone, &value) == 2) && (zone < ZONE_MAX))
+        {
+            setup->holdTimeS[zone] = value;
+        }
+        else if ((sscanf(text, "%lf %u %u", &seconds, &zone, &value) == 3) && (zone < ZONE_MAX) &&
+                 (value <= 1) && (seconds >= 0))
+        {
+            sim_trace_add_edge(trace, (uint8_t)zone, (int64_t)(seconds * 1000000.0), (uint8_t)value);
+        }
+        else
+        {
+            fprintf(stderr, "%s:%d: can not parse \"%s\"\n", path, lineNumber, text);
+            fclose(file);
+            return false;
+        }
+    }
+
+    fclose(file);
+    sim_trace_sort(trace);
+    return true;
+}
+
+uint32_t sim_random(uint32_t *state)
+{
+    /* xorshift32 */
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+int64_t sim_random_range(uint32_t *state, int64_t low, int64_t high)
+{
+    /* Uniform in [low, high] */
+    return low + (int64_t)(sim_random(state) % (uint64_t)(high - low + 1));
+}
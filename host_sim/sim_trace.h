@@ -0,0 +1,43 @@
+#ifndef _SIM_TRACE_H_
+#define _SIM_TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "zone.h"
+
+/* A level change on a zone's PIR output */
+typedef struct
+{
+    int64_t atUs;                   /* From the start of the run */
+    uint8_t zone;
+    uint8_t level;
+} sim_edge_t;
+
+typedef struct
+{
+    sim_edge_t *edges;
+    uint32_t count;
+    uint32_t capacity;
+} sim_trace_t;
+
+/* Settings a trace file may carry besides its edges */
+typedef struct
+{
+    struct tm start;                /* Local time of the start of the run */
+    const char *schedule[ZONE_MAX]; /* NULL keeps the zone's schedule */
+    uint32_t holdTimeS[ZONE_MAX];   /* 0 keeps the zone's hold time */
+    char scheduleText[ZONE_MAX][64];
+} sim_trace_setup_t;
+
+void sim_trace_add_pulse(sim_trace_t *trace, uint8_t zone, int64_t atUs, int64_t widthUs);
+void sim_trace_add_edge(sim_trace_t *trace, uint8_t zone, int64_t atUs, uint8_t level);
+void sim_trace_sort(sim_trace_t *trace);
+void sim_trace_free(sim_trace_t *trace);
+bool sim_trace_load(const char *path, sim_trace_t *trace, sim_trace_setup_t *setup);
+
+/* Deterministic pseudo random numbers for the generated traces */
+uint32_t sim_random(uint32_t *state);
+int64_t sim_random_range(uint32_t *state, int64_t low, int64_t high);
+
+#endif /* _SIM_TRACE_H_ */
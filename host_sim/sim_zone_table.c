@@ -0,0 +1,22 @@
+/*******************************************************************************************
+Simulation Zone Table
+
+ZONE_MAX zones with the defaults of main/zone_table.c. The pins and channels only exist to
+fill the table; scenarios change schedules and hold times at run time.
+
+********************************************************************************************/
+#include "zone.h"
+#include "brightness.h"
+
+#define SIM_ZONE(n) { .sensorGpio = (n), .ledGpio = (n), .channel = (n), .timer = 0,                  \
+                      .holdTimeMs = CONFIG_LIGHT_OCCUPANCY_HOLD_TIME_S * 1000, .maxDuty = 0x3FF,     \
+                      .brightness = BRIGHTNESS_FROM_PERCENT(CONFIG_LIGHT_BRIGHTNESS_PERCENT),       \
+                      .schedule = NULL }
+
+const zone_config_t g_zone_table[] = {
+    SIM_ZONE(0), SIM_ZONE(1), SIM_ZONE(2), SIM_ZONE(3), SIM_ZONE(4), SIM_ZONE(5), SIM_ZONE(6), SIM_ZONE(7),
+};
+
+const uint8_t g_zone_count = sizeof(g_zone_table) / sizeof(g_zone_table[0]);
+
+_Static_assert(sizeof(g_zone_table) / sizeof(g_zone_table[0]) == ZONE_MAX, "One row per zone");
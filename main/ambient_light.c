@@ -0,0 +1,242 @@
+/*******************************************************************************************
+Ambient Light
+
+A photo sensor (a TEMT6000 style phototransistor into a load resistor, so the voltage is
+proportional to the illuminance) on an ADC1 channel, read with the ADC continuous driver.
+Every CONFIG_LIGHT_AMBIENT_INTERVAL_S a batch of AMBIENT_BATCH_SAMPLES conversions is taken
+by DMA at AMBIENT_SAMPLE_HZ, 100 ms that average out the flicker of 50 and 60 Hz lighting,
+and the ADC is stopped again so it does not hold off light sleep in between.
+
+The conversion-done callback sums the DMA frames and compares the batch average against the
+dark and bright thresholds, which were turned into raw ADC counts once at start. Only when the
+level crosses one of them, with the hysteresis between the two, is a LIGHT_EVENT_AMBIENT
+posted; the lighting task is not woken for anything else. The first batch after start is
+always posted so the gate starts from a measurement.
+
+The sensor may also see the fixtures' own light. The controller does not let daylight close
+the gate of a lit zone, it closes once the zone's hold has run out (light_controller.c).
+
+Built with CONFIG_LIGHT_AMBIENT_SENSOR.
+
+********************************************************************************************/
+#include "ambient_light.h"
+#include "esp_adc/adc_continuous.h"
+#include "esp_adc/adc_cali.h"
+#include "esp_adc/adc_cali_scheme.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "soc/soc_caps.h"
+
+#ifdef CONFIG_LIGHT_AMBIENT_SENSOR
+
+static const char *TAG = "ambient";
+
+#define AMBIENT_SAMPLE_HZ 20000
+#define AMBIENT_BATCH_SAMPLES 2000      /* 100 ms, five 50 Hz and six 60 Hz periods */
+#define AMBIENT_FRAME_SAMPLES 500
+#define AMBIENT_FRAME_BYTES (AMBIENT_FRAME_SAMPLES * SOC_ADC_DIGI_RESULT_BYTES)
+#define AMBIENT_STOP_DELAY_US 150000    /* Batch time plus margin */
+#define AMBIENT_RAW_MAX 4095
+#define AMBIENT_FULL_SCALE_MV 3100      /* Nominal range at 12 dB without calibration */
+
+#if (CONFIG_LIGHT_AMBIENT_BRIGHT_LUX <= CONFIG_LIGHT_AMBIENT_DARK_LUX)
+#error "CONFIG_LIGHT_AMBIENT_BRIGHT_LUX must be above CONFIG_LIGHT_AMBIENT_DARK_LUX"
+#endif
+
+static QueueHandle_t s_event_queue;
+static adc_continuous_handle_t s_adc;
+static adc_cali_handle_t s_cali = NULL;
+static esp_timer_handle_t s_sample_timer;
+static esp_timer_handle_t s_stop_timer;
+
+/* Batch state, owned by the conversion-done callback while the ADC runs */
+static uint32_t s_sum;
+static uint32_t s_count;
+static uint32_t s_dark_raw;
+static uint32_t s_bright_raw;
+static bool s_dark = true;
+static bool s_reported = false;
+static volatile uint32_t s_last_raw = 0;
+
+static uint32_t raw_to_mv(uint32_t raw)
+{
+    int mv;
+
+    if ((s_cali != NULL) && (adc_cali_raw_to_voltage(s_cali, (int)raw, &mv) == ESP_OK))
+    {
+        return (uint32_t)mv;
+    }
+    return raw * AMBIENT_FULL_SCALE_MV / AMBIENT_RAW_MAX;
+}
+
+static uint32_t raw_to_lux(uint32_t raw)
+{
+    return (uint32_t)((uint64_t)raw_to_mv(raw) * 1000 / CONFIG_LIGHT_AMBIENT_UV_PER_LUX);
+}
+
+static uint32_t lux_to_raw(uint32_t lux)
+{
+    /* This function returns the lowest raw reading of at least 'lux', by bisection over the
+       monotonic raw to voltage conversion */
+    uint32_t low = 0;
+    uint32_t high = AMBIENT_RAW_MAX;
+
+    while (low < high)
+    {
+        uint32_t mid = (low + high) / 2;
+        if (raw_to_lux(mid) < lux)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static bool IRAM_ATTR conv_done_cb(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *edata, void *user_data)
+{
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+
+    if (s_count >= AMBIENT_BATCH_SAMPLES)
+    {
+        return false;
+    }
+    for (uint32_t i = 0; (i < edata->size) && (s_count < AMBIENT_BATCH_SAMPLES); i += SOC_ADC_DIGI_RESULT_BYTES)
+    {
+        const adc_digi_output_data_t *sample = (const adc_digi_output_data_t *)&edata->conv_frame_buffer[i];
+        s_sum += sample->type1.data;
+        s_count++;
+    }
+    if (s_count < AMBIENT_BATCH_SAMPLES)
+    {
+        return false;
+    }
+
+    uint32_t average = s_sum / s_count;
+    bool dark = s_dark ? (average < s_bright_raw) : (average <= s_dark_raw);
+    s_last_raw = average;
+    if ((dark != s_dark) || !s_reported)
+    {
+        light_event_t event = {
+            .type = LIGHT_EVENT_AMBIENT,
+            .timestamp_us = esp_timer_get_time(),
+            .value = average | (dark ? AMBIENT_LIGHT_DARK : 0),
+        };
+        if (xQueueSendFromISR(s_event_queue, &event, &higherPriorityTaskWoken) == pdTRUE)
+        {
+            s_dark = dark;
+            s_reported = true;
+        }
+    }
+    return higherPriorityTaskWoken == pdTRUE;
+}
+
+static void sample_timer_cb(void *arg)
+{
+    /* Starts a batch, the stop timer ends it */
+    s_sum = 0;
+    s_count = 0;
+    if (adc_continuous_start(s_adc) == ESP_OK)
+    {
+        esp_timer_start_once(s_stop_timer, AMBIENT_STOP_DELAY_US);
+    }
+}
+
+static void stop_timer_cb(void *arg)
+{
+    adc_continuous_stop(s_adc);
+}
+
+static void init_calibration(void)
+{
+#if ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
+    adc_cali_line_fitting_config_t config = {
+        .unit_id = ADC_UNIT_1,
+        .atten = ADC_ATTEN_DB_12,
+        .bitwidth = ADC_BITWIDTH_12,
+    };
+
+    if (adc_cali_create_scheme_line_fitting(&config, &s_cali) != ESP_OK)
+    {
+        s_cali = NULL;
+    }
+#endif
+    if (s_cali == NULL)
+    {
+        ESP_LOGW(TAG, "No ADC calibration, using the nominal %d mV range", AMBIENT_FULL_SCALE_MV);
+    }
+}
+
+void ambient_light_start(QueueHandle_t eventQueue)
+{
+    /* This function sets up the ADC and starts the periodic batches. Threshold crossings are
+       posted on eventQueue. */
+    adc_continuous_handle_cfg_t handleConfig = {
+        .max_store_buf_size = 4 * AMBIENT_FRAME_BYTES,
+        .conv_frame_size = AMBIENT_FRAME_BYTES,
+    };
+    adc_digi_pattern_config_t pattern = {
+        .atten = ADC_ATTEN_DB_12,
+        .channel = CONFIG_LIGHT_AMBIENT_ADC_CHANNEL,
+        .unit = ADC_UNIT_1,
+        .bit_width = ADC_BITWIDTH_12,
+    };
+    adc_continuous_config_t config = {
+        .pattern_num = 1,
+        .adc_pattern = &pattern,
+        .sample_freq_hz = AMBIENT_SAMPLE_HZ,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1,
+    };
+    adc_continuous_evt_cbs_t callbacks = {
+        .on_conv_done = conv_done_cb,
+    };
+    const esp_timer_create_args_t sampleArgs = {
+        .callback = sample_timer_cb,
+        .name = "ambient_sample",
+    };
+    const esp_timer_create_args_t stopArgs = {
+        .callback = stop_timer_cb,
+        .name = "ambient_stop",
+    };
+
+    s_event_queue = eventQueue;
+    init_calibration();
+    s_dark_raw = lux_to_raw(CONFIG_LIGHT_AMBIENT_DARK_LUX);
+    s_bright_raw = lux_to_raw(CONFIG_LIGHT_AMBIENT_BRIGHT_LUX);
+
+    ESP_ERROR_CHECK(adc_continuous_new_handle(&handleConfig, &s_adc));
+    ESP_ERROR_CHECK(adc_continuous_config(s_adc, &config));
+    ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(s_adc, &callbacks, NULL));
+    ESP_ERROR_CHECK(esp_timer_create(&sampleArgs, &s_sample_timer));
+    ESP_ERROR_CHECK(esp_timer_create(&stopArgs, &s_stop_timer));
+
+    sample_timer_cb(NULL);
+    ESP_ERROR_CHECK(esp_timer_start_periodic(s_sample_timer, (uint64_t)CONFIG_LIGHT_AMBIENT_INTERVAL_S * 1000000));
+    ESP_LOGI(TAG, "Light sensor on ADC1 channel %d: dark below %d lux (raw %lu), daylight above %d lux (raw %lu)",
+             CONFIG_LIGHT_AMBIENT_ADC_CHANNEL, CONFIG_LIGHT_AMBIENT_DARK_LUX, (unsigned long)s_dark_raw,
+             CONFIG_LIGHT_AMBIENT_BRIGHT_LUX, (unsigned long)s_bright_raw);
+}
+
+bool ambient_light_handle_event(const light_event_t *event)
+{
+    /* This function logs a threshold crossing and returns whether it is dark now */
+    uint32_t raw = event->value & ~AMBIENT_LIGHT_DARK;
+    bool dark = (event->value & AMBIENT_LIGHT_DARK) != 0;
+
+    ESP_LOGI(TAG, "Ambient light %lu lux (%lu mV): %s", (unsigned long)raw_to_lux(raw),
+             (unsigned long)raw_to_mv(raw), dark ? "dark" : "daylight");
+    return dark;
+}
+
+uint32_t ambient_light_lux(void)
+{
+    /* This function returns the level of the last batch */
+    return raw_to_lux(s_last_raw);
+}
+
+#endif /* CONFIG_LIGHT_AMBIENT_SENSOR */
@@ -0,0 +1,17 @@
+#ifndef _AMBIENT_LIGHT_H_
+#define _AMBIENT_LIGHT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "light_events.h"
+
+/* Set in the value of a LIGHT_EVENT_AMBIENT when the level is below the dark threshold */
+#define AMBIENT_LIGHT_DARK 0x80000000u
+
+void ambient_light_start(QueueHandle_t eventQueue);
+bool ambient_light_handle_event(const light_event_t *event);
+uint32_t ambient_light_lux(void);
+
+#endif /* _AMBIENT_LIGHT_H_ */
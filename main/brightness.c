@@ -0,0 +1,106 @@
+/*******************************************************************************************
+Brightness
+
+Perceptual brightness. The eye responds to lightness, not to luminance: on a linear duty ramp
+nearly all of the visible change happens in the first few percent. Levels 0-255 are spaced
+evenly in CIE 1931 lightness L* and mapped to luminance with
+
+    Y = L* / 903.3                      for L* <= 8
+    Y = ((L* + 16) / 116)^3             otherwise
+
+The table is a constant expression evaluated by the compiler, kept at 16 bits so one table
+serves every LEDC duty resolution; brightness_to_duty() scales it to the channel's full-scale
+duty.
+
+********************************************************************************************/
+#include "brightness.h"
+
+#define CIE_LIGHTNESS(level) ((level) * 100.0 / BRIGHTNESS_MAX)
+#define CIE_CUBE(x) ((x) * (x) * (x))
+#define CIE_LUMINANCE(l) (((l) <= 8.0) ? ((l) / 903.3) : CIE_CUBE(((l) + 16.0) / 116.0))
+#define CIE_ENTRY(level) ((uint16_t)(CIE_LUMINANCE(CIE_LIGHTNESS(level)) * 65535.0 + 0.5))
+#define CIE_ROW(level) CIE_ENTRY((level) + 0), CIE_ENTRY((level) + 1), CIE_ENTRY((level) + 2), \
+                       CIE_ENTRY((level) + 3), CIE_ENTRY((level) + 4), CIE_ENTRY((level) + 5), \
+                       CIE_ENTRY((level) + 6), CIE_ENTRY((level) + 7)
+
+const uint16_t g_brightness_cie1931[BRIGHTNESS_MAX + 1] = {
+    CIE_ROW(0),
+    CIE_ROW(8),
+    CIE_ROW(16),
+    CIE_ROW(24),
+    CIE_ROW(32),
+    CIE_ROW(40),
+    CIE_ROW(48),
+    CIE_ROW(56),
+    CIE_ROW(64),
+    CIE_ROW(72),
+    CIE_ROW(80),
+    CIE_ROW(88),
+    CIE_ROW(96),
+    CIE_ROW(104),
+    CIE_ROW(112),
+    CIE_ROW(120),
+    CIE_ROW(128),
+    CIE_ROW(136),
+    CIE_ROW(144),
+    CIE_ROW(152),
+    CIE_ROW(160),
+    CIE_ROW(168),
+    CIE_ROW(176),
+    CIE_ROW(184),
+    CIE_ROW(192),
+    CIE_ROW(200),
+    CIE_ROW(208),
+    CIE_ROW(216),
+    CIE_ROW(224),
+    CIE_ROW(232),
+    CIE_ROW(240),
+    CIE_ROW(248),
+};
+
+_Static_assert(sizeof(g_brightness_cie1931) / sizeof(g_brightness_cie1931[0]) == BRIGHTNESS_MAX + 1,
+               "One table entry per level");
+
+uint32_t brightness_to_duty(uint8_t level, uint32_t maxDuty)
+{
+    /* This function returns the duty for a level at a channel's full-scale duty. Every level
+       above 0 gets at least the smallest duty so the light never goes out before level 0. */
+    uint32_t duty = (uint32_t)(((uint64_t)g_brightness_cie1931[level] * maxDuty + 0x7FFF) / 0xFFFF);
+
+    if ((duty == 0) && (level > 0))
+    {
+        duty = 1;
+    }
+    return duty;
+}
+
+uint8_t brightness_from_duty(uint32_t duty, uint32_t maxDuty)
+{
+    /* This function returns the lowest level that is at least as bright as duty, for picking
+       up a fade from a duty read back from the hardware */
+    uint16_t low = 0;
+    uint16_t high = BRIGHTNESS_MAX;
+
+    while (low < high)
+    {
+        uint16_t mid = (low + high) / 2;
+        if (brightness_to_duty(mid, maxDuty) < duty)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return (uint8_t)low;
+}
+
+uint8_t brightness_from_percent(uint8_t percent)
+{
+    if (percent > 100)
+    {
+        percent = 100;
+    }
+    return BRIGHTNESS_FROM_PERCENT(percent);
+}
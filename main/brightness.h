@@ -0,0 +1,17 @@
+#ifndef _BRIGHTNESS_H_
+#define _BRIGHTNESS_H_
+
+#include <stdint.h>
+
+/* Perceptual brightness levels, 0 is off and BRIGHTNESS_MAX is full scale */
+#define BRIGHTNESS_MAX 255
+#define BRIGHTNESS_FROM_PERCENT(percent) ((uint8_t)(((percent) * BRIGHTNESS_MAX + 50) / 100))
+
+/* CIE 1931 lightness to relative luminance, full scale 0xFFFF, one entry per level */
+extern const uint16_t g_brightness_cie1931[BRIGHTNESS_MAX + 1];
+
+uint32_t brightness_to_duty(uint8_t level, uint32_t maxDuty);
+uint8_t brightness_from_duty(uint32_t duty, uint32_t maxDuty);
+uint8_t brightness_from_percent(uint8_t percent);
+
+#endif /* _BRIGHTNESS_H_ */
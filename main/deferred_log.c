@@ -0,0 +1,136 @@
+/*******************************************************************************************
+Deferred Log
+
+A ring of log entries that are only formatted when somebody reads them. Putting an entry
+stores the format string (a literal), its arguments and a timestamp; no printf, no
+strftime and no UART output happen on the caller's path. The `log` console command drains
+the ring, which is where the entries are formatted and times are turned into local time. An
+unread ring simply overwrites its oldest entries.
+
+Writers claim a slot with an atomic increment and publish it through the slot's sequence
+number, so any task may write without a lock. There is one reader, the console task; an entry
+overwritten while it is being read is counted as lost. The reader stops at an entry that is
+still being written and picks it up on the next drain.
+
+********************************************************************************************/
+#include "deferred_log.h"
+#include <stdbool.h>
+#include "esp_timer.h"
+
+#define DEFERRED_LOG_MASK (DEFERRED_LOG_ENTRIES - 1)
+#define DEFERRED_LOG_LINE_LEN 128
+
+_Static_assert((DEFERRED_LOG_ENTRIES & DEFERRED_LOG_MASK) == 0, "DEFERRED_LOG_ENTRIES must be a power of two");
+
+typedef struct
+{
+    uint32_t sequence;              /* Index + 1 once written, 0 while being written */
+    bool isTime;                    /* The argument is a time_t printed as local time with %s */
+    const char *format;
+    int64_t timestampUs;
+    long args[2];
+    time_t when;
+} deferred_log_entry_t;
+
+static deferred_log_entry_t s_entries[DEFERRED_LOG_ENTRIES];
+static uint32_t s_head = 0;         /* Next index to be claimed */
+static uint32_t s_tail = 0;         /* Next index to be read, reader only */
+
+static deferred_log_entry_t *claim(uint32_t *index)
+{
+    *index = __atomic_fetch_add(&s_head, 1, __ATOMIC_RELAXED);
+    deferred_log_entry_t *entry = &s_entries[*index & DEFERRED_LOG_MASK];
+
+    __atomic_store_n(&entry->sequence, 0, __ATOMIC_RELAXED);
+    /* The entry is marked as being written before any of it changes */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    entry->timestampUs = esp_timer_get_time();
+    return entry;
+}
+
+static void publish(deferred_log_entry_t *entry, uint32_t index)
+{
+    __atomic_store_n(&entry->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+void deferred_log_put(const char *format, long arg0, long arg1)
+{
+    /* This function logs a format with up to two long arguments */
+    uint32_t index;
+    deferred_log_entry_t *entry = claim(&index);
+
+    entry->isTime = false;
+    entry->format = format;
+    entry->args[0] = arg0;
+    entry->args[1] = arg1;
+    publish(entry, index);
+}
+
+void deferred_log_put_time(const char *format, time_t when)
+{
+    /* This function logs a format with one %s, which becomes 'when' in local time */
+    uint32_t index;
+    deferred_log_entry_t *entry = claim(&index);
+
+    entry->isTime = true;
+    entry->format = format;
+    entry->when = when;
+    publish(entry, index);
+}
+
+uint32_t deferred_log_drain(FILE *out)
+{
+    /* This function formats every entry not read yet to 'out' and returns how many there were.
+       It stops at the first entry that was claimed but not published yet. */
+    uint32_t head = __atomic_load_n(&s_head, __ATOMIC_ACQUIRE);
+    uint32_t lost = 0;
+    uint32_t printed = 0;
+
+    if (head - s_tail > DEFERRED_LOG_ENTRIES)
+    {
+        lost += head - DEFERRED_LOG_ENTRIES - s_tail;
+        s_tail = head - DEFERRED_LOG_ENTRIES;
+    }
+    for (; s_tail != head; s_tail++)
+    {
+        deferred_log_entry_t *slot = &s_entries[s_tail & DEFERRED_LOG_MASK];
+        uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        deferred_log_entry_t entry;
+        char line[DEFERRED_LOG_LINE_LEN];
+
+        /* Still being written: 0, or the sequence of the lap before when the writer has not
+           cleared it yet */
+        if ((sequence == 0) || ((int32_t)(sequence - (s_tail + 1)) < 0))
+        {
+            break;
+        }
+        entry = *slot;
+        /* The copy is complete before the sequence is read again */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        /* Overwritten before or while it was copied */
+        if ((sequence != s_tail + 1) || (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence))
+        {
+            lost++;
+            continue;
+        }
+        if (entry.isTime)
+        {
+            struct tm timeinfo;
+            char timeText[64];
+            localtime_r(&entry.when, &timeinfo);
+            strftime(timeText, sizeof(timeText), "%c", &timeinfo);
+            snprintf(line, sizeof(line), entry.format, timeText);
+        }
+        else
+        {
+            snprintf(line, sizeof(line), entry.format, entry.args[0], entry.args[1]);
+        }
+        fprintf(out, "(%lld) %s\n", (long long)(entry.timestampUs / 1000), line);
+        printed++;
+    }
+    if (lost > 0)
+    {
+        fprintf(out, "%lu entries lost\n", (unsigned long)lost);
+    }
+    return printed;
+}
@@ -0,0 +1,15 @@
+#ifndef _DEFERRED_LOG_H_
+#define _DEFERRED_LOG_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Entries kept, older ones are overwritten. A power of two. */
+#define DEFERRED_LOG_ENTRIES 32
+
+void deferred_log_put(const char *format, long arg0, long arg1);
+void deferred_log_put_time(const char *format, time_t when);
+uint32_t deferred_log_drain(FILE *out);
+
+#endif /* _DEFERRED_LOG_H_ */
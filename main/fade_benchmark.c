@@ -0,0 +1,136 @@
+/*******************************************************************************************
+Fade Benchmark
+
+Compares the ways of fading a zone's LED up and back down, counting LEDC updates and the CPU
+time spent issuing them:
+
+  - the original linear loop, one ledc_set_duty()/ledc_update_duty() pair per duty count
+    (it slept one tick between writes, which is left out here so only CPU time is measured),
+  - LED_FADE_STEPS perceptually even writes through the brightness table,
+  - the fade engine, LED_FADE_STEPS hardware segments driven from fade-end events.
+
+Built with CONFIG_LIGHT_FADE_BENCHMARK; it runs from app_main() before the lighting task is
+started, so it owns the event queue while it runs.
+
+********************************************************************************************/
+#include "fade_benchmark.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/ledc.h"
+#include "zone.h"
+#include "brightness.h"
+#include "led_fade.h"
+
+static const char *TAG = "fade_benchmark";
+
+#define BENCH_FADE_TIME_MS 2000
+#define BENCH_EVENT_TIMEOUT_MS 1000
+
+static void report(const char *name, uint32_t updates, int64_t cpuUs, int64_t wallMs)
+{
+    ESP_LOGI(TAG, "%s: %lu updates, %lld us CPU, %lld ms", name, (unsigned long)updates, cpuUs, wallMs);
+}
+
+static void run_linear_loop(uint8_t zone)
+{
+    const zone_config_t *config = &g_zone_table[zone];
+    uint32_t updates = 0;
+    int64_t cpuUs = 0;
+    int64_t start;
+
+    for (uint32_t duty = 0; duty <= config->maxDuty; duty++)
+    {
+        start = esp_timer_get_time();
+        ledc_set_duty(ZONE_LEDC_SPEED_MODE, config->channel, duty);
+        ledc_update_duty(ZONE_LEDC_SPEED_MODE, config->channel);
+        cpuUs += esp_timer_get_time() - start;
+        updates++;
+    }
+    for (uint32_t duty = config->maxDuty; duty > 0; duty--)
+    {
+        start = esp_timer_get_time();
+        ledc_set_duty(ZONE_LEDC_SPEED_MODE, config->channel, duty - 1);
+        ledc_update_duty(ZONE_LEDC_SPEED_MODE, config->channel);
+        cpuUs += esp_timer_get_time() - start;
+        updates++;
+    }
+
+    /* The loop waited one tick per write */
+    report("Linear loop", updates, cpuUs, (int64_t)updates * portTICK_PERIOD_MS);
+}
+
+static void run_perceptual_steps(uint8_t zone)
+{
+    const zone_config_t *config = &g_zone_table[zone];
+    uint32_t updates = 0;
+    int64_t cpuUs = 0;
+    int64_t start;
+
+    for (int step = 1; step <= 2 * LED_FADE_STEPS; step++)
+    {
+        int position = (step <= LED_FADE_STEPS) ? step : (2 * LED_FADE_STEPS - step);
+        int level = position * LED_FADE_STEP_LEVELS;
+        level = (level > BRIGHTNESS_MAX) ? BRIGHTNESS_MAX : level;
+        start = esp_timer_get_time();
+        ledc_set_duty_and_update(ZONE_LEDC_SPEED_MODE, config->channel,
+                                 brightness_to_duty((uint8_t)level, config->maxDuty), 0);
+        cpuUs += esp_timer_get_time() - start;
+        updates++;
+        vTaskDelay(pdMS_TO_TICKS(BENCH_FADE_TIME_MS / LED_FADE_STEPS));
+    }
+
+    report("Perceptual steps", updates, cpuUs, 2 * BENCH_FADE_TIME_MS);
+}
+
+static bool run_engine_fade(QueueHandle_t eventQueue, uint8_t zone, uint8_t level, int64_t *cpuUs)
+{
+    /* This function runs one fade of the engine to completion and adds the time spent in the
+       engine to cpuUs. It returns false if a fade-end event did not arrive. */
+    light_event_t event;
+    int64_t start = esp_timer_get_time();
+
+    led_fade_to(zone, level, BENCH_FADE_TIME_MS);
+    *cpuUs += esp_timer_get_time() - start;
+    while (led_fade_level(zone) != level)
+    {
+        if (xQueueReceive(eventQueue, &event, pdMS_TO_TICKS(BENCH_EVENT_TIMEOUT_MS)) != pdTRUE)
+        {
+            return false;
+        }
+        start = esp_timer_get_time();
+        led_fade_handle_event(&event);
+        *cpuUs += esp_timer_get_time() - start;
+    }
+    return true;
+}
+
+static void run_engine(QueueHandle_t eventQueue, uint8_t zone)
+{
+    led_fade_stats_t before;
+    led_fade_stats_t after;
+    int64_t cpuUs = 0;
+    int64_t start = esp_timer_get_time();
+
+    led_fade_get_stats(zone, &before);
+    if (!run_engine_fade(eventQueue, zone, BRIGHTNESS_MAX, &cpuUs) ||
+        !run_engine_fade(eventQueue, zone, 0, &cpuUs))
+    {
+        ESP_LOGE(TAG, "Fade engine: fade end event missing");
+        return;
+    }
+    led_fade_get_stats(zone, &after);
+
+    report("Fade engine", (after.segments - before.segments) + (after.writes - before.writes), cpuUs,
+           (esp_timer_get_time() - start) / 1000);
+}
+
+void fade_benchmark_run(QueueHandle_t eventQueue, uint8_t zone)
+{
+    /* This function fades the zone up and down once per method and logs the results */
+    ESP_LOGI(TAG, "Full-scale fade up and down, %lu duty counts, %d perceptual steps",
+             (unsigned long)g_zone_table[zone].maxDuty, LED_FADE_STEPS);
+    run_linear_loop(zone);
+    run_perceptual_steps(zone);
+    run_engine(eventQueue, zone);
+    led_fade_set(zone, 0);
+}
@@ -0,0 +1,10 @@
+#ifndef _FADE_BENCHMARK_H_
+#define _FADE_BENCHMARK_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+void fade_benchmark_run(QueueHandle_t eventQueue, uint8_t zone);
+
+#endif /* _FADE_BENCHMARK_H_ */
@@ -0,0 +1,144 @@
+/*******************************************************************************************
+Fast Boot
+
+Keeps the last SNTP sync and the measured clock drift in RTC slow memory, which survives every
+reset except power-on. On a warm reset (watchdog, panic, brownout, software reset or deep sleep
+wake) the running RTC clock is trusted if the record is intact and the drift accumulated since
+the last sync stays within CONFIG_LIGHT_FAST_BOOT_MAX_ERROR_S, so the next sync can wait for
+its regular slot instead of holding up the start.
+
+********************************************************************************************/
+#include "fast_boot.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+static const char *TAG = "fast_boot";
+
+#define FAST_BOOT_MAGIC 0x4C415442      /* "LATB" */
+
+typedef struct
+{
+    uint32_t magic;
+    int64_t lastSyncUs;             /* Wall clock of the last sync, microseconds since the epoch */
+    int32_t driftPpb;               /* Clock error per elapsed time, positive when running slow */
+    uint32_t crc;
+} fast_boot_record_t;
+
+static RTC_NOINIT_ATTR fast_boot_record_t s_record;
+
+/* Last sync of this boot against the monotonic timer, for the drift estimate */
+static int64_t s_sync_wall_us = 0;
+static int64_t s_sync_mono_us = 0;
+static bool s_clock_trusted = false;
+
+static uint32_t record_crc(const fast_boot_record_t *record)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)record, offsetof(fast_boot_record_t, crc));
+}
+
+static bool record_valid(void)
+{
+    return (s_record.magic == FAST_BOOT_MAGIC) && (s_record.crc == record_crc(&s_record));
+}
+
+static bool warm_reset(esp_reset_reason_t reason)
+{
+    switch (reason)
+    {
+        case ESP_RST_SW:
+        case ESP_RST_PANIC:
+        case ESP_RST_INT_WDT:
+        case ESP_RST_TASK_WDT:
+        case ESP_RST_WDT:
+        case ESP_RST_BROWNOUT:
+        case ESP_RST_DEEPSLEEP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool fast_boot_init(void)
+{
+    /* This function decides whether the clock kept through the reset can be trusted. It returns
+       true for a trusted warm boot. */
+    esp_reset_reason_t reason = esp_reset_reason();
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    int64_t nowUs = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+
+    if (!warm_reset(reason) || !record_valid() || (nowUs < s_record.lastSyncUs))
+    {
+        ESP_LOGI(TAG, "Cold boot (reset reason %d)", reason);
+        return false;
+    }
+
+    int64_t ageS = (nowUs - s_record.lastSyncUs) / 1000000;
+    int64_t errorMs = llabs((int64_t)s_record.driftPpb) * ageS / 1000000;
+    s_clock_trusted = (errorMs <= (int64_t)CONFIG_LIGHT_FAST_BOOT_MAX_ERROR_S * 1000);
+    ESP_LOGI(TAG, "Warm boot (reset reason %d), last sync %lld s ago, estimated error %lld ms: clock %s",
+             reason, ageS, errorMs, s_clock_trusted ? "trusted" : "needs sync");
+    return s_clock_trusted;
+}
+
+bool fast_boot_clock_trusted(void)
+{
+    return s_clock_trusted;
+}
+
+void fast_boot_record_sync(const struct timeval *tv)
+{
+    /* This function stores a completed sync. The drift is the error the monotonic timer, which
+       the system clock runs on between syncs, built up since the previous sync of this boot. */
+    int64_t monoUs = esp_timer_get_time();
+    int64_t wallUs = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+
+    if (!record_valid())
+    {
+        s_record.driftPpb = 0;
+    }
+    if (s_sync_mono_us != 0)
+    {
+        int64_t elapsedUs = monoUs - s_sync_mono_us;
+        int64_t errorUs = (wallUs - s_sync_wall_us) - elapsedUs;
+        if (elapsedUs > 0)
+        {
+            s_record.driftPpb = (int32_t)((errorUs * 1000000000) / elapsedUs);
+        }
+    }
+    s_sync_wall_us = wallUs;
+    s_sync_mono_us = monoUs;
+
+    s_record.magic = FAST_BOOT_MAGIC;
+    s_record.lastSyncUs = wallUs;
+    s_record.crc = record_crc(&s_record);
+    s_clock_trusted = true;
+}
+
+uint32_t fast_boot_sync_delay_s(uint32_t resyncIntervalS)
+{
+    /* This function returns how long the first sync of this boot can wait: until the regular
+       resync slot after a trusted warm boot, otherwise not at all */
+    if (!s_clock_trusted || !record_valid())
+    {
+        return 0;
+    }
+
+    int64_t ageS = ((int64_t)time(NULL) * 1000000 - s_record.lastSyncUs) / 1000000;
+    return (ageS >= resyncIntervalS) ? 0 : (uint32_t)(resyncIntervalS - ageS);
+}
+
+void fast_boot_log_ready(void)
+{
+    /* Time from the start of the application (esp_timer starts at app startup, the bootloader
+       is not included) until the lighting task serves motion */
+    ESP_LOGI(TAG, "Boot to ready: %lld ms (%s)", esp_timer_get_time() / 1000,
+             s_clock_trusted ? "warm, clock trusted" : "clock not trusted");
+}
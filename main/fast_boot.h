@@ -0,0 +1,14 @@
+#ifndef _FAST_BOOT_H_
+#define _FAST_BOOT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+bool fast_boot_init(void);
+bool fast_boot_clock_trusted(void);
+void fast_boot_record_sync(const struct timeval *tv);
+uint32_t fast_boot_sync_delay_s(uint32_t resyncIntervalS);
+void fast_boot_log_ready(void);
+
+#endif /* _FAST_BOOT_H_ */
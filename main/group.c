@@ -0,0 +1,373 @@
+/*******************************************************************************************
+Group
+
+Neighbouring fixtures that share a group id tell each other about motion. Every motion the
+controller accepts goes out as one small UDP packet to a multicast group on the LAN; the boards
+that hear it pre-light their zones at CONFIG_LIGHT_GROUP_PRELIGHT_PERCENT and hold them for the
+sender's hold time, so a corridor is lit ahead of whoever walks it.
+
+Sending is a non-blocking sendto() from the lighting task, sent twice back to back since the
+LAN may drop a multicast frame and there is no acknowledgement. A zone sends at most once per
+CONFIG_LIGHT_GROUP_MIN_INTERVAL_MS and the board at most GROUP_RATE_PER_S a second, so a busy
+sensor can not flood the network; the hold sent is stretched by the interval to cover the
+motion that was not sent. Receivers drop the repeats by the sender's sequence number.
+
+A packet carries the sender's wall clock; with both clocks synced the receiver measures how long
+it was on the way (METRIC_GROUP_LATENCY_US, and the journal). The accuracy is that of SNTP, a
+few ms on a LAN; on the linux target the instances share one clock.
+
+********************************************************************************************/
+#include "group.h"
+#include <string.h>
+#ifdef CONFIG_LIGHT_GROUP
+#include <errno.h>
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "light_hal.h"
+#include "journal.h"
+#include "metrics.h"
+#ifdef CONFIG_IDF_TARGET_LINUX
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#else
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "lwip/sockets.h"
+#endif
+
+static const char *TAG = "group";
+
+#define GROUP_MAGIC 0x474C              /* "LG" */
+#define GROUP_VERSION 1
+#define GROUP_COPIES 2                  /* Every packet is sent this often */
+#define GROUP_RATE_PER_S 4              /* Board wide packets a second, after a burst of GROUP_BURST */
+#define GROUP_BURST 4
+#define GROUP_MAX_PEERS 16              /* Senders remembered for the duplicate check */
+#define GROUP_CLOCK_VALID 0x01          /* Packet flag: the sender's clock is synced */
+#define GROUP_TASK_STACK_SIZE 3072
+#define GROUP_TASK_PRIORITY 6           /* Above time_sync and the HTTP API, below the lighting task */
+#define GROUP_TASK_CORE 0
+#define GROUP_POLL_MS 1
+
+/* On the wire, little endian as both the chip and the hosts store it */
+typedef struct __attribute__((packed))
+{
+    uint16_t magic;
+    uint8_t version;
+    uint8_t group;                  /* CONFIG_LIGHT_GROUP_ID of the sender */
+    uint32_t sender;                /* Node id, the low bytes of the station MAC */
+    uint16_t boot;                  /* Random per boot, restarts the sequence */
+    uint16_t sequence;              /* Per packet, the same in its repeats */
+    uint8_t zone;                   /* Sender's zone that saw the motion */
+    uint8_t flags;
+    uint16_t edgeAgeUs;             /* Sensor edge to sending (capped) */
+    uint32_t holdMs;                /* How long receivers hold their zones */
+    uint32_t sentS;                 /* Sender's wall clock when sending */
+    uint32_t sentUs;
+} group_packet_t;
+
+typedef struct
+{
+    uint32_t sender;
+    uint16_t boot;
+    uint16_t sequence;              /* Newest one taken */
+    int64_t heardUs;                /* 0 for a free slot */
+} group_peer_t;
+
+static int s_socket = -1;
+static struct sockaddr_in s_address;
+static uint32_t s_node_id;
+static uint16_t s_boot;
+static uint16_t s_sequence = 0;
+static int64_t s_zone_sent_us[ZONE_MAX];
+static int64_t s_rate_due_us = 0;   /* Virtual time of the board wide rate limit */
+static group_peer_t s_peers[GROUP_MAX_PEERS];
+static group_stats_t s_stats;
+
+static bool rate_allows(uint8_t zone, int64_t nowUs)
+{
+    /* This function applies the rate limits to a packet about to be sent: the zone's minimum
+       interval, then GROUP_BURST packets at once and GROUP_RATE_PER_S on average for the board */
+    const int64_t periodUs = 1000000 / GROUP_RATE_PER_S;
+
+    if ((s_zone_sent_us[zone] != 0) && (nowUs - s_zone_sent_us[zone] < CONFIG_LIGHT_GROUP_MIN_INTERVAL_MS * 1000LL))
+    {
+        return false;
+    }
+    if (s_rate_due_us < nowUs)
+    {
+        s_rate_due_us = nowUs;
+    }
+    if (s_rate_due_us - nowUs > (GROUP_BURST - 1) * periodUs)
+    {
+        return false;
+    }
+    s_rate_due_us += periodUs;
+    s_zone_sent_us[zone] = nowUs;
+    return true;
+}
+
+static bool take_sequence(const group_packet_t *packet, int64_t nowUs)
+{
+    /* This function tells a first copy from a repeat. A sender's sequence only grows within a
+       boot, anything not newer than the last one taken has been seen. An unknown sender gets a
+       free slot or the one heard from longest ago. */
+    group_peer_t *peer = NULL;
+    group_peer_t *oldest = &s_peers[0];
+
+    for (uint8_t i = 0; i < GROUP_MAX_PEERS; i++)
+    {
+        if ((s_peers[i].heardUs != 0) && (s_peers[i].sender == packet->sender))
+        {
+            peer = &s_peers[i];
+            break;
+        }
+        if (s_peers[i].heardUs < oldest->heardUs)
+        {
+            oldest = &s_peers[i];
+        }
+    }
+
+    if ((peer != NULL) && (peer->boot == packet->boot) && ((int16_t)(packet->sequence - peer->sequence) <= 0))
+    {
+        return false;
+    }
+    if (peer == NULL)
+    {
+        peer = oldest;
+        peer->sender = packet->sender;
+    }
+    peer->boot = packet->boot;
+    peer->sequence = packet->sequence;
+    peer->heardUs = nowUs;
+    return true;
+}
+
+static void handle_packet(const group_packet_t *packet, int64_t receivedUs)
+{
+    /* This function takes a packet of a neighbour: the zones are told about it through the
+       lighting queue, the latency is measured when both clocks are synced */
+    struct timeval now;
+    uint32_t latencyUs = 0;
+
+    if (!take_sequence(packet, receivedUs))
+    {
+        s_stats.duplicates++;
+        return;
+    }
+    gettimeofday(&now, NULL);
+    if ((packet->flags & GROUP_CLOCK_VALID) && light_hal_clock_valid(now.tv_sec))
+    {
+        int64_t sentUs = (int64_t)packet->sentS * 1000000 + packet->sentUs;
+        int64_t latency = (int64_t)now.tv_sec * 1000000 + now.tv_usec - sentUs;
+        latencyUs = (latency > 0) ? (uint32_t)latency : 0;
+        metrics_record(METRIC_GROUP_LATENCY_US, latencyUs);
+        s_stats.latencyLastUs = latencyUs;
+        if (latencyUs > s_stats.latencyMaxUs)
+        {
+            s_stats.latencyMaxUs = latencyUs;
+        }
+    }
+    s_stats.received++;
+    metrics_count(METRIC_GROUP_RECEIVED);
+
+    light_event_t event = {
+        .type = LIGHT_EVENT_GROUP,
+        .zone = 0,
+        .timestamp_us = receivedUs,
+        .value = packet->holdMs,
+    };
+    if (!light_hal_post_event(&event))
+    {
+        ESP_LOGW(TAG, "Event queue full, motion from %08lx dropped", (unsigned long)packet->sender);
+    }
+    journal_add(JOURNAL_REMOTE_MOTION, packet->zone, latencyUs);
+    ESP_LOGI(TAG, "Motion from %08lx zone %u, %lu us on the way, %u us after the edge", (unsigned long)packet->sender,
+             packet->zone, (unsigned long)latencyUs, packet->edgeAgeUs);
+}
+
+static void group_task(void *arg)
+{
+    /* This task receives the group's packets. On the linux target the socket is polled, a task
+       blocked in recvfrom() would hold up the FreeRTOS port. */
+    group_packet_t packet;
+
+    while (true)
+    {
+#ifdef CONFIG_IDF_TARGET_LINUX
+        int length = recvfrom(s_socket, &packet, sizeof(packet), MSG_DONTWAIT, NULL, NULL);
+        if ((length < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+        {
+            vTaskDelay(pdMS_TO_TICKS(GROUP_POLL_MS));
+            continue;
+        }
+#else
+        int length = recvfrom(s_socket, &packet, sizeof(packet), 0, NULL, NULL);
+#endif
+        int64_t receivedUs = light_hal_now_us();
+
+        if (length < 0)
+        {
+            if (errno != EINTR)
+            {
+                ESP_LOGW(TAG, "Receive failed: errno %d", errno);
+                vTaskDelay(pdMS_TO_TICKS(1000));
+            }
+            continue;
+        }
+        if ((length != sizeof(packet)) || (packet.magic != GROUP_MAGIC) || (packet.version != GROUP_VERSION) ||
+            (packet.group != CONFIG_LIGHT_GROUP_ID))
+        {
+            s_stats.foreign++;
+            continue;
+        }
+        if (packet.sender == s_node_id)
+        {
+            /* Our own, looped back */
+            continue;
+        }
+        handle_packet(&packet, receivedUs);
+    }
+}
+
+static void set_node_id(void)
+{
+    /* The node id tells the boards of a group apart, the boot id their restarts */
+#ifdef CONFIG_IDF_TARGET_LINUX
+    s_node_id = (uint32_t)getpid();
+    s_boot = (uint16_t)light_hal_now_us();
+#else
+    uint8_t mac[6];
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    s_node_id = ((uint32_t)mac[2] << 24) | ((uint32_t)mac[3] << 16) | ((uint32_t)mac[4] << 8) | mac[5];
+    s_boot = (uint16_t)esp_random();
+#endif
+}
+
+void group_start(void)
+{
+    /* This function joins the multicast group and starts the receive task; call it once the
+       network interface exists. The linux target uses the loopback interface, so that several
+       instances on one host make a group. */
+    struct ip_mreq membership;
+    struct in_addr interface;
+    int enable = 1;
+    uint8_t ttl = 1;
+
+    set_node_id();
+#ifdef CONFIG_IDF_TARGET_LINUX
+    interface.s_addr = htonl(INADDR_LOOPBACK);
+#else
+    interface.s_addr = htonl(INADDR_ANY);
+#endif
+    memset(&s_address, 0, sizeof(s_address));
+    s_address.sin_family = AF_INET;
+    s_address.sin_port = htons(CONFIG_LIGHT_GROUP_PORT);
+    if (inet_aton(CONFIG_LIGHT_GROUP_ADDRESS, &s_address.sin_addr) == 0)
+    {
+        ESP_LOGE(TAG, "Bad group address %s", CONFIG_LIGHT_GROUP_ADDRESS);
+        return;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+    {
+        ESP_LOGE(TAG, "No socket: errno %d", errno);
+        return;
+    }
+    /* Other boards' instances on the same host listen on the same port */
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+#ifdef SO_REUSEPORT
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+#endif
+    struct sockaddr_in local = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_LIGHT_GROUP_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    membership.imr_multiaddr = s_address.sin_addr;
+    membership.imr_interface = interface;
+    if ((bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0) ||
+        (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) ||
+        (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) < 0) ||
+        (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0))
+    {
+        ESP_LOGE(TAG, "Joining %s:%d failed: errno %d", CONFIG_LIGHT_GROUP_ADDRESS, CONFIG_LIGHT_GROUP_PORT, errno);
+        close(sock);
+        return;
+    }
+
+    s_socket = sock;
+    xTaskCreatePinnedToCore(group_task, "group", GROUP_TASK_STACK_SIZE, NULL, GROUP_TASK_PRIORITY, NULL,
+                            GROUP_TASK_CORE);
+    ESP_LOGI(TAG, "Node %08lx in group %d on %s:%d", (unsigned long)s_node_id, CONFIG_LIGHT_GROUP_ID,
+             CONFIG_LIGHT_GROUP_ADDRESS, CONFIG_LIGHT_GROUP_PORT);
+}
+
+void group_motion(uint8_t zone, uint32_t holdTimeMs, int64_t edgeUs)
+{
+    /* This function tells the group about motion the controller accepted, from the lighting task.
+       Nothing here blocks: the packet goes into the socket's send buffer or is lost. */
+    int64_t nowUs = light_hal_now_us();
+    int64_t edgeAgeUs = nowUs - edgeUs;
+    struct timeval now;
+
+    if (s_socket < 0)
+    {
+        return;
+    }
+    if (!rate_allows(zone, nowUs))
+    {
+        s_stats.rateLimited++;
+        metrics_count(METRIC_GROUP_RATE_LIMITED);
+        return;
+    }
+
+    gettimeofday(&now, NULL);
+    group_packet_t packet = {
+        .magic = GROUP_MAGIC,
+        .version = GROUP_VERSION,
+        .group = CONFIG_LIGHT_GROUP_ID,
+        .sender = s_node_id,
+        .boot = s_boot,
+        .sequence = ++s_sequence,
+        .zone = zone,
+        .flags = light_hal_clock_valid(now.tv_sec) ? GROUP_CLOCK_VALID : 0,
+        .edgeAgeUs = (edgeAgeUs < UINT16_MAX) ? (uint16_t)edgeAgeUs : UINT16_MAX,
+        .holdMs = holdTimeMs + CONFIG_LIGHT_GROUP_MIN_INTERVAL_MS,
+        .sentS = (uint32_t)now.tv_sec,
+        .sentUs = (uint32_t)now.tv_usec,
+    };
+    for (uint8_t copy = 0; copy < GROUP_COPIES; copy++)
+    {
+        sendto(s_socket, &packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr *)&s_address, sizeof(s_address));
+    }
+    s_stats.sent++;
+    metrics_count(METRIC_GROUP_SENT);
+}
+
+void group_get_stats(group_stats_t *stats)
+{
+    *stats = s_stats;
+}
+
+#else
+
+void group_start(void)
+{
+}
+
+void group_motion(uint8_t zone, uint32_t holdTimeMs, int64_t edgeUs)
+{
+}
+
+void group_get_stats(group_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif /* CONFIG_LIGHT_GROUP */
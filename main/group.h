@@ -0,0 +1,30 @@
+#ifndef _GROUP_H_
+#define _GROUP_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "brightness.h"
+
+#ifdef CONFIG_LIGHT_GROUP
+#define GROUP_PRELIGHT_LEVEL BRIGHTNESS_FROM_PERCENT(CONFIG_LIGHT_GROUP_PRELIGHT_PERCENT)
+#else
+#define GROUP_PRELIGHT_LEVEL 0
+#endif
+
+/* Traffic of this board since boot */
+typedef struct
+{
+    uint32_t sent;                  /* Motion packets sent, not counting the repeats */
+    uint32_t rateLimited;           /* Motion not sent because the zone or the board sent too recently */
+    uint32_t received;              /* Neighbour motion taken */
+    uint32_t duplicates;            /* Repeats and packets seen before, dropped */
+    uint32_t foreign;               /* Packets of another group or not ours at all */
+    uint32_t latencyLastUs;         /* Sent to received, with both clocks synced */
+    uint32_t latencyMaxUs;
+} group_stats_t;
+
+void group_start(void);
+void group_motion(uint8_t zone, uint32_t holdTimeMs, int64_t edgeUs);
+void group_get_stats(group_stats_t *stats);
+
+#endif /* _GROUP_H_ */
@@ -0,0 +1,580 @@
+/*******************************************************************************************
+HTTP API
+
+A small local API on esp_http_server (CONFIG_LIGHT_HTTP_API):
+
+    GET  /api/state     the clock and every zone's state and settings as JSON
+    GET  /api/metrics   counters, histograms with their percentiles and stack marks as JSON
+    GET  /api/journal   the journal oldest first, one line per record
+    POST /api/zone      form fields "zone" and any of "brightness" (%), "hold_s" and "schedule";
+                        applied right away and answered with the state, not kept across a reboot
+    GET  /api/events    a server-sent events stream of the journal records as they are added
+
+The zones belong to the lighting task, so the handlers never touch them. A handler leaves its
+request in s_request, posts LIGHT_EVENT_API and waits; the lighting task answers it in
+http_api_handle_event() between two events. The server runs one handler at a time, so there is
+only ever one request in flight.
+
+Responses are serialized by json_writer.c into one static buffer that goes out as a chunk
+whenever it fills; nothing is allocated per request. Event streams stay open after their
+handler returns. The journal listener queues the records and wakes the server task, which
+writes them as chunks of the open responses. A stream whose socket fails a write or is closed
+is dropped.
+
+********************************************************************************************/
+#include "http_api.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "light_hal.h"
+#include "light_controller.h"
+#include "journal.h"
+#include "metrics.h"
+#include "json_writer.h"
+#include "brightness.h"
+#include "occupancy.h"
+#include "zone.h"
+#ifdef CONFIG_LIGHT_HTTP_API
+#include <unistd.h>
+#include "esp_http_server.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#ifndef CONFIG_IDF_TARGET_LINUX
+#include "metrics_console.h"
+#endif
+#endif
+
+#ifdef CONFIG_LIGHT_HTTP_API
+
+static const char *TAG = "http_api";
+
+#define HTTP_API_TASK_PRIORITY 4        /* Below time_sync, far below the lighting task */
+#define HTTP_API_TASK_CORE 0
+#define HTTP_API_MAX_STREAMS 3
+#define HTTP_API_EVENT_QUEUE_LENGTH 16
+#define HTTP_API_BUFFER_LEN 1024
+#define HTTP_API_BODY_LEN 256
+#define HTTP_API_WAIT_MS 1000           /* For the lighting task to answer */
+#define HTTP_API_CHUNK_HEAD 8           /* Room for the chunk size line in front of an event */
+#define HTTP_API_MAX_HOLD_S 86400
+
+typedef enum
+{
+    HTTP_API_READ_STATE,
+    HTTP_API_CHANGE_ZONE,
+} http_api_request_type_t;
+
+/* A request for the lighting task and its answer */
+typedef struct
+{
+    http_api_request_type_t type;
+    uint8_t zone;
+    bool setBrightness;
+    bool setHoldTime;
+    bool setSchedule;
+    uint8_t brightness;
+    uint32_t holdTimeMs;
+    char schedule[HTTP_API_BODY_LEN];
+    bool applied;                               /* Answer: the change was valid and applied */
+    light_zone_status_t zones[ZONE_MAX];        /* Answer: the state after the change */
+} http_api_request_t;
+
+static const char *const s_led_names[] = {
+    [LED_STATE_OFF] = "off",
+    [LED_STATE_FADING_UP] = "fading_up",
+    [LED_STATE_ON] = "on",
+    [LED_STATE_FADING_DOWN] = "fading_down",
+};
+
+static httpd_handle_t s_server = NULL;
+static http_api_request_t s_request;
+static SemaphoreHandle_t s_done;
+static volatile bool s_pending = false;         /* s_request is with the lighting task */
+static QueueHandle_t s_events;                  /* Records for the streams */
+static bool s_push_queued = false;              /* A push_events() work item is queued */
+static uint32_t s_stream_count = 0;
+static int s_streams[HTTP_API_MAX_STREAMS];     /* Sockets of the event streams, server task only */
+static uint32_t s_events_lost = 0;
+
+/* Server task only */
+static char s_buffer[HTTP_API_BUFFER_LEN];
+static char s_body[HTTP_API_BODY_LEN];
+static metrics_snapshot_t s_snapshot;
+
+static uint8_t level_to_percent(uint8_t level)
+{
+    return (uint8_t)((level * 100 + BRIGHTNESS_MAX / 2) / BRIGHTNESS_MAX);
+}
+
+static esp_err_t send_busy(httpd_req_t *req)
+{
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_sendstr(req, "Lighting task busy");
+}
+
+static bool ask_lighting_task(void)
+{
+    /* This function hands s_request to the lighting task and waits for the answer. It fails if
+       the queue is full, if the lighting task does not answer in time or if it still holds a
+       request that timed out before. The handlers check s_pending before they fill in
+       s_request. */
+    light_event_t event = {
+        .type = LIGHT_EVENT_API,
+        .zone = 0,
+        .timestamp_us = light_hal_now_us(),
+        .value = 0,
+    };
+
+    if (s_pending)
+    {
+        return false;
+    }
+    /* A late answer to a request that timed out */
+    xSemaphoreTake(s_done, 0);
+    s_pending = true;
+    if (!light_hal_post_event(&event))
+    {
+        s_pending = false;
+        return false;
+    }
+    return xSemaphoreTake(s_done, pdMS_TO_TICKS(HTTP_API_WAIT_MS)) == pdTRUE;
+}
+
+static bool send_chunk(void *context, const char *data, size_t length)
+{
+    return httpd_resp_send_chunk((httpd_req_t *)context, data, length) == ESP_OK;
+}
+
+static esp_err_t finish(httpd_req_t *req, json_writer_t *json)
+{
+    if (!json_writer_end(json))
+    {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t send_state(httpd_req_t *req)
+{
+    /* This function sends the state the lighting task put into s_request */
+    json_writer_t json;
+    time_t now = time(NULL);
+
+    httpd_resp_set_type(req, "application/json");
+    json_writer_begin(&json, s_buffer, sizeof(s_buffer), send_chunk, req);
+    json_writer_object_begin(&json, NULL);
+    json_writer_int(&json, "uptime_s", light_hal_now_us() / 1000000);
+    json_writer_int(&json, "time", now);
+    json_writer_bool(&json, "time_valid", light_hal_clock_valid(now));
+    json_writer_array_begin(&json, "zones");
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        const light_zone_status_t *status = &s_request.zones[zone];
+        json_writer_object_begin(&json, NULL);
+        json_writer_int(&json, "zone", zone);
+        json_writer_bool(&json, "active", status->active);
+        json_writer_bool(&json, "occupied", status->occupied);
+        json_writer_bool(&json, "lit", status->lit);
+        json_writer_bool(&json, "prelit", status->prelit);
+        json_writer_string(&json, "led", s_led_names[status->led]);
+        json_writer_int(&json, "level", status->level);
+        json_writer_int(&json, "brightness", level_to_percent(status->brightness));
+        json_writer_int(&json, "hold_s", status->holdTimeMs / 1000);
+        json_writer_string(&json, "schedule", status->schedule);
+        json_writer_object_end(&json);
+    }
+    json_writer_array_end(&json);
+    json_writer_object_end(&json);
+    return finish(req, &json);
+}
+
+static esp_err_t state_handler(httpd_req_t *req)
+{
+    if (s_pending)
+    {
+        return send_busy(req);
+    }
+    s_request.type = HTTP_API_READ_STATE;
+    if (!ask_lighting_task())
+    {
+        return send_busy(req);
+    }
+    return send_state(req);
+}
+
+static esp_err_t metrics_handler(httpd_req_t *req)
+{
+    /* This function sends a metrics snapshot; the counters and histograms are atomics, the
+       lighting task is not involved */
+    json_writer_t json;
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+    metrics_console_sample_stacks();
+#endif
+    metrics_snapshot(&s_snapshot, light_hal_now_us());
+    httpd_resp_set_type(req, "application/json");
+    json_writer_begin(&json, s_buffer, sizeof(s_buffer), send_chunk, req);
+    json_writer_object_begin(&json, NULL);
+    json_writer_int(&json, "uptime_s", s_snapshot.uptimeUs / 1000000);
+    json_writer_object_begin(&json, "counters");
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        json_writer_int(&json, metrics_counter_name(i), s_snapshot.counters[i]);
+    }
+    json_writer_object_end(&json);
+    json_writer_object_begin(&json, "histograms");
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        const metrics_histogram_t *h = &s_snapshot.histograms[i];
+        json_writer_object_begin(&json, metrics_histogram_name(i));
+        json_writer_string(&json, "unit", metrics_histogram_unit(i));
+        json_writer_int(&json, "count", h->count);
+        json_writer_int(&json, "mean", (h->count > 0) ? (h->sum / h->count) : 0);
+        json_writer_int(&json, "p50", metrics_percentile(h, 50));
+        json_writer_int(&json, "p90", metrics_percentile(h, 90));
+        json_writer_int(&json, "p99", metrics_percentile(h, 99));
+        json_writer_int(&json, "max", h->max);
+        json_writer_object_end(&json);
+    }
+    json_writer_object_end(&json);
+    json_writer_object_begin(&json, "stacks");
+    for (int i = 0; i < METRICS_MAX_TASKS; i++)
+    {
+        if (s_snapshot.stacks[i].name[0] != '\0')
+        {
+            json_writer_int(&json, s_snapshot.stacks[i].name, s_snapshot.stacks[i].freeBytes);
+        }
+    }
+    json_writer_object_end(&json);
+    json_writer_int(&json, "events_lost", __atomic_load_n(&s_events_lost, __ATOMIC_RELAXED));
+    json_writer_object_end(&json);
+    return finish(req, &json);
+}
+
+static esp_err_t journal_handler(httpd_req_t *req)
+{
+    /* This function streams the journal a record at a time, like the console command */
+    journal_cursor_t cursor;
+    journal_record_t record;
+    size_t length = 0;
+
+    httpd_resp_set_type(req, "text/plain");
+    journal_read_begin(&cursor);
+    while (journal_read_next(&cursor, &record))
+    {
+        char line[64];
+        size_t lineLength = journal_format(&record, line, sizeof(line) - 1);
+        line[lineLength++] = '\n';
+        if (length + lineLength > sizeof(s_buffer))
+        {
+            if (httpd_resp_send_chunk(req, s_buffer, length) != ESP_OK)
+            {
+                return ESP_FAIL;
+            }
+            length = 0;
+        }
+        memcpy(s_buffer + length, line, lineLength);
+        length += lineLength;
+    }
+    if ((length > 0) && (httpd_resp_send_chunk(req, s_buffer, length) != ESP_OK))
+    {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static void url_decode(char *text)
+{
+    /* Decodes a form value in place, '+' is a space and %XX a byte */
+    char *out = text;
+
+    for (const char *in = text; *in != '\0'; in++)
+    {
+        if (*in == '+')
+        {
+            *out++ = ' ';
+        }
+        else if ((in[0] == '%') && isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2]))
+        {
+            char hex[3] = { in[1], in[2], '\0' };
+            *out++ = (char)strtol(hex, NULL, 16);
+            in += 2;
+        }
+        else
+        {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
+
+static bool form_number(const char *form, const char *key, long min, long max, bool *present, long *number)
+{
+    /* This function reads an optional numeric form field, false if it is there but not a
+       number in [min, max] */
+    char value[16];
+    char *end;
+
+    *present = false;
+    switch (httpd_query_key_value(form, key, value, sizeof(value)))
+    {
+        case ESP_OK:
+            break;
+        case ESP_ERR_NOT_FOUND:
+            return true;
+        default:
+            return false;
+    }
+    *number = strtol(value, &end, 10);
+    *present = true;
+    return (end != value) && (*end == '\0') && (*number >= min) && (*number <= max);
+}
+
+static esp_err_t zone_handler(httpd_req_t *req)
+{
+    /* This function parses a zone change, has the lighting task apply it and answers with the
+       state after it */
+    http_api_request_t *request = &s_request;
+    size_t received = 0;
+    bool present;
+    long number;
+    esp_err_t ret;
+
+    if (req->content_len >= sizeof(s_body))
+    {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Form too long");
+    }
+    while (received < req->content_len)
+    {
+        int length = httpd_req_recv(req, s_body + received, req->content_len - received);
+        if (length <= 0)
+        {
+            return ESP_FAIL;
+        }
+        received += length;
+    }
+    s_body[received] = '\0';
+
+    if (s_pending)
+    {
+        return send_busy(req);
+    }
+    request->type = HTTP_API_CHANGE_ZONE;
+    if (!form_number(s_body, "zone", 0, g_zone_count - 1, &present, &number) || !present)
+    {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "No such zone");
+    }
+    request->zone = (uint8_t)number;
+    if (!form_number(s_body, "brightness", 1, 100, &present, &number))
+    {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Brightness is 1 to 100 %");
+    }
+    request->setBrightness = present;
+    request->brightness = brightness_from_percent((uint8_t)number);
+    if (!form_number(s_body, "hold_s", 1, HTTP_API_MAX_HOLD_S, &present, &number))
+    {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Hold time is 1 to 86400 s");
+    }
+    request->setHoldTime = present;
+    request->holdTimeMs = (uint32_t)number * 1000;
+    ret = httpd_query_key_value(s_body, "schedule", request->schedule, sizeof(request->schedule));
+    if ((ret != ESP_OK) && (ret != ESP_ERR_NOT_FOUND))
+    {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Schedule too long");
+    }
+    request->setSchedule = (ret == ESP_OK);
+    url_decode(request->schedule);
+
+    if (!ask_lighting_task())
+    {
+        return send_busy(req);
+    }
+    if (!request->applied)
+    {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid schedule");
+    }
+    ESP_LOGI(TAG, "Zone %u changed", request->zone);
+    return send_state(req);
+}
+
+static void drop_stream(int index)
+{
+    s_streams[index] = s_streams[s_stream_count - 1];
+    __atomic_store_n(&s_stream_count, s_stream_count - 1, __ATOMIC_RELEASE);
+}
+
+static esp_err_t events_handler(httpd_req_t *req)
+{
+    /* This function opens an event stream. The response stays open when it returns; the
+       chunks that follow are written by push_events(). */
+    if (s_stream_count == HTTP_API_MAX_STREAMS)
+    {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_sendstr(req, "Too many event streams");
+    }
+    httpd_resp_set_type(req, "text/event-stream");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    if (httpd_resp_send_chunk(req, ": light events\n\n", HTTPD_RESP_USE_STRLEN) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    s_streams[s_stream_count] = httpd_req_to_sockfd(req);
+    __atomic_store_n(&s_stream_count, s_stream_count + 1, __ATOMIC_RELEASE);
+    return ESP_OK;
+}
+
+static void push_events(void *arg)
+{
+    /* This work item runs in the server task and writes the queued records to every stream,
+       each as one chunk holding one event */
+    journal_record_t record;
+
+    __atomic_store_n(&s_push_queued, false, __ATOMIC_RELEASE);
+    while (xQueueReceive(s_events, &record, 0) == pdTRUE)
+    {
+        char *payload = s_buffer + HTTP_API_CHUNK_HEAD;
+        char head[HTTP_API_CHUNK_HEAD + 1];
+        const char *name = journal_type_name(record.type);
+        int length = snprintf(payload, sizeof(s_buffer) - HTTP_API_CHUNK_HEAD - 2,
+                              "event: %s\ndata: {\"zone\":%u,\"type\":\"%s\",\"value\":%u,\"time\":%lu,\"time_valid\":%s}\n\n",
+                              name, record.zone, name, record.value, (unsigned long)record.time,
+                              (record.type & JOURNAL_UNSYNCED) ? "false" : "true");
+        int headLength = snprintf(head, sizeof(head), "%x\r\n", length);
+        char *chunk = payload - headLength;
+
+        memcpy(chunk, head, headLength);
+        memcpy(payload + length, "\r\n", 2);
+        length += headLength + 2;
+        for (int i = (int)s_stream_count - 1; i >= 0; i--)
+        {
+            if (httpd_socket_send(s_server, s_streams[i], chunk, length, 0) != length)
+            {
+                ESP_LOGI(TAG, "Event stream on socket %d dropped", s_streams[i]);
+                httpd_sess_trigger_close(s_server, s_streams[i]);
+                drop_stream(i);
+            }
+        }
+    }
+}
+
+static void journal_listener(const journal_record_t *record)
+{
+    /* This function runs in the task that adds the record. With no stream open it does
+       nothing; otherwise it queues the record and, once per batch, the work item. */
+    if (__atomic_load_n(&s_stream_count, __ATOMIC_ACQUIRE) == 0)
+    {
+        return;
+    }
+    if (xQueueSend(s_events, record, 0) != pdTRUE)
+    {
+        __atomic_fetch_add(&s_events_lost, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (!__atomic_exchange_n(&s_push_queued, true, __ATOMIC_ACQ_REL) &&
+        (httpd_queue_work(s_server, push_events, NULL) != ESP_OK))
+    {
+        __atomic_store_n(&s_push_queued, false, __ATOMIC_RELEASE);
+    }
+}
+
+static void close_session(httpd_handle_t server, int sockfd)
+{
+    /* The server closes a socket, forget it if it carried an event stream */
+    for (int i = (int)s_stream_count - 1; i >= 0; i--)
+    {
+        if (s_streams[i] == sockfd)
+        {
+            drop_stream(i);
+        }
+    }
+    close(sockfd);
+}
+
+void http_api_start(void)
+{
+    /* This function starts the server on CONFIG_LIGHT_HTTP_PORT. The network has to be up,
+       or at least initialized. */
+    static const httpd_uri_t uris[] = {
+        { .uri = "/api/state", .method = HTTP_GET, .handler = state_handler },
+        { .uri = "/api/metrics", .method = HTTP_GET, .handler = metrics_handler },
+        { .uri = "/api/journal", .method = HTTP_GET, .handler = journal_handler },
+        { .uri = "/api/zone", .method = HTTP_POST, .handler = zone_handler },
+        { .uri = "/api/events", .method = HTTP_GET, .handler = events_handler },
+    };
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    esp_err_t ret;
+
+    config.server_port = CONFIG_LIGHT_HTTP_PORT;
+    config.task_priority = HTTP_API_TASK_PRIORITY;
+    config.core_id = HTTP_API_TASK_CORE;
+    config.lru_purge_enable = true;
+    config.close_fn = close_session;
+
+    s_done = xSemaphoreCreateBinary();
+    s_events = xQueueCreate(HTTP_API_EVENT_QUEUE_LENGTH, sizeof(journal_record_t));
+    ret = httpd_start(&s_server, &config);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "HTTP server start failed: %s", esp_err_to_name(ret));
+        return;
+    }
+    for (size_t i = 0; i < sizeof(uris) / sizeof(uris[0]); i++)
+    {
+        ESP_ERROR_CHECK(httpd_register_uri_handler(s_server, &uris[i]));
+    }
+    journal_set_listener(journal_listener);
+    ESP_LOGI(TAG, "HTTP API listening on port %d", config.server_port);
+}
+
+time_t http_api_handle_event(const light_event_t *event, time_t nextCheck)
+{
+    /* This function answers the request waiting in s_request, from the lighting task. A
+       change is applied and the schedules re-evaluated before the state is read back, so it
+       returns the new instant of the next schedule check. */
+    http_api_request_t *request = &s_request;
+
+    if (!s_pending)
+    {
+        return nextCheck;
+    }
+    if (request->type == HTTP_API_CHANGE_ZONE)
+    {
+        request->applied = !request->setSchedule || light_controller_set_schedule(request->zone, request->schedule);
+        if (request->applied)
+        {
+            if (request->setBrightness)
+            {
+                light_controller_set_brightness(request->zone, request->brightness);
+            }
+            if (request->setHoldTime)
+            {
+                occupancy_set_hold_time(request->zone, request->holdTimeMs);
+            }
+            nextCheck = light_controller_update(time(NULL));
+        }
+    }
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        light_controller_get_status(zone, &request->zones[zone]);
+    }
+    /* The give goes first, see ask_lighting_task() */
+    xSemaphoreGive(s_done);
+    s_pending = false;
+    return nextCheck;
+}
+
+#else
+
+void http_api_start(void)
+{
+}
+
+time_t http_api_handle_event(const light_event_t *event, time_t nextCheck)
+{
+    return nextCheck;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef _HTTP_API_H_
+#define _HTTP_API_H_
+
+#include <time.h>
+#include "light_events.h"
+
+void http_api_start(void);
+time_t http_api_handle_event(const light_event_t *event, time_t nextCheck);
+
+#endif /* _HTTP_API_H_ */
@@ -0,0 +1,561 @@
+/*******************************************************************************************
+Journal
+
+A persistent log of what the fixtures did, for usage patterns per zone: motion making a zone
+occupied, hold extensions, the zone going vacant, the light going on and off, time syncs and
+their failures, and boots. Every entry is an 8 byte journal_record_t stamped with the synced
+wall clock (or the seconds since boot, flagged, before the clock is set).
+
+Records are appended to a ring in RTC slow memory, which survives deep sleep and warm resets,
+so recording costs a spinlock and an 8 byte store and never touches the flash. A low priority
+task moves them to the "journal" data partition once they fill the rest of the current flash
+sector, so the flash sees one write per sector's worth of records and every sector is erased
+once per trip around the partition. The sector after the one being written is kept erased,
+which is how the write position is found again at boot. Records still staged after
+CONFIG_LIGHT_JOURNAL_FLUSH_INTERVAL_MIN are written as they are; appending to a sector that
+was already started costs no erase. Staged records are lost only on a power cut.
+
+Readers stream the journal one record at a time, from the memory-mapped partition and then
+from the staging ring, so an export never copies the log into RAM and never stalls the caches
+with flash reads.
+
+Without the partition (see partitions.csv) the journal stays off. A listener set with
+journal_set_listener() sees every record as it is added either way; the HTTP API streams
+them to its clients from there.
+
+********************************************************************************************/
+#include "journal.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include "light_hal.h"
+#ifdef CONFIG_LIGHT_JOURNAL
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "metrics_console.h"
+#endif
+
+static const char *const s_type_names[JOURNAL_TYPE_COUNT] = {
+    [JOURNAL_BOOT] = "boot",
+    [JOURNAL_OCCUPIED] = "occupied",
+    [JOURNAL_HOLD_EXTENDED] = "hold_extended",
+    [JOURNAL_VACANT] = "vacant",
+    [JOURNAL_LIGHT_ON] = "light_on",
+    [JOURNAL_LIGHT_OFF] = "light_off",
+    [JOURNAL_TIME_SYNC] = "time_sync",
+    [JOURNAL_TIME_SYNC_FAILED] = "time_sync_failed",
+    [JOURNAL_REMOTE_MOTION] = "remote_motion",
+};
+
+static journal_listener_t s_listener = NULL;
+
+static void stamp(journal_record_t *record, journal_type_t type)
+{
+    /* This function sets the time of a record, flagged as seconds since boot before the clock
+       is set */
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    if (light_hal_clock_valid(now.tv_sec))
+    {
+        record->time = (uint32_t)now.tv_sec;
+        record->type = type;
+    }
+    else
+    {
+        record->time = (uint32_t)(light_hal_now_us() / 1000000);
+        record->type = type | JOURNAL_UNSYNCED;
+    }
+}
+
+#ifdef CONFIG_LIGHT_JOURNAL
+
+static const char *TAG = "journal";
+
+#define JOURNAL_PARTITION_LABEL "journal"
+#define JOURNAL_MAGIC 0x4C414A4E        /* "LAJN" */
+#define JOURNAL_SECTOR_SIZE 4096
+#define JOURNAL_RECORDS_PER_SECTOR (JOURNAL_SECTOR_SIZE / sizeof(journal_record_t))
+#define JOURNAL_STAGE_RECORDS (JOURNAL_RECORDS_PER_SECTOR + 64)     /* A sector and room to keep recording while it is written */
+#define JOURNAL_MIN_SECTORS 3
+
+#define JOURNAL_TASK_STACK_SIZE 3072
+#define JOURNAL_TASK_PRIORITY 2
+#define JOURNAL_TASK_CORE 0
+
+#define JOURNAL_NOTIFY_BATCH (1U << 0)      /* A sector's worth of records is staged */
+#define JOURNAL_NOTIFY_FLUSH (1U << 1)      /* Write what is staged now */
+
+#if CONFIG_LIGHT_JOURNAL_FLUSH_INTERVAL_MIN > 0
+#define JOURNAL_FLUSH_TICKS pdMS_TO_TICKS(CONFIG_LIGHT_JOURNAL_FLUSH_INTERVAL_MIN * 60 * 1000)
+#else
+#define JOURNAL_FLUSH_TICKS portMAX_DELAY
+#endif
+
+_Static_assert(sizeof(journal_record_t) == 8, "journal_record_t is the on-flash format");
+
+/* Records not on flash yet, kept through deep sleep and warm resets */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t head;                  /* Records ever staged */
+    uint32_t tail;                  /* Records ever written to flash */
+    uint32_t dropped;
+    journal_record_t records[JOURNAL_STAGE_RECORDS];
+} journal_stage_t;
+
+static RTC_NOINIT_ATTR journal_stage_t s_stage;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static const esp_partition_t *s_partition = NULL;
+static const journal_record_t *s_flash;         /* The partition, memory-mapped */
+static esp_partition_mmap_handle_t s_mmap;
+static TaskHandle_t s_task;
+static uint32_t s_sectors;
+static uint32_t s_slots;                        /* Record slots in the partition */
+static uint32_t s_write;                        /* Next slot to write, changed under s_lock */
+static uint32_t s_written;                      /* Records on flash */
+static uint32_t s_batch;                        /* Staged records that complete the current sector */
+static uint32_t s_batches = 0;
+static uint32_t s_erases = 0;
+static volatile bool s_busy = false;
+
+static bool slot_erased(uint32_t slot)
+{
+    static const journal_record_t erased = { UINT32_MAX, UINT8_MAX, UINT8_MAX, UINT16_MAX };
+    return memcmp(&s_flash[slot], &erased, sizeof(erased)) == 0;
+}
+
+static bool record_valid(const journal_record_t *record)
+{
+    return (record->type & ~JOURNAL_UNSYNCED) < JOURNAL_TYPE_COUNT;
+}
+
+static void erase_sector(uint32_t sector)
+{
+    /* This function erases a sector and takes its records off the count */
+    if (!slot_erased(sector * JOURNAL_RECORDS_PER_SECTOR))
+    {
+        s_written -= (s_written > JOURNAL_RECORDS_PER_SECTOR) ? JOURNAL_RECORDS_PER_SECTOR : s_written;
+    }
+    ESP_ERROR_CHECK(esp_partition_erase_range(s_partition, sector * JOURNAL_SECTOR_SIZE, JOURNAL_SECTOR_SIZE));
+    s_erases++;
+}
+
+static void find_write_position(void)
+{
+    /* This function finds the slot after the newest record: in the written sector followed by
+       an erased one, the first erased slot. A partition without that shape is erased. */
+    uint32_t head = UINT32_MAX;
+    uint32_t lo;
+    uint32_t hi;
+
+    s_written = 0;
+    for (uint32_t sector = 0; sector < s_sectors; sector++)
+    {
+        bool written = !slot_erased(sector * JOURNAL_RECORDS_PER_SECTOR);
+        bool nextErased = slot_erased(((sector + 1) % s_sectors) * JOURNAL_RECORDS_PER_SECTOR);
+        if (written)
+        {
+            s_written += JOURNAL_RECORDS_PER_SECTOR;
+            if (nextErased)
+            {
+                head = sector;
+            }
+        }
+    }
+
+    if (head == UINT32_MAX)
+    {
+        for (uint32_t slot = 0; slot < s_slots; slot++)
+        {
+            if (!slot_erased(slot))
+            {
+                ESP_LOGW(TAG, "Partition not in journal format, erasing it");
+                ESP_ERROR_CHECK(esp_partition_erase_range(s_partition, 0, s_partition->size));
+                break;
+            }
+        }
+        s_written = 0;
+        s_write = 0;
+        return;
+    }
+
+    /* Records are written in order, the erased slots of the head sector are at its end */
+    lo = head * JOURNAL_RECORDS_PER_SECTOR;
+    hi = lo + JOURNAL_RECORDS_PER_SECTOR;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (slot_erased(mid))
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+    s_written -= (head + 1) * JOURNAL_RECORDS_PER_SECTOR - lo;
+    s_write = lo % s_slots;
+
+    /* A full head sector: the erase ahead may have been cut short by a reset */
+    if ((s_write % JOURNAL_RECORDS_PER_SECTOR) == 0)
+    {
+        uint32_t next = (s_write / JOURNAL_RECORDS_PER_SECTOR + 1) % s_sectors;
+        if (!slot_erased(next * JOURNAL_RECORDS_PER_SECTOR))
+        {
+            erase_sector(next);
+        }
+    }
+}
+
+static void write_batch(uint32_t count)
+{
+    /* This function writes the oldest 'count' staged records, which do not cross the end of
+       the current sector, straight from RTC memory */
+    uint32_t index = s_stage.tail % JOURNAL_STAGE_RECORDS;
+    uint32_t first = (count < JOURNAL_STAGE_RECORDS - index) ? count : (JOURNAL_STAGE_RECORDS - index);
+    size_t offset = (size_t)s_write * sizeof(journal_record_t);
+    esp_err_t err;
+
+    s_busy = true;
+    err = esp_partition_write(s_partition, offset, &s_stage.records[index], first * sizeof(journal_record_t));
+    if ((err == ESP_OK) && (count > first))
+    {
+        err = esp_partition_write(s_partition, offset + first * sizeof(journal_record_t), &s_stage.records[0],
+                                  (count - first) * sizeof(journal_record_t));
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Writing %lu records failed: %s", (unsigned long)count, esp_err_to_name(err));
+    }
+
+    taskENTER_CRITICAL(&s_lock);
+    s_stage.tail += count;
+    s_write = (s_write + count) % s_slots;
+    taskEXIT_CRITICAL(&s_lock);
+    s_written += count;
+    s_batches++;
+
+    /* Entering a new sector, keep the one after it erased */
+    if ((s_write % JOURNAL_RECORDS_PER_SECTOR) == 0)
+    {
+        erase_sector((s_write / JOURNAL_RECORDS_PER_SECTOR + 1) % s_sectors);
+    }
+    s_busy = false;
+}
+
+static void write_staged(bool partial)
+{
+    /* This function writes the staged records that complete the current sector, and with
+       'partial' also the ones that do not */
+    while (true)
+    {
+        uint32_t room = JOURNAL_RECORDS_PER_SECTOR - (s_write % JOURNAL_RECORDS_PER_SECTOR);
+        uint32_t staged;
+
+        taskENTER_CRITICAL(&s_lock);
+        staged = s_stage.head - s_stage.tail;
+        s_batch = room;
+        taskEXIT_CRITICAL(&s_lock);
+
+        uint32_t count = (staged < room) ? staged : room;
+        if ((count == 0) || ((count < room) && !partial))
+        {
+            return;
+        }
+        write_batch(count);
+    }
+}
+
+static void journal_task(void *arg)
+{
+    /* This task writes a batch whenever a sector's worth is staged, and whatever is staged when
+       the flush interval passes without one */
+    metrics_console_watch_task(NULL);
+    while (true)
+    {
+        uint32_t bits = 0;
+        bool timedOut = (xTaskNotifyWait(0, UINT32_MAX, &bits, JOURNAL_FLUSH_TICKS) != pdTRUE);
+
+        write_staged(timedOut || (bits & JOURNAL_NOTIFY_FLUSH));
+    }
+}
+
+void journal_init(void)
+{
+    /* This function maps the journal partition, finds the write position and keeps the records
+       staged before a warm reset. Records added before it are dropped. */
+    const void *flash;
+
+    s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                           JOURNAL_PARTITION_LABEL);
+    if (s_partition == NULL)
+    {
+        ESP_LOGW(TAG, "No \"%s\" partition, the journal is off", JOURNAL_PARTITION_LABEL);
+        return;
+    }
+    s_sectors = s_partition->size / JOURNAL_SECTOR_SIZE;
+    s_slots = s_sectors * JOURNAL_RECORDS_PER_SECTOR;
+    if ((s_sectors < JOURNAL_MIN_SECTORS) ||
+        (esp_partition_mmap(s_partition, 0, s_partition->size, ESP_PARTITION_MMAP_DATA, &flash, &s_mmap) != ESP_OK))
+    {
+        ESP_LOGW(TAG, "Journal partition unusable, the journal is off");
+        s_partition = NULL;
+        return;
+    }
+    s_flash = flash;
+    find_write_position();
+
+    if ((esp_reset_reason() == ESP_RST_POWERON) || (s_stage.magic != JOURNAL_MAGIC) ||
+        (s_stage.head - s_stage.tail > JOURNAL_STAGE_RECORDS))
+    {
+        memset(&s_stage, 0, offsetof(journal_stage_t, records));
+        s_stage.magic = JOURNAL_MAGIC;
+    }
+    s_batch = JOURNAL_RECORDS_PER_SECTOR - (s_write % JOURNAL_RECORDS_PER_SECTOR);
+    ESP_LOGI(TAG, "%lu records on flash, %lu staged, room for %lu", (unsigned long)s_written,
+             (unsigned long)(s_stage.head - s_stage.tail), (unsigned long)(s_slots - 2 * JOURNAL_RECORDS_PER_SECTOR));
+
+    xTaskCreatePinnedToCore(journal_task, "journal", JOURNAL_TASK_STACK_SIZE, NULL, JOURNAL_TASK_PRIORITY,
+                            &s_task, JOURNAL_TASK_CORE);
+    /* A batch may have been completed just before the reset */
+    xTaskNotify(s_task, JOURNAL_NOTIFY_BATCH, eSetBits);
+}
+
+void journal_add(journal_type_t type, uint8_t zone, uint32_t value)
+{
+    /* This function stages a record stamped with the current time and hands it to the
+       listener. It only takes a spinlock, so it may sit on the lighting task's paths. */
+    journal_record_t record = {
+        .zone = zone,
+        .value = (value > UINT16_MAX) ? UINT16_MAX : (uint16_t)value,
+    };
+    journal_listener_t listener = s_listener;
+    bool notify;
+
+    if ((s_partition == NULL) && (listener == NULL))
+    {
+        return;
+    }
+    stamp(&record, type);
+    if (listener != NULL)
+    {
+        listener(&record);
+    }
+    if (s_partition == NULL)
+    {
+        return;
+    }
+
+    taskENTER_CRITICAL(&s_lock);
+    if (s_stage.head - s_stage.tail >= JOURNAL_STAGE_RECORDS)
+    {
+        s_stage.dropped++;
+        taskEXIT_CRITICAL(&s_lock);
+        return;
+    }
+    s_stage.records[s_stage.head % JOURNAL_STAGE_RECORDS] = record;
+    s_stage.head++;
+    notify = (s_stage.head - s_stage.tail == s_batch);
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (notify)
+    {
+        xTaskNotify(s_task, JOURNAL_NOTIFY_BATCH, eSetBits);
+    }
+}
+
+void journal_flush(void)
+{
+    /* This function has the journal task write every staged record now */
+    if (s_partition != NULL)
+    {
+        xTaskNotify(s_task, JOURNAL_NOTIFY_FLUSH, eSetBits);
+    }
+}
+
+bool journal_busy(void)
+{
+    /* This function returns true while a batch is being written, deep sleep waits for it */
+    return s_busy;
+}
+
+void journal_get_stats(journal_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (s_partition == NULL)
+    {
+        return;
+    }
+    taskENTER_CRITICAL(&s_lock);
+    stats->staged = s_stage.head - s_stage.tail;
+    stats->dropped = s_stage.dropped;
+    taskEXIT_CRITICAL(&s_lock);
+    stats->capacity = s_slots - 2 * JOURNAL_RECORDS_PER_SECTOR;
+    stats->written = s_written;
+    stats->batches = s_batches;
+    stats->erases = s_erases;
+}
+
+void journal_read_begin(journal_cursor_t *cursor)
+{
+    /* This function starts a reader at the oldest record. The oldest sector is the one after the
+       erased sector ahead of the write position. */
+    memset(cursor, 0, sizeof(*cursor));
+    if (s_partition == NULL)
+    {
+        return;
+    }
+    taskENTER_CRITICAL(&s_lock);
+    uint32_t oldest = ((s_write / JOURNAL_RECORDS_PER_SECTOR + 2) % s_sectors) * JOURNAL_RECORDS_PER_SECTOR;
+    cursor->flashNext = oldest;
+    cursor->flashLeft = (s_write + s_slots - oldest) % s_slots;
+    cursor->stagedNext = s_stage.tail;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+bool journal_read_next(journal_cursor_t *cursor, journal_record_t *record)
+{
+    /* This function copies the next record into 'record' and returns false at the end. Records
+       staged after the reader started are included; the ones written to flash in the meantime
+       are found there. Erased and damaged slots are skipped. */
+    if (s_partition == NULL)
+    {
+        return false;
+    }
+    while (true)
+    {
+        bool found = true;
+
+        taskENTER_CRITICAL(&s_lock);
+        if (cursor->flashLeft > 0)
+        {
+            *record = s_flash[cursor->flashNext];
+            cursor->flashNext = (cursor->flashNext + 1) % s_slots;
+            cursor->flashLeft--;
+        }
+        else if ((int32_t)(s_stage.tail - cursor->stagedNext) > 0)
+        {
+            /* Written to flash since the reader started, it ends 'behind' slots before s_write */
+            uint32_t behind = s_stage.tail - cursor->stagedNext;
+            *record = s_flash[(s_write + s_slots - behind % s_slots) % s_slots];
+            cursor->stagedNext++;
+        }
+        else if (cursor->stagedNext != s_stage.head)
+        {
+            *record = s_stage.records[cursor->stagedNext % JOURNAL_STAGE_RECORDS];
+            cursor->stagedNext++;
+        }
+        else
+        {
+            found = false;
+        }
+        taskEXIT_CRITICAL(&s_lock);
+
+        if (!found)
+        {
+            return false;
+        }
+        if (record_valid(record))
+        {
+            return true;
+        }
+    }
+}
+
+#else
+
+void journal_init(void)
+{
+}
+
+void journal_add(journal_type_t type, uint8_t zone, uint32_t value)
+{
+    /* Without the journal a record is only made for the listener */
+    journal_record_t record = {
+        .zone = zone,
+        .value = (value > UINT16_MAX) ? UINT16_MAX : (uint16_t)value,
+    };
+    journal_listener_t listener = s_listener;
+
+    if (listener != NULL)
+    {
+        stamp(&record, type);
+        listener(&record);
+    }
+}
+
+void journal_flush(void)
+{
+}
+
+bool journal_busy(void)
+{
+    return false;
+}
+
+void journal_get_stats(journal_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+void journal_read_begin(journal_cursor_t *cursor)
+{
+    memset(cursor, 0, sizeof(*cursor));
+}
+
+bool journal_read_next(journal_cursor_t *cursor, journal_record_t *record)
+{
+    return false;
+}
+
+#endif
+
+void journal_set_listener(journal_listener_t listener)
+{
+    /* This function sets the one listener, NULL removes it. It is called from the task that
+       adds the record, after the time is stamped and before the record is staged. */
+    s_listener = listener;
+}
+
+const char *journal_type_name(uint8_t type)
+{
+    /* This function returns the name of a record type, the JOURNAL_UNSYNCED flag is ignored */
+    type &= ~JOURNAL_UNSYNCED;
+    return (type < JOURNAL_TYPE_COUNT) ? s_type_names[type] : "unknown";
+}
+
+size_t journal_format(const journal_record_t *record, char *text, size_t size)
+{
+    /* This function formats a record as one line of text: local time, or seconds since boot
+       before the clock was set, zone, type and value. It returns the length of the text. */
+    char when[32];
+    int length;
+
+    if (record->type & JOURNAL_UNSYNCED)
+    {
+        snprintf(when, sizeof(when), "boot+%lus", (unsigned long)record->time);
+    }
+    else
+    {
+        time_t time = record->time;
+        struct tm timeinfo;
+        localtime_r(&time, &timeinfo);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &timeinfo);
+    }
+    length = snprintf(text, size, "%s zone %u %s %u", when, record->zone, journal_type_name(record->type),
+                      record->value);
+    if (length < 0)
+    {
+        return 0;
+    }
+    return ((size_t)length < size) ? (size_t)length : (size - 1);
+}
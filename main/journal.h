@@ -0,0 +1,66 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    JOURNAL_BOOT,                   /* value: esp_reset_reason() */
+    JOURNAL_OCCUPIED,               /* Motion made a vacant zone occupied */
+    JOURNAL_HOLD_EXTENDED,          /* value: 0 motion re-armed the hold, 1 the sensor was still high at expiry */
+    JOURNAL_VACANT,                 /* The hold ran out */
+    JOURNAL_LIGHT_ON,               /* value: edge to first duty update in us (capped), 0 when the schedule lit it */
+    JOURNAL_LIGHT_OFF,
+    JOURNAL_TIME_SYNC,              /* value: sync time in ms (capped) */
+    JOURNAL_TIME_SYNC_FAILED,
+    JOURNAL_REMOTE_MOTION,          /* zone: the neighbour's zone, value: us on the way (capped), 0 without synced clocks */
+    JOURNAL_TYPE_COUNT
+} journal_type_t;
+
+/* Set in the type when the clock was not set yet; the time is then seconds since boot */
+#define JOURNAL_UNSYNCED 0x80
+
+/* One record on flash, little endian. An erased slot reads as all ones. */
+typedef struct __attribute__((packed))
+{
+    uint32_t time;                  /* Seconds since the epoch, or since boot with JOURNAL_UNSYNCED */
+    uint8_t type;                   /* journal_type_t, with JOURNAL_UNSYNCED */
+    uint8_t zone;
+    uint16_t value;
+} journal_record_t;
+
+/* Position of a reader, see journal_read_begin() */
+typedef struct
+{
+    uint32_t flashNext;             /* Next record index in the partition */
+    uint32_t flashLeft;             /* Flash records left to read */
+    uint32_t stagedNext;            /* Next staged record, as a count of records ever staged */
+} journal_cursor_t;
+
+typedef struct
+{
+    uint32_t capacity;              /* Records the partition keeps at least */
+    uint32_t written;               /* Records on flash */
+    uint32_t staged;                /* Records waiting in RTC memory for the next batch */
+    uint32_t dropped;               /* Records lost because the staging buffer was full */
+    uint32_t batches;               /* Flash writes since boot */
+    uint32_t erases;                /* Sector erases since boot */
+} journal_stats_t;
+
+/* Sees every record as it is added, see journal_set_listener() */
+typedef void (*journal_listener_t)(const journal_record_t *record);
+
+void journal_init(void);
+void journal_add(journal_type_t type, uint8_t zone, uint32_t value);
+void journal_flush(void);
+bool journal_busy(void);
+void journal_get_stats(journal_stats_t *stats);
+void journal_read_begin(journal_cursor_t *cursor);
+bool journal_read_next(journal_cursor_t *cursor, journal_record_t *record);
+void journal_set_listener(journal_listener_t listener);
+const char *journal_type_name(uint8_t type);
+size_t journal_format(const journal_record_t *record, char *text, size_t size);
+
+#endif /* _JOURNAL_H_ */
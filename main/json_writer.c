@@ -0,0 +1,177 @@
+/*******************************************************************************************
+JSON Writer
+
+Serializes a JSON document front to back into a buffer the caller owns. Whenever the buffer
+fills it is handed to the flush callback (the HTTP API sends it as a response chunk) and
+reused, so a document of any length is written through a fixed buffer without allocating.
+Commas, quoting and string escapes are taken care of; the caller only opens and closes
+objects and arrays in order.
+
+********************************************************************************************/
+#include "json_writer.h"
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+static void flush(json_writer_t *writer)
+{
+    if ((writer->length > 0) && !writer->failed)
+    {
+        writer->failed = !writer->flush(writer->context, writer->buffer, writer->length);
+    }
+    writer->length = 0;
+}
+
+static void put(json_writer_t *writer, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        size_t room = writer->size - writer->length;
+        size_t part = (length < room) ? length : room;
+
+        memcpy(writer->buffer + writer->length, data, part);
+        writer->length += part;
+        data += part;
+        length -= part;
+        if (writer->length == writer->size)
+        {
+            flush(writer);
+        }
+    }
+}
+
+static void put_char(json_writer_t *writer, char c)
+{
+    put(writer, &c, 1);
+}
+
+static void put_quoted(json_writer_t *writer, const char *text)
+{
+    /* Puts a string literal, escaping quotes, backslashes and control characters */
+    put_char(writer, '"');
+    for (const char *p = text; *p != '\0'; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if ((c == '"') || (c == '\\'))
+        {
+            put_char(writer, '\\');
+            put_char(writer, (char)c);
+        }
+        else if (c < 0x20)
+        {
+            char escape[8];
+            int length = snprintf(escape, sizeof(escape), "\\u%04x", c);
+            put(writer, escape, (size_t)length);
+        }
+        else
+        {
+            put_char(writer, (char)c);
+        }
+    }
+    put_char(writer, '"');
+}
+
+static void begin_value(json_writer_t *writer, const char *key)
+{
+    /* Puts the comma in front of every value but the first of its level, and the key */
+    uint32_t bit = 1U << writer->depth;
+
+    if (writer->hasValue & bit)
+    {
+        put_char(writer, ',');
+    }
+    writer->hasValue |= bit;
+    if (key != NULL)
+    {
+        put_quoted(writer, key);
+        put_char(writer, ':');
+    }
+}
+
+static void open_level(json_writer_t *writer, const char *key, char bracket)
+{
+    begin_value(writer, key);
+    put_char(writer, bracket);
+    if (writer->depth + 1 < JSON_WRITER_MAX_DEPTH)
+    {
+        writer->depth++;
+        writer->hasValue &= ~(1U << writer->depth);
+    }
+}
+
+static void close_level(json_writer_t *writer, char bracket)
+{
+    if (writer->depth > 0)
+    {
+        writer->depth--;
+    }
+    put_char(writer, bracket);
+}
+
+void json_writer_begin(json_writer_t *writer, char *buffer, size_t size, json_writer_flush_t flush, void *context)
+{
+    writer->buffer = buffer;
+    writer->size = size;
+    writer->length = 0;
+    writer->flush = flush;
+    writer->context = context;
+    writer->hasValue = 0;
+    writer->depth = 0;
+    writer->failed = false;
+}
+
+void json_writer_object_begin(json_writer_t *writer, const char *key)
+{
+    open_level(writer, key, '{');
+}
+
+void json_writer_object_end(json_writer_t *writer)
+{
+    close_level(writer, '}');
+}
+
+void json_writer_array_begin(json_writer_t *writer, const char *key)
+{
+    open_level(writer, key, '[');
+}
+
+void json_writer_array_end(json_writer_t *writer)
+{
+    close_level(writer, ']');
+}
+
+void json_writer_string(json_writer_t *writer, const char *key, const char *value)
+{
+    begin_value(writer, key);
+    put_quoted(writer, value);
+}
+
+void json_writer_int(json_writer_t *writer, const char *key, int64_t value)
+{
+    char text[24];
+    int length = snprintf(text, sizeof(text), "%" PRId64, value);
+
+    begin_value(writer, key);
+    put(writer, text, (size_t)length);
+}
+
+void json_writer_bool(json_writer_t *writer, const char *key, bool value)
+{
+    begin_value(writer, key);
+    if (value)
+    {
+        put(writer, "true", 4);
+    }
+    else
+    {
+        put(writer, "false", 5);
+    }
+}
+
+bool json_writer_end(json_writer_t *writer)
+{
+    /* This function flushes what is left of the document and returns whether all of it was
+       taken by the flush callback */
+    flush(writer);
+    return !writer->failed;
+}
@@ -0,0 +1,36 @@
+#ifndef _JSON_WRITER_H_
+#define _JSON_WRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JSON_WRITER_MAX_DEPTH 32
+
+/* Takes a full buffer, returns false to abandon the document */
+typedef bool (*json_writer_flush_t)(void *context, const char *data, size_t length);
+
+typedef struct
+{
+    char *buffer;
+    size_t size;
+    size_t length;                  /* Bytes waiting in buffer */
+    json_writer_flush_t flush;
+    void *context;
+    uint32_t hasValue;              /* Bit n set once nesting level n holds a value */
+    uint8_t depth;
+    bool failed;                    /* A flush failed, everything after it is dropped */
+} json_writer_t;
+
+/* 'key' is the member name inside an object and NULL for array elements and the document */
+void json_writer_begin(json_writer_t *writer, char *buffer, size_t size, json_writer_flush_t flush, void *context);
+void json_writer_object_begin(json_writer_t *writer, const char *key);
+void json_writer_object_end(json_writer_t *writer);
+void json_writer_array_begin(json_writer_t *writer, const char *key);
+void json_writer_array_end(json_writer_t *writer);
+void json_writer_string(json_writer_t *writer, const char *key, const char *value);
+void json_writer_int(json_writer_t *writer, const char *key, int64_t value);
+void json_writer_bool(json_writer_t *writer, const char *key, bool value);
+bool json_writer_end(json_writer_t *writer);
+
+#endif /* _JSON_WRITER_H_ */
@@ -0,0 +1,194 @@
+/*******************************************************************************************
+LED Fade Engine
+
+Non-blocking fades on top of the LEDC hardware fade unit. A fade is split into short linear
+hardware segments; the end of every segment is reported as a LIGHT_EVENT_FADE_DONE on the
+lighting event queue (by the LEDC fade-end interrupt in light_hal_esp.c), and the lighting task
+hands that event back to led_fade_handle_event() to start the next segment. No call in here
+waits for a fade. Every zone has its own fade state.
+
+Fades run in perceptual brightness levels (brightness.c). A full-scale fade is LED_FADE_STEPS
+segments that are even steps to the eye; between two steps the hardware ramps the duty
+linearly, so the curve is followed piecewise without a write per duty count.
+
+********************************************************************************************/
+#include "led_fade.h"
+#include "brightness.h"
+#include "esp_log.h"
+#include "light_hal.h"
+#include "metrics.h"
+
+static const char *TAG = "led_fade";
+
+typedef struct
+{
+    uint8_t zone;
+    uint32_t maxDuty;
+    led_state_t state;
+    uint8_t level;                  /* Level at the start of the running segment, or the steady level */
+    uint8_t segmentLevel;           /* Level the running segment ends at */
+    uint8_t targetLevel;
+    uint32_t segmentsLeft;
+    uint32_t segmentTimeMs;
+    int64_t segmentStartUs;
+    int64_t fadeStartUs;            /* Start of the fade, for the fade duration metric */
+    bool segmentRunning;
+    led_fade_stats_t stats;
+} led_fade_t;
+
+static led_fade_t s_fades[ZONE_MAX];
+
+static void stop_segment(led_fade_t *fade)
+{
+    /* This function stops the running hardware segment where the chip supports it and picks
+       the fade up from the level the hardware reached */
+    uint32_t duty;
+
+    if (fade->segmentRunning && light_hal_led_stop(fade->zone, &duty))
+    {
+        fade->level = brightness_from_duty(duty, fade->maxDuty);
+        fade->segmentRunning = false;
+    }
+}
+
+static bool start_next_segment(led_fade_t *fade)
+{
+    /* This function starts the next hardware segment towards the target. It returns true when
+       the target has been reached and no segment was started. */
+    if (fade->level == fade->targetLevel)
+    {
+        fade->state = (fade->level == 0) ? LED_STATE_OFF : LED_STATE_ON;
+        fade->segmentsLeft = 0;
+        return true;
+    }
+
+    if (fade->segmentsLeft == 0)
+    {
+        fade->segmentsLeft = 1;
+    }
+    int32_t delta = ((int32_t)fade->targetLevel - (int32_t)fade->level) / (int32_t)fade->segmentsLeft;
+    if (delta == 0)
+    {
+        delta = (fade->targetLevel > fade->level) ? 1 : -1;
+    }
+    fade->segmentLevel = (uint8_t)(fade->level + delta);
+    fade->segmentStartUs = light_hal_now_us();
+    fade->stats.segments++;
+    light_hal_led_fade(fade->zone, brightness_to_duty(fade->segmentLevel, fade->maxDuty), fade->segmentTimeMs);
+    fade->segmentRunning = true;
+    return false;
+}
+
+void led_fade_add(uint8_t zone, uint32_t maxDuty)
+{
+    /* This function sets up the fade state of a zone whose channel is configured and off */
+    led_fade_t *fade = &s_fades[zone];
+
+    fade->zone = zone;
+    fade->maxDuty = maxDuty;
+    fade->level = 0;
+    fade->targetLevel = 0;
+    fade->state = LED_STATE_OFF;
+}
+
+void led_fade_to(uint8_t zone, uint8_t targetLevel, uint32_t fullScaleTimeMs)
+{
+    /* This function starts, or retargets, a fade to a brightness level and returns at once. The
+       fade time is scaled by the distance to travel so a fade reversed halfway takes half the
+       time, and the fade takes one segment per LED_FADE_STEP_LEVELS levels. */
+    led_fade_t *fade = &s_fades[zone];
+
+    stop_segment(fade);
+
+    uint32_t distance = (targetLevel > fade->level) ? (targetLevel - fade->level) : (fade->level - targetLevel);
+    uint32_t fadeTimeMs = (uint32_t)(((uint64_t)fullScaleTimeMs * distance) / BRIGHTNESS_MAX);
+
+    fade->targetLevel = targetLevel;
+    fade->segmentsLeft = (distance + LED_FADE_STEP_LEVELS - 1) / LED_FADE_STEP_LEVELS;
+    fade->segmentTimeMs = (fade->segmentsLeft > 0) ? fadeTimeMs / fade->segmentsLeft : 0;
+    if ((fade->segmentTimeMs == 0) && !fade->segmentRunning)
+    {
+        /* Nothing to ramp over, or a fade too short to be worth a hardware segment */
+        led_fade_set(zone, targetLevel);
+        return;
+    }
+    if (fade->segmentTimeMs == 0)
+    {
+        fade->segmentTimeMs = 1;
+    }
+    if (targetLevel != fade->level)
+    {
+        fade->state = (targetLevel > fade->level) ? LED_STATE_FADING_UP : LED_STATE_FADING_DOWN;
+    }
+    fade->fadeStartUs = light_hal_now_us();
+
+    /* Without hardware fade stop the new target is picked up when the running segment ends */
+    if (!fade->segmentRunning)
+    {
+        start_next_segment(fade);
+    }
+}
+
+void led_fade_set(uint8_t zone, uint8_t level)
+{
+    /* This function sets a brightness level immediately, cancelling any fade in progress */
+    led_fade_t *fade = &s_fades[zone];
+
+    fade->segmentRunning = false;
+    light_hal_led_set(zone, brightness_to_duty(level, fade->maxDuty));
+    fade->stats.writes++;
+    fade->level = level;
+    fade->targetLevel = level;
+    fade->segmentsLeft = 0;
+    fade->state = (level == 0) ? LED_STATE_OFF : LED_STATE_ON;
+}
+
+bool led_fade_handle_event(const light_event_t *event)
+{
+    /* This function advances the fade on a LIGHT_EVENT_FADE_DONE. It returns true when the event
+       completed the whole fade. Events raised before the running segment was started belong to a
+       segment that was stopped by a retarget and are ignored. */
+    led_fade_t *fade = &s_fades[event->zone];
+
+    if ((event->type != LIGHT_EVENT_FADE_DONE) || !fade->segmentRunning ||
+        (event->timestamp_us < fade->segmentStartUs))
+    {
+        return false;
+    }
+
+    fade->segmentRunning = false;
+    fade->level = fade->segmentLevel;
+    if (fade->segmentsLeft > 0)
+    {
+        fade->segmentsLeft--;
+    }
+
+    if (start_next_segment(fade))
+    {
+        metrics_count(METRIC_FADES);
+        metrics_record(METRIC_FADE_MS, (uint32_t)((event->timestamp_us - fade->fadeStartUs) / 1000));
+        ESP_LOGD(TAG, "Zone %u: fade complete at level %u", event->zone, fade->level);
+        return true;
+    }
+    return false;
+}
+
+led_state_t led_fade_state(uint8_t zone)
+{
+    return s_fades[zone].state;
+}
+
+uint8_t led_fade_level(uint8_t zone)
+{
+    return s_fades[zone].level;
+}
+
+uint32_t led_fade_duty(uint8_t zone)
+{
+    return brightness_to_duty(s_fades[zone].level, s_fades[zone].maxDuty);
+}
+
+void led_fade_get_stats(uint8_t zone, led_fade_stats_t *stats)
+{
+    *stats = s_fades[zone].stats;
+}
@@ -0,0 +1,39 @@
+#ifndef _LED_FADE_H_
+#define _LED_FADE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "light_events.h"
+#include "brightness.h"
+
+/* Number of perceptually even steps in a full-scale fade. Each step is one hardware segment;
+   a running fade can be retargeted at the latest at the next segment boundary, or immediately
+   on chips that support stopping a hardware fade. */
+#define LED_FADE_STEPS 32
+#define LED_FADE_STEP_LEVELS ((BRIGHTNESS_MAX + 1) / LED_FADE_STEPS)
+
+typedef enum
+{
+    LED_STATE_OFF,
+    LED_STATE_FADING_UP,
+    LED_STATE_ON,
+    LED_STATE_FADING_DOWN,
+} led_state_t;
+
+/* LEDC calls made by a zone since boot */
+typedef struct
+{
+    uint32_t segments;              /* Hardware fade segments started */
+    uint32_t writes;                /* Immediate duty writes */
+} led_fade_stats_t;
+
+void led_fade_add(uint8_t zone, uint32_t maxDuty);
+void led_fade_to(uint8_t zone, uint8_t targetLevel, uint32_t fullScaleTimeMs);
+void led_fade_set(uint8_t zone, uint8_t level);
+bool led_fade_handle_event(const light_event_t *event);
+led_state_t led_fade_state(uint8_t zone);
+uint8_t led_fade_level(uint8_t zone);
+uint32_t led_fade_duty(uint8_t zone);
+void led_fade_get_stats(uint8_t zone, led_fade_stats_t *stats);
+
+#endif /* _LED_FADE_H_ */
@@ -0,0 +1,149 @@
+/*******************************************************************************************
+Light Automation, Linux Target
+
+The program as a host process, built by `idf.py --preview set-target linux`, for testing the
+HTTP API with a local client (pytest_http_api.py) and the group with several instances on one
+host (pytest_group.py). The lighting loop (lighting_loop.c) and the controller are the ones of
+the chip, on light_hal_linux.c and the two zones below; the HTTP API listens on the host and the
+group runs on the loopback interface. There are no sensors: a line "motion <zone> <level>" on
+stdin sets a zone's sensor level and raises the edge, "group" prints the group's traffic.
+
+********************************************************************************************/
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "light_events.h"
+#include "zone.h"
+#include "light_controller.h"
+#include "light_hal_linux.h"
+#include "lighting_loop.h"
+#include "brightness.h"
+#include "led_fade.h"
+#include "motion_filter.h"
+#include "occupancy.h"
+#include "schedule.h"
+#include "http_api.h"
+#include "group.h"
+
+static const char *TAG = "example";
+
+#define LIGHTING_TASK_STACK_SIZE 4096
+#define LIGHTING_TASK_PRIORITY 10
+#define COMMAND_POLL_MS 20
+#define COMMAND_LINE_LEN 64
+
+#define LINUX_ZONE(n) { .sensorGpio = GPIO_NUM_NC, .ledGpio = GPIO_NUM_NC, .channel = (n), .timer = 0,   \
+                        .holdTimeMs = CONFIG_LIGHT_OCCUPANCY_HOLD_TIME_S * 1000, .maxDuty = 0x3FF,        \
+                        .brightness = BRIGHTNESS_FROM_PERCENT(CONFIG_LIGHT_BRIGHTNESS_PERCENT),          \
+                        .schedule = NULL }
+
+const zone_config_t g_zone_table[] = {
+    LINUX_ZONE(0), LINUX_ZONE(1),
+};
+
+const uint8_t g_zone_count = sizeof(g_zone_table) / sizeof(g_zone_table[0]);
+
+static QueueHandle_t s_light_event_queue;
+
+static void lighting_task(void *arg)
+{
+    /* This task runs the lighting loop of the chip without the hour blink and the power
+       management */
+    static const lighting_loop_hooks_t hooks = { 0 };
+
+    lighting_loop_run(s_light_event_queue, &hooks);
+}
+
+static void log_group_stats(void)
+{
+    group_stats_t stats;
+
+    group_get_stats(&stats);
+    ESP_LOGI(TAG, "Group: %lu sent, %lu rate limited, %lu received, %lu duplicates, %lu foreign, "
+             "latency %lu us (max %lu us)", (unsigned long)stats.sent, (unsigned long)stats.rateLimited,
+             (unsigned long)stats.received, (unsigned long)stats.duplicates, (unsigned long)stats.foreign,
+             (unsigned long)stats.latencyLastUs, (unsigned long)stats.latencyMaxUs);
+}
+
+static void run_command(const char *line)
+{
+    /* This function runs one line from stdin */
+    unsigned zone;
+    int level;
+
+    if (strcmp(line, "group") == 0)
+    {
+        log_group_stats();
+        return;
+    }
+    if ((sscanf(line, "motion %u %d", &zone, &level) != 2) || (zone >= g_zone_count))
+    {
+        ESP_LOGW(TAG, "Unknown command \"%s\", try \"motion <zone> <0|1>\" or \"group\"", line);
+        return;
+    }
+    light_event_t event = {
+        .type = LIGHT_EVENT_MOTION,
+        .zone = (uint8_t)zone,
+        .timestamp_us = light_hal_now_us(),
+        .value = (level != 0) ? 1 : 0,
+    };
+    light_hal_linux_set_sensor(event.zone, (int)event.value);
+    light_hal_post_event(&event);
+}
+
+static void read_commands(void)
+{
+    /* stdin is polled, a task blocked in read() would hold up the FreeRTOS port */
+    char line[COMMAND_LINE_LEN];
+    size_t length = 0;
+
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+    while (true)
+    {
+        char c;
+        if (read(STDIN_FILENO, &c, 1) != 1)
+        {
+            vTaskDelay(pdMS_TO_TICKS(COMMAND_POLL_MS));
+            continue;
+        }
+        if ((c != '\n') && (c != '\r'))
+        {
+            if (length < sizeof(line) - 1)
+            {
+                line[length++] = c;
+            }
+            continue;
+        }
+        line[length] = '\0';
+        if (length > 0)
+        {
+            run_command(line);
+        }
+        length = 0;
+    }
+}
+
+void app_main(void)
+{
+    schedule_init(CONFIG_LIGHT_TIMEZONE);
+    s_light_event_queue = xQueueCreate(LIGHT_EVENT_QUEUE_LENGTH, sizeof(light_event_t));
+    light_hal_linux_init(s_light_event_queue);
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        led_fade_add(zone, g_zone_table[zone].maxDuty);
+        motion_filter_add(zone);
+        occupancy_add(zone, g_zone_table[zone].holdTimeMs);
+    }
+    light_controller_init();
+    ESP_LOGI(TAG, "%u zone(s) configured", g_zone_count);
+    xTaskCreate(lighting_task, "lighting", LIGHTING_TASK_STACK_SIZE, NULL, LIGHTING_TASK_PRIORITY, NULL);
+    http_api_start();
+    group_start();
+    read_commands();
+}
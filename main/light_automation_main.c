@@ -1,9 +1,10 @@
 /*******************************************************************************************
 Light Automation Program
 
-This program is intended to monitor the time of day and control a light source depending on the
-time. Motion will be monitored and the illumination will be enabled outside of the range between
-START_LED_OFF_HOUR and END_LED_OFF_HOUR.
+This program is intended to monitor the time of day and control light sources depending on the
+time. Motion will be monitored and the illumination will be enabled during the active windows of
+the schedule set by CONFIG_LIGHT_SCHEDULE. Every sensor/LED pair in the zone table is a zone, all
+of them are served by the single lighting task.
 
 The program has used the simple wifi connection example from the ESP IDF as a starting point.
 
@@ -24,111 +25,247 @@ The program has used the simple wifi connection example from the ESP IDF as a st
 #include "esp_log.h"
 #include "esp_attr.h"
 #include "esp_sleep.h"
-#include "nvs_flash.h"
-#include "protocol_examples_common.h"
-#include "esp_netif_sntp.h"
-#include "lwip/ip_addr.h"
-#include "esp_sntp.h"
 #include "driver/gpio.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "driver/ledc.h"
+#include "esp_timer.h"
+#include "light_events.h"
+#include "zone.h"
+#include "light_controller.h"
+#include "light_hal_esp.h"
+#include "lighting_loop.h"
+#include "motion_sensor.h"
+#include "led_fade.h"
+#include "motion_filter.h"
+#include "occupancy.h"
+#include "schedule.h"
+#include "time_sync.h"
+#include "fast_boot.h"
+#include "power.h"
+#include "pixel_strip.h"
+#include "metrics.h"
+#include "metrics_console.h"
+#include "deferred_log.h"
+#include "journal.h"
+#ifdef CONFIG_LIGHT_AMBIENT_SENSOR
+#include "ambient_light.h"
+#endif
+#ifdef CONFIG_LIGHT_ZONE_STRESS_TEST
+#include "zone_stress_test.h"
+#endif
+#ifdef CONFIG_LIGHT_FADE_BENCHMARK
+#include "fade_benchmark.h"
+#endif
+#ifdef CONFIG_LIGHT_STRIP_BENCHMARK
+#include "strip_benchmark.h"
+#endif
 
 static const char *TAG = "example";
 
-#ifndef INET6_ADDRSTRLEN
-#define INET6_ADDRSTRLEN 48
-#endif
+#define BLINK_ZONE 0
+#define BLINK_PERIOD_MS 500
+#define BLINK_LEVEL BRIGHTNESS_FROM_PERCENT(50)
+
+#define LIGHTING_TASK_STACK_SIZE 4096
+#define LIGHTING_TASK_PRIORITY 10
+#define LIGHTING_TASK_CORE 1            /* APP CPU, leaves the PRO CPU to Wi-Fi and SNTP */
 
-#define LED_GPIO 2
-#define MAX_DUTY_CYCLE 0x3FF
-#define START_LED_OFF_HOUR 8           /* 08:00 set for LED off time start*/
-#define END_LED_OFF_HOUR 15            /* 19:00 set for LED off time end*/
+static QueueHandle_t s_light_event_queue;
 
-static ledc_channel_config_t ledc_channel;
-#define SENSOR_GPIO 17
+/* Diagnostic hour blink on the first zone, run by the lighting task between motion events */
+static esp_timer_handle_t s_blink_timer;
+static int s_blink_steps_left = 0;
+static bool s_blink_pending = false;
 
-void monitor_motion(void);
-void obtain_time(void);
+void lighting_task(void *arg);
 int8_t check_hour(void);
 int8_t setup_procedure(void);
 void blink_LED(int8_t numCycles);
+void start_hour_blink(void);
+void step_hour_blink(void);
+void cancel_hour_blink(void);
+void blink_timer_cb(void *arg);
 void configure_GPIOS(void);
 void configure_LED(void);
-void time_sync_notification_cb(struct timeval *tv);
-void fadeUpLed(void);
-void fadeDownLed(void);
-
-bool ledON = false;
+void configure_zones(void);
 
 void app_main(void)
 {
-    int8_t currentHour = setup_procedure();    
-    while(true)
+    schedule_init(CONFIG_LIGHT_TIMEZONE);
+    s_light_event_queue = xQueueCreate(LIGHT_EVENT_QUEUE_LENGTH, sizeof(light_event_t));
+    power_init(s_light_event_queue);
+    journal_init();
+    journal_add(JOURNAL_BOOT, 0, esp_reset_reason());
+    setup_procedure();
+#ifdef CONFIG_LIGHT_FADE_BENCHMARK
+    fade_benchmark_run(s_light_event_queue, 0);
+#endif
+#ifdef CONFIG_LIGHT_STRIP_BENCHMARK
+    strip_benchmark_run();
+#endif
+
+    configure_zones();
+    light_controller_init();
+#ifdef CONFIG_LIGHT_AMBIENT_SENSOR
+    ambient_light_start(s_light_event_queue);
+#endif
+    xTaskCreatePinnedToCore(lighting_task, "lighting", LIGHTING_TASK_STACK_SIZE, NULL,
+                            LIGHTING_TASK_PRIORITY, NULL, LIGHTING_TASK_CORE);
+    time_sync_start(s_light_event_queue);
+    metrics_console_start();
+#ifdef CONFIG_LIGHT_ZONE_STRESS_TEST
+    zone_stress_test_start(s_light_event_queue);
+#endif
+}
+
+static void lighting_started(void)
+{
+    if (s_blink_pending && time_sync_clock_valid(time(NULL)))
     {
-        currentHour = check_hour();
-        if ((currentHour >= START_LED_OFF_HOUR) && (currentHour <= END_LED_OFF_HOUR))
-        {
-            monitor_motion();
-        }
-        else
-        {
-            if (ledON)
+        start_hour_blink();
+    }
+    fast_boot_log_ready();
+    metrics_console_watch_task(NULL);
+}
+
+static bool lighting_event(const light_event_t *event)
+{
+    /* This function takes the hour blink steps and lets motion on the blink zone end the blink */
+    switch (event->type)
+    {
+        case LIGHT_EVENT_MOTION:
+            if ((event->zone == BLINK_ZONE) && (event->value == 1))
             {
-               fadeDownLed(); 
+                cancel_hour_blink();
             }
-        }
-        vTaskDelay( 4000 / portTICK_PERIOD_MS);
+            return false;
+        case LIGHT_EVENT_TIME_SYNCED:
+            check_hour();
+            return false;
+        case LIGHT_EVENT_BLINK:
+            step_hour_blink();
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void lighting_handled(const light_event_t *event)
+{
+    if (event->type == LIGHT_EVENT_MOTION)
+    {
+        power_motion_end();
+    }
+    else if ((event->type == LIGHT_EVENT_TIME_SYNCED) && s_blink_pending)
+    {
+        start_hour_blink();
     }
 }
 
+void lighting_task(void *arg)
+{
+    /* This task runs the lighting loop (lighting_loop.c) with the hour blink and, with nothing
+       to do until the next transition, may put the chip into deep sleep (power.c) */
+    static const lighting_loop_hooks_t hooks = {
+        .started = lighting_started,
+        .idle = power_deep_sleep_if_idle,
+        .event = lighting_event,
+        .handled = lighting_handled,
+    };
+
+    lighting_loop_run(s_light_event_queue, &hooks);
+}
+
 int8_t setup_procedure(void)
 {
-    /* This setup function configures the LED and timing. The LED will blink the hour of the day when the time is found. */
+    /* This setup function configures the LED and timing. With fast boot nothing in here waits:
+       the hour blink is optional and runs later from the lighting task. Otherwise the LED is
+       held on for 5 s and then blinks the hour of the day when the time is known. */
     int8_t currentHour;
     configure_GPIOS();
     configure_LED();
-    gpio_set_level(LED_GPIO, 1);
+#ifdef CONFIG_LIGHT_FAST_BOOT
+    fast_boot_init();
+    currentHour = check_hour();
+#ifdef CONFIG_LIGHT_BOOT_BLINK
+    s_blink_pending = true;
+#endif
+#else
+    gpio_set_level(g_zone_table[BLINK_ZONE].ledGpio, 1);
     vTaskDelay( 5000 / portTICK_PERIOD_MS);
 
     currentHour = check_hour();
-    gpio_set_level(LED_GPIO, 0);
+    gpio_set_level(g_zone_table[BLINK_ZONE].ledGpio, 0);
     blink_LED(currentHour);
+#endif
     return currentHour;
 }
 
-void time_sync_notification_cb(struct timeval *tv)
-{
-    ESP_LOGI(TAG, "Notification of a time synchronization event");
-}
-
 void configure_GPIOS(void)
 {
-    gpio_reset_pin(LED_GPIO);
-    gpio_reset_pin(SENSOR_GPIO);
-    gpio_set_direction(LED_GPIO, GPIO_MODE_OUTPUT);
-    gpio_set_direction(SENSOR_GPIO, GPIO_MODE_INPUT);
+    /* The sensor pins are configured together with their interrupts in configure_zones() */
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        gpio_reset_pin(g_zone_table[zone].ledGpio);
+        gpio_set_direction(g_zone_table[zone].ledGpio, GPIO_MODE_OUTPUT);
+    }
 }
 
 void configure_LED(void)
 {
-    /* This function configures the LED/LED strip for PWM control*/
+#ifdef CONFIG_LIGHT_OUTPUT_STRIP
+    /* This function starts the addressable strip and gives every zone its segment */
+    light_hal_esp_init(s_light_event_queue);
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        pixel_strip_add_segment(zone, g_zone_table[zone].stripFirst, g_zone_table[zone].stripCount,
+                                g_zone_table[zone].stripOrigin, g_zone_table[zone].maxDuty);
+        led_fade_add(zone, g_zone_table[zone].maxDuty);
+    }
+#else
+    /* This function configures the LEDs of all zones for PWM control. The zones share one timer
+       and get a channel each. */
     ledc_timer_config_t ledc_timer = {
         .duty_resolution = LEDC_TIMER_10_BIT,
         .freq_hz = 1000,
-        .speed_mode = LEDC_HIGH_SPEED_MODE,
+        .speed_mode = ZONE_LEDC_SPEED_MODE,
         .timer_num = LEDC_TIMER_0,
-        .clk_cfg = LEDC_AUTO_CLK,
+        .clk_cfg = ZONE_LEDC_CLK,
     };
 
     ledc_timer_config(&ledc_timer);
-    ledc_channel.channel = LEDC_CHANNEL_0;
-    ledc_channel.duty = 0;
-    ledc_channel.gpio_num = LED_GPIO;
-    ledc_channel.speed_mode = LEDC_HIGH_SPEED_MODE;
-    ledc_channel.hpoint = 0;
-    ledc_channel.timer_sel = LEDC_TIMER_0;
-    ledc_channel_config(&ledc_channel);
+    light_hal_esp_init(s_light_event_queue);
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        ledc_channel_config_t ledc_channel = {
+            .channel = g_zone_table[zone].channel,
+            .duty = 0,
+            .gpio_num = g_zone_table[zone].ledGpio,
+            .speed_mode = ZONE_LEDC_SPEED_MODE,
+            .hpoint = 0,
+            .timer_sel = g_zone_table[zone].timer,
+        };
+        ledc_channel_config(&ledc_channel);
+        light_hal_esp_add_led(zone, &ledc_channel);
+        led_fade_add(zone, g_zone_table[zone].maxDuty);
+    }
+#endif
+}
+
+void configure_zones(void)
+{
+    /* This function attaches the sensor, its filter and the occupancy hold of every zone to the
+       event queue */
+    motion_sensor_init(s_light_event_queue);
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        motion_sensor_add(zone, g_zone_table[zone].sensorGpio);
+        motion_filter_add(zone);
+        occupancy_add(zone, g_zone_table[zone].holdTimeMs);
+    }
+    ESP_LOGI(TAG, "%u zone(s) configured", g_zone_count);
 }
 
 void blink_LED(int8_t numCycles)
@@ -137,147 +274,106 @@ void blink_LED(int8_t numCycles)
 
     for( ; numCycles > 0; numCycles--)
     {   
-        ledc_set_duty(ledc_channel.speed_mode, ledc_channel.channel, 0);
-        ledc_update_duty(ledc_channel.speed_mode, ledc_channel.channel);
+        led_fade_set(BLINK_ZONE, 0);
         vTaskDelay(500  / portTICK_PERIOD_MS);
 
-        ledc_set_duty(ledc_channel.speed_mode, ledc_channel.channel, 0xFF);
-        ledc_update_duty(ledc_channel.speed_mode, ledc_channel.channel);
+        led_fade_set(BLINK_ZONE, BLINK_LEVEL);
 
         vTaskDelay(500  / portTICK_PERIOD_MS);
     }
-    ledc_set_duty(ledc_channel.speed_mode, ledc_channel.channel, 0);
-    ledc_update_duty(ledc_channel.speed_mode, ledc_channel.channel);
-
-}
+    led_fade_set(BLINK_ZONE, 0);
 
-void print_servers(void)
-{
-    ESP_LOGI(TAG, "List of configured NTP servers:");
-
-    for (uint8_t i = 0; i < SNTP_MAX_SERVERS; ++i){
-        if (esp_sntp_getservername(i)){
-            ESP_LOGI(TAG, "server %d: %s", i, esp_sntp_getservername(i));
-        } else {
-            char buff[INET6_ADDRSTRLEN];
-            ip_addr_t const *ip = esp_sntp_getserver(i);
-            if (ipaddr_ntoa_r(ip, buff, INET6_ADDRSTRLEN) != NULL)
-                ESP_LOGI(TAG, "server %d: %s", i, buff);
-        }
-    }
 }
 
-int8_t check_hour(void)
+void start_hour_blink(void)
 {
-    /* This function finds and returns the hour of the day as int8 */
-    time_t now;
+    /* This function starts the non-blocking blink of the hour of the day. Every step is an event
+       for the lighting task, so motion can take the LED over at any point. */
+    const esp_timer_create_args_t timerArgs = {
+        .callback = blink_timer_cb,
+        .name = "hour_blink",
+    };
+    time_t now = time(NULL);
     struct tm timeinfo;
-    time(&now);
-    localtime_r(&now, &timeinfo);
-    if (timeinfo.tm_year < (2016 - 1900)) {
-        ESP_LOGI(TAG, "Time is not set yet. Connecting to WiFi and getting time over NTP.");
-        obtain_time();
-        // update 'now' variable with current time
-        time(&now);
-    }
 
-    char strftime_buf[64];
-    setenv("TZ", "CST6EDT,M3.2.0/2,M11.1.0", 1); // CST timezone config
-    tzset();
+    s_blink_pending = false;
+    if (light_controller_zone_lit(BLINK_ZONE) || (led_fade_state(BLINK_ZONE) != LED_STATE_OFF))
+    {
+        return;
+    }
+    if (s_blink_timer == NULL)
+    {
+        ESP_ERROR_CHECK(esp_timer_create(&timerArgs, &s_blink_timer));
+    }
     localtime_r(&now, &timeinfo);
-    strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-    ESP_LOGI(TAG, "The current date/time in Dallas is: %s", strftime_buf);
-    ESP_LOGI(TAG, "The hours is: %d", timeinfo.tm_hour);
-    return timeinfo.tm_hour;
+    s_blink_steps_left = 2 * timeinfo.tm_hour;
+    if (s_blink_steps_left > 0)
+    {
+        ESP_ERROR_CHECK(esp_timer_start_periodic(s_blink_timer, BLINK_PERIOD_MS * 1000));
+    }
 }
 
-void obtain_time(void)
+void step_hour_blink(void)
 {
-    ESP_ERROR_CHECK( nvs_flash_init() );
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK( esp_event_loop_create_default() );
-
-    /* This helper function configures Wi-Fi or Ethernet, as selected in menuconfig.
-     * Read "Establishing Wi-Fi or Ethernet Connection" section in
-     * examples/protocols/README.md for more information about this function.
-     */
-    ESP_ERROR_CHECK(example_connect());
-    ESP_LOGI(TAG, "Initializing and starting SNTP");
-
-    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_SNTP_TIME_SERVER);
-
-    config.sync_cb = time_sync_notification_cb;     // Note: This is only needed if we want
-
-    esp_netif_sntp_init(&config);
-
-    print_servers();
-
-    // wait for time to be set
-    time_t now = 0;
-    struct tm timeinfo = { 0 };
-    int retry = 0;
-    const int retry_count = 15;
-    while (esp_netif_sntp_sync_wait(2000 / portTICK_PERIOD_MS) == ESP_ERR_TIMEOUT && ++retry < retry_count) {
-        ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
+    if (s_blink_steps_left <= 0)
+    {
+        return;
     }
-    time(&now);
-    localtime_r(&now, &timeinfo);
-
-    ESP_ERROR_CHECK( example_disconnect() );
-    esp_netif_sntp_deinit();
-}
 
-void monitor_motion(void)
-{
-    /* This funciton monitors motion from an IR sensor and handles the LED control */
-    if (gpio_get_level(SENSOR_GPIO) == 1)
+    if (light_controller_zone_lit(BLINK_ZONE))
     {
-        if (ledON == false)
-        {
-            ESP_LOGI(TAG, "MOTION DETECTED!");
-            fadeUpLed();
-        }
-        vTaskDelay( 300000 / portTICK_PERIOD_MS);
+        /* The schedule opened on an occupied zone, the controller owns the LED now */
+        esp_timer_stop(s_blink_timer);
+        s_blink_steps_left = 0;
+        return;
     }
-    else
+
+    s_blink_steps_left--;
+    led_fade_set(BLINK_ZONE, (s_blink_steps_left % 2) ? BLINK_LEVEL : 0);
+    if (s_blink_steps_left == 0)
     {
-        // gpio_set_level(LED_GPIO, 0);
-        if (ledON == true)
-        {
-            ESP_LOGI(TAG, "MOTION NO LONGER DETECTED!");
-            fadeDownLed();
-        }
-        vTaskDelay( 100 / portTICK_PERIOD_MS);
+        esp_timer_stop(s_blink_timer);
     }
 }
 
-void fadeUpLed(void)
+void cancel_hour_blink(void)
 {
-    /* This function fades up the LED to the maximum brightness set by the MAX_DUTY_CYCLE definition */
-    uint32_t ledDutyCycle;
-    for (ledDutyCycle = 0; ledDutyCycle <= MAX_DUTY_CYCLE; ledDutyCycle++)
+    if (s_blink_steps_left <= 0)
     {
-        ledc_set_duty(ledc_channel.speed_mode, ledc_channel.channel, ledDutyCycle);
-        ledc_update_duty(ledc_channel.speed_mode, ledc_channel.channel);
-        vTaskDelay( 10 / portTICK_PERIOD_MS);
+        return;
     }
 
-    ledON = true;
+    esp_timer_stop(s_blink_timer);
+    s_blink_steps_left = 0;
+    led_fade_set(BLINK_ZONE, 0);
 }
 
-void fadeDownLed(void)
+void blink_timer_cb(void *arg)
 {
-    /* This function fades down the LED from the maximum brightness set by the MAX_DUTY_CYCLE definition */
+    light_event_t event = {
+        .type = LIGHT_EVENT_BLINK,
+        .zone = BLINK_ZONE,
+        .timestamp_us = esp_timer_get_time(),
+    };
 
-    uint32_t ledDutyCycle;
-    for (ledDutyCycle = MAX_DUTY_CYCLE; ledDutyCycle > 0; ledDutyCycle--)
-    {
-        ledc_set_duty(ledc_channel.speed_mode, ledc_channel.channel, ledDutyCycle);
-        ledc_update_duty(ledc_channel.speed_mode, ledc_channel.channel);
-        vTaskDelay( 10 / portTICK_PERIOD_MS);
+    xQueueSend(s_light_event_queue, &event, 0);
+}
+
+int8_t check_hour(void)
+{
+    /* This function finds and returns the hour of the day as int8, or -1 if the clock is not set.
+       Time sync runs in the background and is not waited for. The messages go to the deferred
+       log and are only formatted when the `log` console command reads them. */
+    time_t now;
+    struct tm timeinfo;
+    time(&now);
+    if (!time_sync_clock_valid(now)) {
+        deferred_log_put("Time is not set yet, running on the fallback policy until it is synchronized.", 0, 0);
+        return -1;
     }
 
-    ledc_set_duty(ledc_channel.speed_mode, ledc_channel.channel, 0);
-    ledc_update_duty(ledc_channel.speed_mode, ledc_channel.channel);
-    ledON = false;
+    localtime_r(&now, &timeinfo);
+    deferred_log_put_time("The current local date/time is: %s", now);
+    deferred_log_put("The hours is: %ld", timeinfo.tm_hour, 0);
+    return timeinfo.tm_hour;
 }
@@ -0,0 +1,397 @@
+/*******************************************************************************************
+Light Controller
+
+The per-zone lighting logic. Every zone in g_zone_table runs the same small state machine: a
+rising edge on the sensor that passes the motion filter marks the zone occupied and, inside the
+zone's schedule window, fades its LED up; the occupancy hold expiring or the window closing
+fades it down again.
+
+All zones are served from one event queue by one task, which calls
+light_controller_handle_event() for every event and light_controller_update() at the head of
+its loop. The zone index travels in the event, so adding a fixture is a row in the zone table
+and not another task.
+
+With CONFIG_LIGHT_GROUP accepted motion is also sent to the neighbouring fixtures, and their
+motion pre-lights the zones here inside the schedule window, at GROUP_PRELIGHT_LEVEL for their
+hold time, until motion of our own takes the zone to full brightness.
+
+Brightness and schedule start out from the zone table and may be changed at run time (the HTTP
+API does), from the lighting task only. Changes are not kept across a reboot.
+
+********************************************************************************************/
+#include "light_controller.h"
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "zone.h"
+#include "light_hal.h"
+#include "journal.h"
+#include "group.h"
+#include "led_fade.h"
+#include "metrics.h"
+#include "motion_filter.h"
+#include "occupancy.h"
+#include "schedule.h"
+
+static const char *TAG = "light_controller";
+
+typedef struct
+{
+    bool scheduleActive;            /* Cached, re-evaluated in light_controller_update() */
+    bool lit;                       /* The controller wants the LED on */
+    bool prelit;                    /* On at the pre-light level for a neighbour's motion */
+    uint8_t brightness;             /* Level to fade up to */
+    char schedule[LIGHT_SCHEDULE_TEXT_LEN];     /* Rules in use, as given */
+    light_zone_stats_t stats;
+} light_zone_t;
+
+static light_zone_t s_zones[ZONE_MAX];
+static bool s_dark = true;          /* Ambient light gate, always dark without a sensor */
+
+static void fade_up(uint8_t zone)
+{
+    /* Fade up to the zone's configured brightness */
+    s_zones[zone].lit = true;
+    s_zones[zone].prelit = false;
+    led_fade_to(zone, s_zones[zone].brightness, CONFIG_LIGHT_FADE_UP_TIME_MS);
+}
+
+static void fade_down(uint8_t zone)
+{
+    /* Fade down to off from the current brightness */
+    s_zones[zone].lit = false;
+    s_zones[zone].prelit = false;
+    led_fade_to(zone, 0, CONFIG_LIGHT_FADE_DOWN_TIME_MS);
+    journal_add(JOURNAL_LIGHT_OFF, zone, 0);
+}
+
+static void prelight(uint8_t zone)
+{
+    /* Fade up to the pre-light level, for motion next door */
+    s_zones[zone].prelit = true;
+    led_fade_to(zone, GROUP_PRELIGHT_LEVEL, CONFIG_LIGHT_FADE_UP_TIME_MS);
+}
+
+static bool schedule_active_now(uint8_t zone, time_t now, time_t *nextCheck)
+{
+    /* This function returns whether motion should light the zone now and when to ask again.
+       Until the clock has been set the fallback policy from the configuration applies. */
+    if (!light_hal_clock_valid(now))
+    {
+        *nextCheck = now + SCHEDULE_MAX_SLEEP_S;
+#ifdef CONFIG_LIGHT_UNSYNCED_ACTIVE
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    *nextCheck = schedule_next_transition(zone, now);
+    return schedule_is_active(zone, now);
+}
+
+static void handle_schedule_change(uint8_t zone, time_t now)
+{
+    /* This function applies a schedule transition. Formatting the time only happens here, once
+       per transition. */
+    light_zone_t *state = &s_zones[zone];
+    struct tm timeinfo;
+    char strftime_buf[64];
+
+    localtime_r(&now, &timeinfo);
+    strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
+    ESP_LOGI(TAG, "%s: zone %u schedule window %s", strftime_buf, zone,
+             state->scheduleActive ? "opened" : "closed");
+
+    if (state->scheduleActive)
+    {
+        /* The window may have opened while the zone was already occupied */
+        if (!state->lit && (occupancy_state(zone) == OCCUPANCY_OCCUPIED))
+        {
+            fade_up(zone);
+            journal_add(JOURNAL_LIGHT_ON, zone, 0);
+        }
+    }
+    else if (state->lit || state->prelit)
+    {
+        fade_down(zone);
+    }
+}
+
+static void handle_motion(uint8_t zone, int64_t edgeUs)
+{
+    /* This function handles motion that passed the sensor filter. Only the cached schedule
+       state is consulted, so no time formatting or logging sits in front of the first duty
+       update. A fade-down in progress is reversed from its current duty. The journal is
+       written after it. */
+    light_zone_t *state = &s_zones[zone];
+    int64_t latency;
+    bool becameOccupied = occupancy_motion(zone);
+
+    if (!state->scheduleActive || state->lit)
+    {
+        journal_add(becameOccupied ? JOURNAL_OCCUPIED : JOURNAL_HOLD_EXTENDED, zone, 0);
+        group_motion(zone, occupancy_hold_time(zone), edgeUs);
+        return;
+    }
+
+    fade_up(zone);
+    latency = light_hal_now_us() - edgeUs;
+    state->stats.lightUps++;
+    metrics_count(METRIC_LIGHT_UPS);
+    metrics_record(METRIC_EDGE_TO_DUTY_US, (uint32_t)latency);
+    if (latency > state->stats.lightMaxUs)
+    {
+        state->stats.lightMaxUs = latency;
+    }
+    journal_add(becameOccupied ? JOURNAL_OCCUPIED : JOURNAL_HOLD_EXTENDED, zone, 0);
+    journal_add(JOURNAL_LIGHT_ON, zone, (uint32_t)latency);
+    group_motion(zone, occupancy_hold_time(zone), edgeUs);
+    ESP_LOGI(TAG, "MOTION DETECTED in zone %u! Edge to first duty update: %lld us (max %lld us)",
+             zone, (long long)latency, (long long)state->stats.lightMaxUs);
+}
+
+static void handle_edge(const light_event_t *event)
+{
+    /* This function hands a sensor edge to the filter, after counting rising edges for the
+       dispatch statistics */
+    light_zone_stats_t *stats = &s_zones[event->zone].stats;
+    bool occupied = (occupancy_state(event->zone) == OCCUPANCY_OCCUPIED);
+
+    if (event->value == 1)
+    {
+        int64_t latency = light_hal_now_us() - event->timestamp_us;
+        stats->motionEvents++;
+        stats->dispatchSumUs += latency;
+        if (latency > stats->dispatchMaxUs)
+        {
+            stats->dispatchMaxUs = latency;
+        }
+    }
+
+    if (motion_filter_edge(event, occupied))
+    {
+        handle_motion(event->zone, event->timestamp_us);
+    }
+}
+
+static void handle_pulse_width(const light_event_t *event)
+{
+    /* The minimum width of a rising edge has passed, the filter reads the line again */
+    int64_t edgeUs;
+
+    if (motion_filter_handle_event(event, occupancy_state(event->zone) == OCCUPANCY_OCCUPIED, &edgeUs))
+    {
+        handle_motion(event->zone, edgeUs);
+    }
+}
+
+static void handle_group(uint32_t holdTimeMs)
+{
+    /* This function shares a neighbour's motion with every zone: each is held at least as long
+       as the neighbour's hold, and a dark zone inside its window is pre-lit */
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        light_zone_t *state = &s_zones[zone];
+
+        occupancy_share(zone, holdTimeMs);
+        if (state->scheduleActive && !state->lit && !state->prelit && (GROUP_PRELIGHT_LEVEL > 0))
+        {
+            prelight(zone);
+        }
+    }
+}
+
+static void log_sensor_stats(uint8_t zone)
+{
+    motion_filter_stats_t stats;
+
+    motion_filter_get_stats(zone, &stats);
+    ESP_LOGI(TAG, "Zone %u sensor: %lu pulses accepted, rejected %lu bounces, %lu short, %lu unconfirmed",
+             zone, (unsigned long)stats.accepted, (unsigned long)stats.bounces,
+             (unsigned long)stats.shortPulses, (unsigned long)stats.unconfirmed);
+}
+
+static void handle_hold_expired(const light_event_t *event)
+{
+    /* The zone may have become vacant. A hold for a neighbour's motion runs out quietly. */
+    bool occupied = (occupancy_state(event->zone) == OCCUPANCY_OCCUPIED);
+
+    if (!occupancy_handle_event(event))
+    {
+        return;
+    }
+    if (occupied)
+    {
+        ESP_LOGI(TAG, "MOTION NO LONGER DETECTED in zone %u!", event->zone);
+        journal_add(JOURNAL_VACANT, event->zone, 0);
+        log_sensor_stats(event->zone);
+    }
+    if (s_zones[event->zone].lit || s_zones[event->zone].prelit)
+    {
+        fade_down(event->zone);
+        if (!s_dark)
+        {
+            /* Daylight seen while the zone was lit holds from now on */
+            s_zones[event->zone].scheduleActive = false;
+        }
+    }
+}
+
+void light_controller_init(void)
+{
+    /* This function loads the schedule of every zone. The zones' LEDs, sensors and occupancy
+       timers are set up by the caller. */
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        const char *rules = g_zone_table[zone].schedule;
+        if ((rules == NULL) || !light_controller_set_schedule(zone, rules))
+        {
+            light_controller_set_schedule(zone, CONFIG_LIGHT_SCHEDULE);
+        }
+        s_zones[zone].scheduleActive = false;
+        s_zones[zone].lit = false;
+        s_zones[zone].prelit = false;
+        s_zones[zone].brightness = g_zone_table[zone].brightness;
+    }
+}
+
+time_t light_controller_update(time_t now)
+{
+    /* This function re-evaluates the schedule of every zone and applies the transitions. It
+       returns the earliest instant one of them has to be looked at again. */
+    time_t nextCheck = now + SCHEDULE_MAX_SLEEP_S;
+
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        time_t zoneCheck;
+        bool active = schedule_active_now(zone, now, &zoneCheck);
+        /* The sensor may see the zone's own light; daylight closes the gate once it is off */
+        bool dark = s_dark || s_zones[zone].lit || s_zones[zone].prelit;
+#ifdef CONFIG_LIGHT_AMBIENT_REPLACES_SCHEDULE
+        active = dark;
+#else
+        active = active && dark;
+#endif
+        if (active != s_zones[zone].scheduleActive)
+        {
+            s_zones[zone].scheduleActive = active;
+            handle_schedule_change(zone, now);
+        }
+        if (zoneCheck < nextCheck)
+        {
+            nextCheck = zoneCheck;
+        }
+    }
+    return nextCheck;
+}
+
+void light_controller_set_dark(bool dark)
+{
+    /* This function sets the ambient light gate; light_controller_update() applies it. A lit
+       zone is not closed by daylight, only once its hold has run out. */
+    s_dark = dark;
+}
+
+void light_controller_handle_event(const light_event_t *event)
+{
+    /* This function dispatches one event from the lighting queue to its zone */
+    if (event->zone >= g_zone_count)
+    {
+        ESP_LOGW(TAG, "Event %d for unknown zone %u", event->type, event->zone);
+        return;
+    }
+
+    switch (event->type)
+    {
+        case LIGHT_EVENT_MOTION:
+            handle_edge(event);
+            break;
+        case LIGHT_EVENT_PULSE_WIDTH:
+            handle_pulse_width(event);
+            break;
+        case LIGHT_EVENT_FADE_DONE:
+            if (led_fade_handle_event(event))
+            {
+                ESP_LOGI(TAG, "Zone %u LED is %s", event->zone,
+                         (led_fade_state(event->zone) == LED_STATE_ON) ? "on" : "off");
+            }
+            break;
+        case LIGHT_EVENT_HOLD_EXPIRED:
+            handle_hold_expired(event);
+            break;
+        case LIGHT_EVENT_GROUP:
+            handle_group(event->value);
+            break;
+        case LIGHT_EVENT_TIME_SYNCED:
+            /* The clock may have been stepped, the state is re-evaluated at the next update */
+            schedule_invalidate();
+            break;
+        default:
+            break;
+    }
+}
+
+bool light_controller_zone_active(uint8_t zone)
+{
+    /* This function returns whether motion lights the zone, as of the last update */
+    return s_zones[zone].scheduleActive;
+}
+
+bool light_controller_zone_lit(uint8_t zone)
+{
+    /* This function returns whether the controller holds the zone's LED on or fading up */
+    return s_zones[zone].lit;
+}
+
+void light_controller_get_stats(uint8_t zone, light_zone_stats_t *stats)
+{
+    *stats = s_zones[zone].stats;
+}
+
+void light_controller_reset_stats(void)
+{
+    for (uint8_t zone = 0; zone < ZONE_MAX; zone++)
+    {
+        memset(&s_zones[zone].stats, 0, sizeof(s_zones[zone].stats));
+    }
+}
+
+void light_controller_get_status(uint8_t zone, light_zone_status_t *status)
+{
+    /* This function fills in the state and settings of a zone, from the lighting task */
+    const light_zone_t *state = &s_zones[zone];
+
+    status->active = state->scheduleActive;
+    status->lit = state->lit;
+    status->prelit = state->prelit;
+    status->occupied = (occupancy_state(zone) == OCCUPANCY_OCCUPIED);
+    status->led = led_fade_state(zone);
+    status->level = led_fade_level(zone);
+    status->brightness = state->brightness;
+    status->holdTimeMs = occupancy_hold_time(zone);
+    memcpy(status->schedule, state->schedule, sizeof(status->schedule));
+}
+
+bool light_controller_set_schedule(uint8_t zone, const char *rules)
+{
+    /* This function replaces the schedule rules of a zone; invalid rules are rejected and the
+       old ones kept. The next light_controller_update() applies them. Rules longer than
+       LIGHT_SCHEDULE_TEXT_LEN are read back truncated. */
+    if (!schedule_set_rules(zone, rules))
+    {
+        return false;
+    }
+    snprintf(s_zones[zone].schedule, sizeof(s_zones[zone].schedule), "%s", rules);
+    return true;
+}
+
+void light_controller_set_brightness(uint8_t zone, uint8_t level)
+{
+    /* This function changes the level a zone fades up to. A lit zone fades to it right away. */
+    s_zones[zone].brightness = level;
+    if (s_zones[zone].lit)
+    {
+        led_fade_to(zone, level, CONFIG_LIGHT_FADE_UP_TIME_MS);
+    }
+}
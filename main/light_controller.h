@@ -0,0 +1,48 @@
+#ifndef _LIGHT_CONTROLLER_H_
+#define _LIGHT_CONTROLLER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "light_events.h"
+#include "led_fade.h"
+
+#define LIGHT_SCHEDULE_TEXT_LEN 96     /* Longest schedule rules kept for read back, with the terminator */
+
+/* Dispatch statistics of one zone since the last reset */
+typedef struct
+{
+    uint32_t motionEvents;          /* Rising edges dispatched */
+    uint32_t lightUps;              /* Accepted motion that started a fade up */
+    int64_t dispatchSumUs;          /* Edge to dispatch, summed over motionEvents */
+    int64_t dispatchMaxUs;
+    int64_t lightMaxUs;             /* Edge to first duty update */
+} light_zone_stats_t;
+
+/* What a zone is doing and how it is set up */
+typedef struct
+{
+    bool active;                    /* Motion lights the zone, as of the last update */
+    bool lit;                       /* The controller holds the LED on or fading up */
+    bool prelit;                    /* On at the pre-light level for a neighbour's motion */
+    bool occupied;
+    led_state_t led;
+    uint8_t level;                  /* Perceptual level of the LED now */
+    uint8_t brightness;             /* Level the zone fades up to */
+    uint32_t holdTimeMs;
+    char schedule[LIGHT_SCHEDULE_TEXT_LEN];
+} light_zone_status_t;
+
+void light_controller_init(void);
+time_t light_controller_update(time_t now);
+void light_controller_set_dark(bool dark);
+void light_controller_handle_event(const light_event_t *event);
+bool light_controller_zone_active(uint8_t zone);
+bool light_controller_zone_lit(uint8_t zone);
+void light_controller_get_stats(uint8_t zone, light_zone_stats_t *stats);
+void light_controller_reset_stats(void);
+void light_controller_get_status(uint8_t zone, light_zone_status_t *status);
+bool light_controller_set_schedule(uint8_t zone, const char *rules);
+void light_controller_set_brightness(uint8_t zone, uint8_t level);
+
+#endif /* _LIGHT_CONTROLLER_H_ */
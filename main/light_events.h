@@ -0,0 +1,33 @@
+#ifndef _LIGHT_EVENTS_H_
+#define _LIGHT_EVENTS_H_
+
+#include <stdint.h>
+#include "zone.h"
+
+/* Events consumed by the lighting task. Producers (ISRs, timers, other tasks) post
+   these to the lighting event queue so the task can block instead of polling. */
+
+#define LIGHT_EVENT_QUEUE_LENGTH (4 * ZONE_MAX)
+
+typedef enum
+{
+    LIGHT_EVENT_MOTION,             /* Edge on the PIR sensor line, value holds the new level */
+    LIGHT_EVENT_FADE_DONE,          /* LEDC hardware fade finished, value holds the duty reached */
+    LIGHT_EVENT_HOLD_EXPIRED,       /* Occupancy hold timer ran out, value holds the timer generation */
+    LIGHT_EVENT_TIME_SYNCED,        /* The system clock was set from SNTP */
+    LIGHT_EVENT_BLINK,              /* Next step of the non-blocking diagnostic hour blink */
+    LIGHT_EVENT_PULSE_WIDTH,        /* Minimum width of a sensor pulse elapsed, value holds the filter generation */
+    LIGHT_EVENT_AMBIENT,            /* Ambient light crossed a threshold, value holds the raw average and the dark flag */
+    LIGHT_EVENT_API,                /* A request of the HTTP API waits for the lighting task, see http_api.c */
+    LIGHT_EVENT_GROUP,              /* A neighbour in the group saw motion, value holds its hold time in ms */
+} light_event_type_t;
+
+typedef struct
+{
+    light_event_type_t type;
+    uint8_t zone;                   /* Index into g_zone_table, 0 for board wide events */
+    int64_t timestamp_us;           /* esp_timer_get_time() when the event was raised */
+    uint32_t value;                 /* Payload, see the event type */
+} light_event_t;
+
+#endif /* _LIGHT_EVENTS_H_ */
@@ -0,0 +1,41 @@
+#ifndef _LIGHT_HAL_H_
+#define _LIGHT_HAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "light_events.h"
+
+/* The platform under the lighting logic. light_controller.c, led_fade.c, occupancy.c and
+   schedule.c only reach the hardware, the clocks and the event queue through these calls;
+   light_hal_esp.c implements them on the ESP32, light_hal_linux.c on the host clock for the
+   linux target build and host_sim/sim_hal.c on a virtual clock. */
+
+typedef struct light_hal_timer *light_hal_timer_t;
+typedef void (*light_hal_timer_cb_t)(void *arg);
+
+/* Monotonic time in microseconds, the time base of event timestamps */
+int64_t light_hal_now_us(void);
+
+/* Whether the wall clock has been set */
+bool light_hal_clock_valid(time_t now);
+
+/* Posts an event to the lighting event queue, returns false if the queue is full */
+bool light_hal_post_event(const light_event_t *event);
+
+/* One-shot timers, the callback runs outside the lighting task and may only post events */
+light_hal_timer_t light_hal_timer_create(light_hal_timer_cb_t callback, void *arg, const char *name);
+void light_hal_timer_start(light_hal_timer_t timer, uint64_t timeoutUs);
+void light_hal_timer_stop(light_hal_timer_t timer);
+
+/* Current level of a zone's motion sensor */
+int light_hal_sensor_level(uint8_t zone);
+
+/* A zone's PWM channel. A fade ramps linearly to 'duty' and posts LIGHT_EVENT_FADE_DONE when
+   it ends. light_hal_led_stop() stops a running fade and returns the duty reached; it returns
+   false where the hardware can not stop a fade, which then runs to its end. */
+void light_hal_led_fade(uint8_t zone, uint32_t duty, uint32_t timeMs);
+bool light_hal_led_stop(uint8_t zone, uint32_t *duty);
+void light_hal_led_set(uint8_t zone, uint32_t duty);
+
+#endif /* _LIGHT_HAL_H_ */
@@ -0,0 +1,175 @@
+/*******************************************************************************************
+Light HAL, ESP32
+
+light_hal.h on ESP-IDF: events go to the FreeRTOS lighting queue, timers are esp_timer
+one-shots, the sensors are read through motion_sensor.c and the LEDs are LEDC channels whose
+hardware fade-end interrupt posts LIGHT_EVENT_FADE_DONE. The zone index is the fade callback
+argument. A running hardware fade holds off light sleep (power.c). With
+CONFIG_LIGHT_OUTPUT_STRIP the LEDs are segments of an addressable strip instead (pixel_strip.c),
+which posts the same events.
+
+********************************************************************************************/
+#include "light_hal_esp.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "soc/soc_caps.h"
+#include "motion_sensor.h"
+#include "time_sync.h"
+#include "power.h"
+#include "pixel_strip.h"
+
+static QueueHandle_t s_event_queue;
+
+#ifdef CONFIG_LIGHT_OUTPUT_STRIP
+
+void light_hal_esp_init(QueueHandle_t eventQueue)
+{
+    /* This function starts the strip output, events are delivered on eventQueue. The zones'
+       segments are added with pixel_strip_add_segment(). */
+    s_event_queue = eventQueue;
+    pixel_strip_init();
+}
+
+#else
+
+typedef struct
+{
+    ledc_mode_t speedMode;
+    ledc_channel_t channel;
+} light_hal_led_t;
+
+static light_hal_led_t s_leds[ZONE_MAX];
+
+static IRAM_ATTR bool fade_end_cb(const ledc_cb_param_t *param, void *user_arg)
+{
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+
+    if (param->event == LEDC_FADE_END_EVT)
+    {
+        light_event_t event = {
+            .type = LIGHT_EVENT_FADE_DONE,
+            .zone = (uint8_t)(uintptr_t)user_arg,
+            .timestamp_us = esp_timer_get_time(),
+            .value = param->duty,
+        };
+        power_fade_end(event.zone);
+        xQueueSendFromISR(s_event_queue, &event, &higherPriorityTaskWoken);
+    }
+    return higherPriorityTaskWoken == pdTRUE;
+}
+
+void light_hal_esp_init(QueueHandle_t eventQueue)
+{
+    /* This function installs the LEDC fade service, events are delivered on eventQueue */
+    s_event_queue = eventQueue;
+    ESP_ERROR_CHECK(ledc_fade_func_install(0));
+}
+
+void light_hal_esp_add_led(uint8_t zone, const ledc_channel_config_t *channel)
+{
+    /* This function registers the fade-end callback for a zone's configured channel */
+    ledc_cbs_t callbacks = {
+        .fade_cb = fade_end_cb,
+    };
+
+    s_leds[zone].speedMode = channel->speed_mode;
+    s_leds[zone].channel = channel->channel;
+    ESP_ERROR_CHECK(ledc_cb_register(channel->speed_mode, channel->channel, &callbacks, (void *)(uintptr_t)zone));
+}
+
+#endif /* CONFIG_LIGHT_OUTPUT_STRIP */
+
+int64_t light_hal_now_us(void)
+{
+    return esp_timer_get_time();
+}
+
+bool light_hal_clock_valid(time_t now)
+{
+    return time_sync_clock_valid(now);
+}
+
+bool light_hal_post_event(const light_event_t *event)
+{
+    return xQueueSend(s_event_queue, event, 0) == pdTRUE;
+}
+
+light_hal_timer_t light_hal_timer_create(light_hal_timer_cb_t callback, void *arg, const char *name)
+{
+    const esp_timer_create_args_t timerArgs = {
+        .callback = callback,
+        .arg = arg,
+        .name = name,
+    };
+    esp_timer_handle_t timer;
+
+    ESP_ERROR_CHECK(esp_timer_create(&timerArgs, &timer));
+    return (light_hal_timer_t)timer;
+}
+
+void light_hal_timer_start(light_hal_timer_t timer, uint64_t timeoutUs)
+{
+    esp_timer_stop((esp_timer_handle_t)timer);
+    ESP_ERROR_CHECK(esp_timer_start_once((esp_timer_handle_t)timer, timeoutUs));
+}
+
+void light_hal_timer_stop(light_hal_timer_t timer)
+{
+    esp_timer_stop((esp_timer_handle_t)timer);
+}
+
+int light_hal_sensor_level(uint8_t zone)
+{
+    return motion_sensor_level(zone);
+}
+
+#ifdef CONFIG_LIGHT_OUTPUT_STRIP
+
+void light_hal_led_fade(uint8_t zone, uint32_t duty, uint32_t timeMs)
+{
+    pixel_strip_fade(zone, duty, timeMs);
+}
+
+bool light_hal_led_stop(uint8_t zone, uint32_t *duty)
+{
+    *duty = pixel_strip_stop(zone);
+    return true;
+}
+
+void light_hal_led_set(uint8_t zone, uint32_t duty)
+{
+    pixel_strip_set(zone, duty);
+}
+
+#else
+
+void light_hal_led_fade(uint8_t zone, uint32_t duty, uint32_t timeMs)
+{
+    power_fade_begin(zone);
+    ledc_set_fade_with_time(s_leds[zone].speedMode, s_leds[zone].channel, duty, timeMs);
+    ledc_fade_start(s_leds[zone].speedMode, s_leds[zone].channel, LEDC_FADE_NO_WAIT);
+}
+
+bool light_hal_led_stop(uint8_t zone, uint32_t *duty)
+{
+#if SOC_LEDC_SUPPORT_FADE_STOP
+    ledc_fade_stop(s_leds[zone].speedMode, s_leds[zone].channel);
+    power_fade_end(zone);
+    *duty = ledc_get_duty(s_leds[zone].speedMode, s_leds[zone].channel);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void light_hal_led_set(uint8_t zone, uint32_t duty)
+{
+#if SOC_LEDC_SUPPORT_FADE_STOP
+    ledc_fade_stop(s_leds[zone].speedMode, s_leds[zone].channel);
+#endif
+    power_fade_end(zone);
+    ledc_set_duty_and_update(s_leds[zone].speedMode, s_leds[zone].channel, duty, 0);
+}
+
+#endif /* CONFIG_LIGHT_OUTPUT_STRIP */
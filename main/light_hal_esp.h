@@ -0,0 +1,13 @@
+#ifndef _LIGHT_HAL_ESP_H_
+#define _LIGHT_HAL_ESP_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/ledc.h"
+#include "light_hal.h"
+
+void light_hal_esp_init(QueueHandle_t eventQueue);
+void light_hal_esp_add_led(uint8_t zone, const ledc_channel_config_t *channel);
+
+#endif /* _LIGHT_HAL_ESP_H_ */
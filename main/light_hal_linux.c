@@ -0,0 +1,153 @@
+/*******************************************************************************************
+Light HAL, Linux
+
+light_hal.h for the linux target build, which runs the lighting logic and the HTTP API as a host
+program for tests. Events go to the FreeRTOS lighting queue, timers are FreeRTOS software
+timers and the clocks are the host's. There are no LEDs: a fade sets its target duty right
+away and posts LIGHT_EVENT_FADE_DONE once its time is up, like a hardware fade that can not be
+stopped. The sensor levels are whatever light_hal_linux_set_sensor() last set.
+
+********************************************************************************************/
+#include "light_hal_linux.h"
+#include "esp_log.h"
+#include "freertos/timers.h"
+#include "time_sync.h"
+
+static const char *TAG = "light_hal";
+
+#define LINUX_HAL_MAX_TIMERS (2 * ZONE_MAX)    /* A pulse width and an occupancy timer per zone */
+
+struct light_hal_timer
+{
+    TimerHandle_t handle;
+    light_hal_timer_cb_t callback;
+    void *arg;
+};
+
+typedef struct
+{
+    TimerHandle_t fadeTimer;
+    uint32_t duty;
+    int sensorLevel;
+} linux_zone_t;
+
+static QueueHandle_t s_event_queue;
+static struct light_hal_timer s_timers[LINUX_HAL_MAX_TIMERS];
+static uint8_t s_timer_count = 0;
+static linux_zone_t s_zones[ZONE_MAX];
+
+static TickType_t ticks_from_us(uint64_t timeoutUs)
+{
+    /* Rounded up, plus one: the period counts from the last tick, which may be up to a tick
+       ago, and a timer must not fire before its time (occupancy.c checks the time) */
+    return (TickType_t)((timeoutUs + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000)) + 1;
+}
+
+static void timer_cb(TimerHandle_t handle)
+{
+    struct light_hal_timer *timer = pvTimerGetTimerID(handle);
+    timer->callback(timer->arg);
+}
+
+static void post_fade_done(uint8_t zone)
+{
+    light_event_t event = {
+        .type = LIGHT_EVENT_FADE_DONE,
+        .zone = zone,
+        .timestamp_us = light_hal_now_us(),
+        .value = s_zones[zone].duty,
+    };
+    light_hal_post_event(&event);
+}
+
+static void fade_timer_cb(TimerHandle_t handle)
+{
+    post_fade_done((uint8_t)(uintptr_t)pvTimerGetTimerID(handle));
+}
+
+void light_hal_linux_init(QueueHandle_t eventQueue)
+{
+    /* This function sets up the fade timers, events are delivered on eventQueue */
+    s_event_queue = eventQueue;
+    for (uint8_t zone = 0; zone < ZONE_MAX; zone++)
+    {
+        s_zones[zone].fadeTimer = xTimerCreate("fade", 1, pdFALSE, (void *)(uintptr_t)zone, fade_timer_cb);
+    }
+}
+
+void light_hal_linux_set_sensor(uint8_t zone, int level)
+{
+    s_zones[zone].sensorLevel = level;
+}
+
+int64_t light_hal_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+bool light_hal_clock_valid(time_t now)
+{
+    return now >= TIME_SYNC_VALID_EPOCH;
+}
+
+bool light_hal_post_event(const light_event_t *event)
+{
+    return xQueueSend(s_event_queue, event, 0) == pdTRUE;
+}
+
+light_hal_timer_t light_hal_timer_create(light_hal_timer_cb_t callback, void *arg, const char *name)
+{
+    struct light_hal_timer *timer;
+
+    if (s_timer_count == LINUX_HAL_MAX_TIMERS)
+    {
+        ESP_LOGE(TAG, "Out of timers for %s", name);
+        return NULL;
+    }
+    timer = &s_timers[s_timer_count++];
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->handle = xTimerCreate(name, 1, pdFALSE, timer, timer_cb);
+    return timer;
+}
+
+void light_hal_timer_start(light_hal_timer_t timer, uint64_t timeoutUs)
+{
+    /* Changing the period (re)starts the timer */
+    xTimerChangePeriod(timer->handle, ticks_from_us(timeoutUs), portMAX_DELAY);
+}
+
+void light_hal_timer_stop(light_hal_timer_t timer)
+{
+    xTimerStop(timer->handle, portMAX_DELAY);
+}
+
+int light_hal_sensor_level(uint8_t zone)
+{
+    return s_zones[zone].sensorLevel;
+}
+
+void light_hal_led_fade(uint8_t zone, uint32_t duty, uint32_t timeMs)
+{
+    s_zones[zone].duty = duty;
+    if (timeMs == 0)
+    {
+        post_fade_done(zone);
+        return;
+    }
+    xTimerChangePeriod(s_zones[zone].fadeTimer, ticks_from_us((uint64_t)timeMs * 1000), portMAX_DELAY);
+}
+
+bool light_hal_led_stop(uint8_t zone, uint32_t *duty)
+{
+    return false;
+}
+
+void light_hal_led_set(uint8_t zone, uint32_t duty)
+{
+    xTimerStop(s_zones[zone].fadeTimer, portMAX_DELAY);
+    s_zones[zone].duty = duty;
+}
@@ -0,0 +1,12 @@
+#ifndef _LIGHT_HAL_LINUX_H_
+#define _LIGHT_HAL_LINUX_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "light_hal.h"
+
+void light_hal_linux_init(QueueHandle_t eventQueue);
+void light_hal_linux_set_sensor(uint8_t zone, int level);
+
+#endif /* _LIGHT_HAL_LINUX_H_ */
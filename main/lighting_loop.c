@@ -0,0 +1,95 @@
+/*******************************************************************************************
+Lighting Loop
+
+The body of the lighting task, shared by the chip (light_automation_main.c) and the linux
+target (light_automation_linux.c). It owns the LEDs of all zones: it sleeps on the event queue
+until a motion edge, a fade segment end, an occupancy hold expiry, an ambient light crossing, an
+API request or the next schedule transition of any zone, whichever comes first, and hands the
+event to the controller. The hour blink and the power management of the chip come in through
+the hooks.
+
+********************************************************************************************/
+#include "lighting_loop.h"
+#include "light_controller.h"
+#include "schedule.h"
+#include "metrics.h"
+#include "http_api.h"
+#ifdef CONFIG_LIGHT_AMBIENT_SENSOR
+#include "ambient_light.h"
+#endif
+
+static TickType_t ticks_until(time_t when, time_t now)
+{
+    /* This function converts the wait for a wall clock instant into ticks for the queue timeout */
+    time_t seconds = when - now;
+    if (seconds <= 0)
+    {
+        return 0;
+    }
+    if (seconds > SCHEDULE_MAX_SLEEP_S)
+    {
+        seconds = SCHEDULE_MAX_SLEEP_S;
+    }
+    return pdMS_TO_TICKS((uint32_t)seconds * 1000);
+}
+
+void lighting_loop_run(QueueHandle_t queue, const lighting_loop_hooks_t *hooks)
+{
+    /* This function runs the lighting task and does not return */
+    light_event_t event;
+    time_t nextCheck = light_controller_update(time(NULL));
+
+    if (hooks->started != NULL)
+    {
+        hooks->started();
+    }
+    while(true)
+    {
+        time_t now = time(NULL);
+        metrics_count(METRIC_LOOP_ITERATIONS);
+        if (now >= nextCheck)
+        {
+            nextCheck = light_controller_update(now);
+        }
+
+        if ((hooks->idle != NULL) && (uxQueueMessagesWaiting(queue) == 0))
+        {
+            hooks->idle(now, nextCheck);
+        }
+        if (xQueueReceive(queue, &event, ticks_until(nextCheck, now)) != pdTRUE)
+        {
+            continue;
+        }
+        metrics_count(METRIC_EVENTS);
+        if ((hooks->event != NULL) && hooks->event(&event))
+        {
+            continue;
+        }
+
+        switch (event.type)
+        {
+            case LIGHT_EVENT_TIME_SYNCED:
+                light_controller_handle_event(&event);
+                nextCheck = light_controller_update(time(NULL));
+                break;
+#ifdef CONFIG_LIGHT_AMBIENT_SENSOR
+            case LIGHT_EVENT_AMBIENT:
+                light_controller_set_dark(ambient_light_handle_event(&event));
+                nextCheck = light_controller_update(time(NULL));
+                break;
+#endif
+#ifdef CONFIG_LIGHT_HTTP_API
+            case LIGHT_EVENT_API:
+                nextCheck = http_api_handle_event(&event, nextCheck);
+                break;
+#endif
+            default:
+                light_controller_handle_event(&event);
+                break;
+        }
+        if (hooks->handled != NULL)
+        {
+            hooks->handled(&event);
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef _LIGHTING_LOOP_H_
+#define _LIGHTING_LOOP_H_
+
+#include <stdbool.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "light_events.h"
+
+/* What an entry point adds to the lighting loop, any member may be NULL */
+typedef struct
+{
+    void (*started)(void);                              /* After the first update */
+    void (*idle)(time_t now, time_t nextCheck);         /* The queue is empty, about to wait */
+    bool (*event)(const light_event_t *event);          /* Before dispatch, true if it took the event */
+    void (*handled)(const light_event_t *event);        /* After dispatch */
+} lighting_loop_hooks_t;
+
+void lighting_loop_run(QueueHandle_t queue, const lighting_loop_hooks_t *hooks);
+
+#endif /* _LIGHTING_LOOP_H_ */
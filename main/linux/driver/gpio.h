@@ -0,0 +1,6 @@
+/* The GPIO types used by zone.h, for the linux target build */
+#pragma once
+
+typedef int gpio_num_t;
+
+#define GPIO_NUM_NC (-1)
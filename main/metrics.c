@@ -0,0 +1,191 @@
+/*******************************************************************************************
+Metrics
+
+Counters and log2 histograms for the hot paths, cheap enough to stay on in production. A
+count or a sample is a handful of atomic read-modify-writes on 32-bit words, no lock and no
+formatting, so they are safe from any task and timer callback on either core. Nothing is
+formatted until somebody asks: metrics_console.c prints them on the `metrics` console command
+and hands out the binary snapshot.
+
+The metrics are platform-free and built into the host simulation too.
+
+********************************************************************************************/
+#include "metrics.h"
+#include <stdbool.h>
+#include <string.h>
+
+/* Same words as metrics_histogram_t, but aligned for the atomics */
+typedef struct
+{
+    uint32_t count;
+    uint32_t sum;
+    uint32_t max;
+    uint32_t buckets[METRICS_BUCKETS];
+} histogram_state_t;
+
+static uint32_t s_counters[METRIC_COUNTER_COUNT];
+static histogram_state_t s_histograms[METRIC_HISTOGRAM_COUNT];
+static metrics_stack_t s_stacks[METRICS_MAX_TASKS];
+
+static const char *const s_counter_names[METRIC_COUNTER_COUNT] = {
+    [METRIC_LOOP_ITERATIONS] = "loop_iterations",
+    [METRIC_EVENTS] = "events",
+    [METRIC_LIGHT_UPS] = "light_ups",
+    [METRIC_FADES] = "fades",
+    [METRIC_TIME_SYNCS] = "time_syncs",
+    [METRIC_TIME_SYNC_FAILURES] = "time_sync_failures",
+    [METRIC_WIFI_CONNECTS] = "wifi_connects",
+    [METRIC_WIFI_FAILURES] = "wifi_failures",
+    [METRIC_GROUP_SENT] = "group_sent",
+    [METRIC_GROUP_RATE_LIMITED] = "group_rate_limited",
+    [METRIC_GROUP_RECEIVED] = "group_received",
+};
+
+static const struct
+{
+    const char *name;
+    const char *unit;
+} s_histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_EDGE_TO_DUTY_US] = { "edge_to_duty", "us" },
+    [METRIC_FADE_MS] = { "fade", "ms" },
+    [METRIC_SNTP_SYNC_MS] = { "sntp_sync", "ms" },
+    [METRIC_WIFI_CONNECT_MS] = { "wifi_connect", "ms" },
+    [METRIC_GROUP_LATENCY_US] = { "group_latency", "us" },
+};
+
+static uint8_t bucket_of(uint32_t value)
+{
+    uint8_t bucket = (value == 0) ? 0 : (uint8_t)(32 - __builtin_clz(value));
+    return (bucket < METRICS_BUCKETS) ? bucket : (METRICS_BUCKETS - 1);
+}
+
+void metrics_count(metric_counter_t counter)
+{
+    __atomic_fetch_add(&s_counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+void metrics_record(metric_histogram_t histogram, uint32_t value)
+{
+    /* This function adds a sample to a histogram. The maximum is raised with a compare and
+       swap that only loops while another core raises it at the same time. */
+    histogram_state_t *h = &s_histograms[histogram];
+    uint32_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->buckets[bucket_of(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    while ((value > max) &&
+           !__atomic_compare_exchange_n(&h->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+void metrics_set_stack(uint8_t index, const char *name, uint32_t freeBytes)
+{
+    /* This function stores a task's stack high-water mark for the snapshot, sampled by the
+       caller */
+    if (index >= METRICS_MAX_TASKS)
+    {
+        return;
+    }
+    strncpy(s_stacks[index].name, name, METRICS_TASK_NAME_LEN - 1);
+    s_stacks[index].name[METRICS_TASK_NAME_LEN - 1] = '\0';
+    s_stacks[index].freeBytes = freeBytes;
+}
+
+void metrics_snapshot(metrics_snapshot_t *snapshot, int64_t uptimeUs)
+{
+    /* This function copies every metric into a snapshot. The words are read one by one while
+       the writers keep going, so a histogram may be a sample or two apart from its count. */
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->magic = METRICS_SNAPSHOT_MAGIC;
+    snapshot->version = METRICS_SNAPSHOT_VERSION;
+    snapshot->size = sizeof(*snapshot);
+    snapshot->uptimeUs = uptimeUs;
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        snapshot->counters[i] = __atomic_load_n(&s_counters[i], __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        const histogram_state_t *h = &s_histograms[i];
+        metrics_histogram_t *copy = &snapshot->histograms[i];
+        copy->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        copy->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+        copy->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+        {
+            copy->buckets[b] = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(snapshot->stacks, s_stacks, sizeof(s_stacks));
+}
+
+void metrics_reset(void)
+{
+    /* This function clears the counters and histograms. Samples recorded while it runs may
+       survive it in part. */
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        __atomic_store_n(&s_counters[i], 0, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        histogram_state_t *h = &s_histograms[i];
+        __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+        {
+            __atomic_store_n(&h->buckets[b], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+const char *metrics_counter_name(metric_counter_t counter)
+{
+    return s_counter_names[counter];
+}
+
+const char *metrics_histogram_name(metric_histogram_t histogram)
+{
+    return s_histogram_names[histogram].name;
+}
+
+const char *metrics_histogram_unit(metric_histogram_t histogram)
+{
+    return s_histogram_names[histogram].unit;
+}
+
+uint32_t metrics_bucket_upper(uint8_t bucket)
+{
+    /* This function returns the largest value a bucket holds, UINT32_MAX for the last one */
+    if (bucket >= METRICS_BUCKETS - 1)
+    {
+        return UINT32_MAX;
+    }
+    return (bucket == 0) ? 0 : ((1u << bucket) - 1);
+}
+
+uint32_t metrics_percentile(const metrics_histogram_t *histogram, uint8_t percent)
+{
+    /* This function returns an upper bound for a percentile: the top of the bucket it falls
+       in, capped at the maximum seen */
+    uint64_t rank = ((uint64_t)histogram->count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    if (histogram->count == 0)
+    {
+        return 0;
+    }
+    for (uint8_t b = 0; b < METRICS_BUCKETS; b++)
+    {
+        seen += histogram->buckets[b];
+        if (seen >= rank)
+        {
+            uint32_t upper = metrics_bucket_upper(b);
+            return (upper < histogram->max) ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
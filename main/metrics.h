@@ -0,0 +1,78 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    METRIC_LOOP_ITERATIONS,         /* Passes of the lighting task loop */
+    METRIC_EVENTS,                  /* Events taken off the lighting queue */
+    METRIC_LIGHT_UPS,               /* Accepted motion that started a fade up */
+    METRIC_FADES,                   /* Fades that reached their target */
+    METRIC_TIME_SYNCS,
+    METRIC_TIME_SYNC_FAILURES,
+    METRIC_WIFI_CONNECTS,
+    METRIC_WIFI_FAILURES,
+    METRIC_GROUP_SENT,              /* Motion packets sent to the group */
+    METRIC_GROUP_RATE_LIMITED,      /* Motion not sent to the group by the rate limits */
+    METRIC_GROUP_RECEIVED,          /* Neighbour motion taken, without the duplicates */
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+typedef enum
+{
+    METRIC_EDGE_TO_DUTY_US,         /* Sensor edge to the first duty update of the fade up */
+    METRIC_FADE_MS,                 /* Start of a fade to reaching its target */
+    METRIC_SNTP_SYNC_MS,            /* SNTP start to the clock being set */
+    METRIC_WIFI_CONNECT_MS,         /* wifi_connect() call to an IP */
+    METRIC_GROUP_LATENCY_US,        /* A neighbour sending motion to receiving it, with synced clocks */
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram_t;
+
+/* Bucket 0 holds 0, bucket i the values from 2^(i-1) to 2^i - 1, the last one everything above */
+#define METRICS_BUCKETS 20
+#define METRICS_MAX_TASKS 6
+#define METRICS_TASK_NAME_LEN 12
+
+#define METRICS_SNAPSHOT_MAGIC 0x54454D4Cu     /* "LMET" */
+#define METRICS_SNAPSHOT_VERSION 2
+
+typedef struct __attribute__((packed))
+{
+    uint32_t count;
+    uint32_t sum;                   /* Wraps, the mean is only good while it has not */
+    uint32_t max;
+    uint32_t buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+typedef struct __attribute__((packed))
+{
+    char name[METRICS_TASK_NAME_LEN];
+    uint32_t freeBytes;             /* Stack high-water mark, bytes never used */
+} metrics_stack_t;
+
+/* The binary snapshot, little endian as the chip stores it */
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;                  /* sizeof(metrics_snapshot_t) */
+    int64_t uptimeUs;
+    uint32_t counters[METRIC_COUNTER_COUNT];
+    metrics_histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+    metrics_stack_t stacks[METRICS_MAX_TASKS];
+} metrics_snapshot_t;
+
+void metrics_count(metric_counter_t counter);
+void metrics_record(metric_histogram_t histogram, uint32_t value);
+void metrics_set_stack(uint8_t index, const char *name, uint32_t freeBytes);
+void metrics_snapshot(metrics_snapshot_t *snapshot, int64_t uptimeUs);
+void metrics_reset(void);
+const char *metrics_counter_name(metric_counter_t counter);
+const char *metrics_histogram_name(metric_histogram_t histogram);
+const char *metrics_histogram_unit(metric_histogram_t histogram);
+uint32_t metrics_bucket_upper(uint8_t bucket);
+uint32_t metrics_percentile(const metrics_histogram_t *histogram, uint8_t percent);
+
+#endif /* _METRICS_H_ */
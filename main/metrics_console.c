@@ -0,0 +1,285 @@
+/*******************************************************************************************
+Metrics Console
+
+Reads out metrics.c, the deferred log and the journal on the UART console
+(CONFIG_LIGHT_CONSOLE), and takes the Wi-Fi credentials:
+
+    metrics         counters, histograms with their percentiles, and task stack high-water marks
+    metrics bin     the metrics_snapshot_t as hex, for a script to decode
+    metrics reset   clears the counters and histograms
+    log             formats and prints the deferred log (check_hour and friends)
+    journal         prints the journal oldest first, one line per record
+    journal bin     the journal records as hex, 8 bytes to a line
+    journal stats   record counts and flash writes of the journal
+    journal flush   writes the staged journal records to flash now
+    wifi <ssid> <password>
+                    stores the Wi-Fi credentials in NVS for the next connect
+
+Stack high-water marks are not tracked on the hot path; the tasks register themselves with
+metrics_console_watch_task() and their marks are sampled when a snapshot is taken.
+
+********************************************************************************************/
+#include "metrics_console.h"
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "metrics.h"
+#include "deferred_log.h"
+#include "journal.h"
+#include "wifi_connection.h"
+#ifdef CONFIG_LIGHT_CONSOLE
+#include "esp_console.h"
+#endif
+
+static const char *TAG = "metrics";
+
+#define METRICS_HEX_PER_LINE 32
+
+static TaskHandle_t s_tasks[METRICS_MAX_TASKS];
+static uint32_t s_task_count = 0;
+
+void metrics_console_watch_task(TaskHandle_t task)
+{
+    /* This function adds a task to the stack high-water marks, the calling task for NULL. A
+       task already watched is not added again. */
+    uint32_t index;
+
+    if (task == NULL)
+    {
+        task = xTaskGetCurrentTaskHandle();
+    }
+    for (uint32_t i = 0; i < __atomic_load_n(&s_task_count, __ATOMIC_ACQUIRE); i++)
+    {
+        if (s_tasks[i] == task)
+        {
+            return;
+        }
+    }
+    index = __atomic_fetch_add(&s_task_count, 1, __ATOMIC_ACQ_REL);
+    if (index >= METRICS_MAX_TASKS)
+    {
+        ESP_LOGW(TAG, "No room to watch the stack of %s", pcTaskGetName(task));
+        __atomic_store_n(&s_task_count, METRICS_MAX_TASKS, __ATOMIC_RELEASE);
+        return;
+    }
+    s_tasks[index] = task;
+}
+
+void metrics_console_sample_stacks(void)
+{
+    /* This function stores the stack high-water mark of every watched task, in bytes as the
+       IDF counts stack */
+    uint32_t count = __atomic_load_n(&s_task_count, __ATOMIC_ACQUIRE);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (s_tasks[i] != NULL)
+        {
+            metrics_set_stack(i, pcTaskGetName(s_tasks[i]), uxTaskGetStackHighWaterMark(s_tasks[i]));
+        }
+    }
+}
+
+#ifdef CONFIG_LIGHT_CONSOLE
+
+static metrics_snapshot_t s_snapshot;  /* Only used by the console task, kept off its stack */
+
+static void take_snapshot(void)
+{
+    metrics_console_watch_task(NULL);
+    metrics_console_sample_stacks();
+    metrics_snapshot(&s_snapshot, esp_timer_get_time());
+}
+
+static void print_metrics(void)
+{
+    printf("uptime %lld s\n", (long long)(s_snapshot.uptimeUs / 1000000));
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        printf("%-20s %lu\n", metrics_counter_name(i), (unsigned long)s_snapshot.counters[i]);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        const metrics_histogram_t *h = &s_snapshot.histograms[i];
+        const char *unit = metrics_histogram_unit(i);
+        printf("%-14s n %lu mean %lu %s, p50 <= %lu, p90 <= %lu, p99 <= %lu, max %lu %s\n",
+               metrics_histogram_name(i), (unsigned long)h->count,
+               (unsigned long)((h->count > 0) ? (h->sum / h->count) : 0), unit,
+               (unsigned long)metrics_percentile(h, 50), (unsigned long)metrics_percentile(h, 90),
+               (unsigned long)metrics_percentile(h, 99), (unsigned long)h->max, unit);
+    }
+    for (int i = 0; i < METRICS_MAX_TASKS; i++)
+    {
+        if (s_snapshot.stacks[i].name[0] != '\0')
+        {
+            printf("stack %-12s %lu bytes free\n", s_snapshot.stacks[i].name,
+                   (unsigned long)s_snapshot.stacks[i].freeBytes);
+        }
+    }
+}
+
+static void print_snapshot_hex(void)
+{
+    const uint8_t *bytes = (const uint8_t *)&s_snapshot;
+
+    for (size_t i = 0; i < sizeof(s_snapshot); i++)
+    {
+        printf("%02x", bytes[i]);
+        if (((i + 1) % METRICS_HEX_PER_LINE == 0) || (i + 1 == sizeof(s_snapshot)))
+        {
+            printf("\n");
+        }
+    }
+}
+
+static int metrics_cmd(int argc, char **argv)
+{
+    if ((argc > 1) && (strcmp(argv[1], "reset") == 0))
+    {
+        metrics_reset();
+        printf("metrics cleared\n");
+        return 0;
+    }
+    take_snapshot();
+    if ((argc > 1) && (strcmp(argv[1], "bin") == 0))
+    {
+        print_snapshot_hex();
+    }
+    else if (argc > 1)
+    {
+        printf("usage: metrics [bin|reset]\n");
+        return 1;
+    }
+    else
+    {
+        print_metrics();
+    }
+    return 0;
+}
+
+static int log_cmd(int argc, char **argv)
+{
+    deferred_log_drain(stdout);
+    return 0;
+}
+
+static int journal_cmd(int argc, char **argv)
+{
+    /* The journal is streamed a record at a time, never copied as a whole */
+    const char *option = (argc > 1) ? argv[1] : "";
+    journal_cursor_t cursor;
+    journal_record_t record;
+    uint32_t count = 0;
+
+    if (strcmp(option, "flush") == 0)
+    {
+        journal_flush();
+        return 0;
+    }
+    if (strcmp(option, "stats") == 0)
+    {
+        journal_stats_t stats;
+        journal_get_stats(&stats);
+        printf("%lu of %lu records on flash, %lu staged, %lu dropped, %lu writes and %lu erases since boot\n",
+               (unsigned long)stats.written, (unsigned long)stats.capacity, (unsigned long)stats.staged,
+               (unsigned long)stats.dropped, (unsigned long)stats.batches, (unsigned long)stats.erases);
+        return 0;
+    }
+    if ((option[0] != '\0') && (strcmp(option, "bin") != 0))
+    {
+        printf("usage: journal [bin|stats|flush]\n");
+        return 1;
+    }
+
+    journal_read_begin(&cursor);
+    while (journal_read_next(&cursor, &record))
+    {
+        if (option[0] != '\0')
+        {
+            const uint8_t *bytes = (const uint8_t *)&record;
+            for (size_t i = 0; i < sizeof(record); i++)
+            {
+                printf("%02x", bytes[i]);
+            }
+            printf("\n");
+        }
+        else
+        {
+            char line[64];
+            journal_format(&record, line, sizeof(line));
+            printf("%s\n", line);
+        }
+        count++;
+    }
+    printf("%lu records\n", (unsigned long)count);
+    return 0;
+}
+
+static int wifi_cmd(int argc, char **argv)
+{
+    /* An open network has no password */
+    if ((argc < 2) || (argc > 3))
+    {
+        printf("usage: wifi <ssid> [<password>]\n");
+        return 1;
+    }
+    esp_err_t ret = wifi_connection_set_credentials(argv[1], (argc > 2) ? argv[2] : "");
+    if (ret != ESP_OK)
+    {
+        printf("credentials not stored: %s\n", esp_err_to_name(ret));
+        return 1;
+    }
+    printf("credentials stored\n");
+    return 0;
+}
+
+void metrics_console_start(void)
+{
+    /* This function starts the console REPL on the UART and registers the commands. Its task
+       and the esp_timer task are watched along with the ones that register themselves. */
+    esp_console_repl_t *repl = NULL;
+    esp_console_repl_config_t replConfig = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    esp_console_dev_uart_config_t uartConfig = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+    const esp_console_cmd_t metricsCommand = {
+        .command = "metrics",
+        .help = "Print the metrics; 'metrics bin' dumps the binary snapshot, 'metrics reset' clears them",
+        .func = metrics_cmd,
+    };
+    const esp_console_cmd_t logCommand = {
+        .command = "log",
+        .help = "Print the deferred log",
+        .func = log_cmd,
+    };
+    const esp_console_cmd_t journalCommand = {
+        .command = "journal",
+        .help = "Print the journal; 'journal bin' as hex, 'journal stats', 'journal flush' writes it to flash now",
+        .func = journal_cmd,
+    };
+    const esp_console_cmd_t wifiCommand = {
+        .command = "wifi",
+        .help = "Store the Wi-Fi credentials for the next connect: 'wifi <ssid> [<password>]'",
+        .func = wifi_cmd,
+    };
+    TaskHandle_t timerTask = xTaskGetHandle("esp_timer");
+
+    if (timerTask != NULL)
+    {
+        metrics_console_watch_task(timerTask);
+    }
+    replConfig.prompt = "light>";
+    ESP_ERROR_CHECK(esp_console_new_repl_uart(&uartConfig, &replConfig, &repl));
+    ESP_ERROR_CHECK(esp_console_cmd_register(&metricsCommand));
+    ESP_ERROR_CHECK(esp_console_cmd_register(&logCommand));
+    ESP_ERROR_CHECK(esp_console_cmd_register(&journalCommand));
+    ESP_ERROR_CHECK(esp_console_cmd_register(&wifiCommand));
+    ESP_ERROR_CHECK(esp_console_start_repl(repl));
+}
+
+#else
+
+void metrics_console_start(void)
+{
+}
+
+#endif
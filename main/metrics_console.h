@@ -0,0 +1,11 @@
+#ifndef _METRICS_CONSOLE_H_
+#define _METRICS_CONSOLE_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+void metrics_console_watch_task(TaskHandle_t task);
+void metrics_console_sample_stacks(void);
+void metrics_console_start(void);
+
+#endif /* _METRICS_CONSOLE_H_ */
@@ -0,0 +1,212 @@
+/*******************************************************************************************
+Motion Filter
+
+Conditioning of the PIR edges before they count as motion, per zone. The edges arrive with the
+hardware timer timestamp taken in the sensor ISR, so pulse widths are measured from those
+instead of by sampling the line:
+
+- Debounce: a level change within CONFIG_LIGHT_MOTION_DEBOUNCE_MS of the previous accepted
+  change is dropped. The first edge after a quiet line is not delayed.
+- Minimum pulse width: a rising edge qualifies once the line has stayed high for
+  CONFIG_LIGHT_MOTION_MIN_PULSE_MS. If that has not passed yet when the edge is handled, a
+  one-shot timer posts LIGHT_EVENT_PULSE_WIDTH for the rest and the line is read again then.
+- N-of-M confirmation: in a vacant zone motion is only accepted once
+  CONFIG_LIGHT_MOTION_CONFIRM_PULSES qualifying pulses fell within
+  CONFIG_LIGHT_MOTION_CONFIRM_WINDOW_S. In an occupied zone every qualifying pulse counts.
+
+Glitches shorter than the minimum width cost one timer arm and no light-up; a real pulse is
+late by the minimum width at most.
+
+Every edge ends up in one of the counters of motion_filter_stats_t.
+
+********************************************************************************************/
+#include "motion_filter.h"
+#include "esp_log.h"
+#include "light_hal.h"
+
+static const char *TAG = "motion_filter";
+
+#define MOTION_FILTER_DEBOUNCE_US ((int64_t)CONFIG_LIGHT_MOTION_DEBOUNCE_MS * 1000)
+#define MOTION_FILTER_MIN_PULSE_US ((int64_t)CONFIG_LIGHT_MOTION_MIN_PULSE_MS * 1000)
+#define MOTION_FILTER_WINDOW_US ((int64_t)CONFIG_LIGHT_MOTION_CONFIRM_WINDOW_S * 1000000)
+#define MOTION_FILTER_NO_EDGE INT64_MIN
+
+#if (CONFIG_LIGHT_MOTION_CONFIRM_PULSES > MOTION_FILTER_MAX_CONFIRM)
+#error "CONFIG_LIGHT_MOTION_CONFIRM_PULSES is above MOTION_FILTER_MAX_CONFIRM"
+#endif
+
+typedef struct
+{
+    uint8_t zone;
+    int64_t changeUs;               /* Last accepted level change */
+    int64_t riseUs;                 /* Rising edge waiting for the minimum width, or MOTION_FILTER_NO_EDGE */
+    light_hal_timer_t widthTimer;
+    uint32_t generation;            /* Bumped on every arm so stale width checks can be told apart */
+    int64_t pulseUs[MOTION_FILTER_MAX_CONFIRM];     /* Recent qualifying pulses, oldest first */
+    uint8_t pulseCount;
+    motion_filter_stats_t stats;
+} motion_filter_t;
+
+static motion_filter_t s_filters[ZONE_MAX];
+
+static void width_timer_cb(void *arg)
+{
+    uint8_t zone = (uint8_t)(uintptr_t)arg;
+    light_event_t event = {
+        .type = LIGHT_EVENT_PULSE_WIDTH,
+        .zone = zone,
+        .timestamp_us = light_hal_now_us(),
+        .value = s_filters[zone].generation,
+    };
+
+    if (!light_hal_post_event(&event))
+    {
+        ESP_LOGW(TAG, "Zone %u: event queue full, pulse width check dropped", zone);
+    }
+}
+
+static bool qualify(motion_filter_t *filter, int64_t riseUs, bool occupied)
+{
+    /* This function applies the N-of-M rule to a pulse that passed the width check. It returns
+       true when the pulse is accepted as motion. */
+    if (occupied || (CONFIG_LIGHT_MOTION_CONFIRM_PULSES <= 1))
+    {
+        filter->pulseCount = 0;
+        filter->stats.accepted++;
+        return true;
+    }
+
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < filter->pulseCount; i++)
+    {
+        if (riseUs - filter->pulseUs[i] < MOTION_FILTER_WINDOW_US)
+        {
+            filter->pulseUs[kept++] = filter->pulseUs[i];
+        }
+    }
+    if (kept == MOTION_FILTER_MAX_CONFIRM)
+    {
+        kept--;
+    }
+    filter->pulseUs[kept++] = riseUs;
+    filter->pulseCount = kept;
+
+    if (kept < CONFIG_LIGHT_MOTION_CONFIRM_PULSES)
+    {
+        filter->stats.unconfirmed++;
+        ESP_LOGD(TAG, "Zone %u: pulse %u of %d, not confirmed yet", filter->zone, kept,
+                 CONFIG_LIGHT_MOTION_CONFIRM_PULSES);
+        return false;
+    }
+    filter->pulseCount = 0;
+    filter->stats.accepted++;
+    return true;
+}
+
+static void reject_short(motion_filter_t *filter)
+{
+    filter->riseUs = MOTION_FILTER_NO_EDGE;
+    filter->generation++;
+    filter->stats.shortPulses++;
+    ESP_LOGD(TAG, "Zone %u: pulse shorter than %d ms rejected", filter->zone, CONFIG_LIGHT_MOTION_MIN_PULSE_MS);
+}
+
+void motion_filter_add(uint8_t zone)
+{
+    /* This function sets up the filter of a zone, with the line taken as low */
+    motion_filter_t *filter = &s_filters[zone];
+
+    filter->zone = zone;
+    /* Far enough back for the edge of a deep sleep wake, stamped before the application start */
+    filter->changeUs = INT64_MIN / 2;
+    filter->riseUs = MOTION_FILTER_NO_EDGE;
+    if (MOTION_FILTER_MIN_PULSE_US > 0)
+    {
+        filter->widthTimer = light_hal_timer_create(width_timer_cb, (void *)(uintptr_t)zone, "pulse_width");
+    }
+}
+
+bool motion_filter_edge(const light_event_t *event, bool occupied)
+{
+    /* This function runs a LIGHT_EVENT_MOTION through the filter. It returns true when the edge
+       is accepted as motion right away; a rising edge still short of the minimum width is
+       decided later by motion_filter_handle_event(). */
+    motion_filter_t *filter = &s_filters[event->zone];
+    uint8_t level = (event->value != 0) ? 1 : 0;
+
+    filter->stats.edges++;
+    if (event->timestamp_us - filter->changeUs < MOTION_FILTER_DEBOUNCE_US)
+    {
+        filter->stats.bounces++;
+        return false;
+    }
+    /* Two edges in a row to the same level mean the one between was dropped as a bounce, so
+       every edge past the debounce is a change */
+    filter->changeUs = event->timestamp_us;
+
+    if (level == 0)
+    {
+        if (filter->riseUs != MOTION_FILTER_NO_EDGE)
+        {
+            light_hal_timer_stop(filter->widthTimer);
+            reject_short(filter);
+        }
+        return false;
+    }
+
+    if (MOTION_FILTER_MIN_PULSE_US == 0)
+    {
+        return qualify(filter, event->timestamp_us, occupied);
+    }
+    int64_t remainingUs = event->timestamp_us + MOTION_FILTER_MIN_PULSE_US - light_hal_now_us();
+    filter->riseUs = event->timestamp_us;
+    filter->generation++;
+    if (remainingUs <= 0)
+    {
+        /* The edge waited in the queue for longer than the minimum width */
+        light_event_t check = { .type = LIGHT_EVENT_PULSE_WIDTH, .zone = event->zone, .value = filter->generation };
+        int64_t edgeUs;
+        return motion_filter_handle_event(&check, occupied, &edgeUs);
+    }
+    light_hal_timer_start(filter->widthTimer, (uint64_t)remainingUs);
+    return false;
+}
+
+bool motion_filter_handle_event(const light_event_t *event, bool occupied, int64_t *edgeUs)
+{
+    /* This function finishes the width check of a rising edge on LIGHT_EVENT_PULSE_WIDTH. It
+       returns true, with the time of the edge in edgeUs, when the pulse is accepted as motion.
+       Checks overtaken by a newer edge are ignored. */
+    motion_filter_t *filter = &s_filters[event->zone];
+    int64_t remainingUs;
+
+    if ((event->type != LIGHT_EVENT_PULSE_WIDTH) || (event->value != filter->generation) ||
+        (filter->riseUs == MOTION_FILTER_NO_EDGE))
+    {
+        return false;
+    }
+
+    /* The generation is read when the timer fires, so the check of an older edge that was
+       already under way can pass for this one; it waits for the rest of the width then */
+    remainingUs = filter->riseUs + MOTION_FILTER_MIN_PULSE_US - light_hal_now_us();
+    if (remainingUs > 0)
+    {
+        light_hal_timer_start(filter->widthTimer, (uint64_t)remainingUs);
+        return false;
+    }
+
+    /* A falling edge dropped by the debounce still shows on the line */
+    if (light_hal_sensor_level(event->zone) != 1)
+    {
+        reject_short(filter);
+        return false;
+    }
+    *edgeUs = filter->riseUs;
+    filter->riseUs = MOTION_FILTER_NO_EDGE;
+    return qualify(filter, *edgeUs, occupied);
+}
+
+void motion_filter_get_stats(uint8_t zone, motion_filter_stats_t *stats)
+{
+    *stats = s_filters[zone].stats;
+}
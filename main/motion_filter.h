@@ -0,0 +1,25 @@
+#ifndef _MOTION_FILTER_H_
+#define _MOTION_FILTER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "light_events.h"
+
+#define MOTION_FILTER_MAX_CONFIRM 8
+
+/* Sensor edge and pulse counts of one zone since boot */
+typedef struct
+{
+    uint32_t edges;                 /* Edges seen by the filter */
+    uint32_t bounces;               /* Edges dropped by the debounce */
+    uint32_t shortPulses;           /* Pulses rejected by the minimum width */
+    uint32_t unconfirmed;           /* Qualifying pulses short of the N-of-M confirmation */
+    uint32_t accepted;              /* Pulses passed on as motion */
+} motion_filter_stats_t;
+
+void motion_filter_add(uint8_t zone);
+bool motion_filter_edge(const light_event_t *event, bool occupied);
+bool motion_filter_handle_event(const light_event_t *event, bool occupied, int64_t *edgeUs);
+void motion_filter_get_stats(uint8_t zone, motion_filter_stats_t *stats);
+
+#endif /* _MOTION_FILTER_H_ */
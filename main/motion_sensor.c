@@ -0,0 +1,85 @@
+/*******************************************************************************************
+Motion Sensor
+
+Edge-triggered handling of the PIR sensors. Every edge on a zone's sensor pin is timestamped in
+the ISR and posted to the lighting event queue, so the lighting task reacts as soon as it is
+scheduled instead of on its next polling pass. All zones share the one GPIO ISR service; the
+zone index is the handler argument.
+
+In the light sleep power mode the pins are GPIO wakeup sources. Wakeup is level triggered, so
+there the interrupt is a level interrupt too, switched to the opposite level on every edge.
+
+********************************************************************************************/
+#include "motion_sensor.h"
+#include "light_events.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "power.h"
+
+static const char *TAG = "motion";
+
+static QueueHandle_t s_event_queue;
+static gpio_num_t s_sensor_gpio[ZONE_MAX];
+
+static void IRAM_ATTR motion_isr_handler(void *arg)
+{
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    uint8_t zone = (uint8_t)(uintptr_t)arg;
+    light_event_t event = {
+        .type = LIGHT_EVENT_MOTION,
+        .zone = zone,
+        .timestamp_us = esp_timer_get_time(),
+        .value = gpio_get_level(s_sensor_gpio[zone]),
+    };
+
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+    power_sensor_wakeup(s_sensor_gpio[zone], event.value);
+#endif
+    power_motion_begin();
+    if (xQueueSendFromISR(s_event_queue, &event, &higherPriorityTaskWoken) != pdTRUE)
+    {
+        power_motion_end();
+    }
+    if (higherPriorityTaskWoken)
+    {
+        portYIELD_FROM_ISR();
+    }
+}
+
+void motion_sensor_init(QueueHandle_t eventQueue)
+{
+    /* This function installs the shared GPIO ISR service, edges are delivered on eventQueue */
+    s_event_queue = eventQueue;
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+}
+
+void motion_sensor_add(uint8_t zone, gpio_num_t gpio)
+{
+    /* This function configures a PIR input and routes both of its edges to the event queue */
+    gpio_config_t sensorConfig = {
+        .pin_bit_mask = 1ULL << gpio,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,          /* Same pull as the former gpio_reset_pin() setup */
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+        .intr_type = GPIO_INTR_DISABLE,             /* Level interrupt armed below */
+#else
+        .intr_type = GPIO_INTR_ANYEDGE,
+#endif
+    };
+
+    s_sensor_gpio[zone] = gpio;
+    ESP_ERROR_CHECK(gpio_config(&sensorConfig));
+    ESP_ERROR_CHECK(gpio_isr_handler_add(gpio, motion_isr_handler, (void *)(uintptr_t)zone));
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+    power_sensor_wakeup(gpio, gpio_get_level(gpio));
+    ESP_ERROR_CHECK(gpio_intr_enable(gpio));
+#endif
+    ESP_LOGI(TAG, "Zone %u: motion interrupt enabled on GPIO %d", zone, gpio);
+}
+
+int motion_sensor_level(uint8_t zone)
+{
+    return gpio_get_level(s_sensor_gpio[zone]);
+}
@@ -0,0 +1,13 @@
+#ifndef _MOTION_SENSOR_H_
+#define _MOTION_SENSOR_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/gpio.h"
+
+void motion_sensor_init(QueueHandle_t eventQueue);
+void motion_sensor_add(uint8_t zone, gpio_num_t gpio);
+int motion_sensor_level(uint8_t zone);
+
+#endif /* _MOTION_SENSOR_H_ */
@@ -0,0 +1,147 @@
+/*******************************************************************************************
+Occupancy
+
+Retriggerable occupancy state machine, one per zone. A motion edge marks the zone occupied and
+(re)arms a one-shot timer for the hold time; when the timer runs out it posts
+LIGHT_EVENT_HOLD_EXPIRED to the lighting event queue. Nothing here blocks, so the lighting task
+keeps serving motion and schedule changes for the whole hold time.
+
+A neighbour's motion (group.c) holds a vacant zone in the remote state for the neighbour's hold
+time. A hold is never cut short by a shorter one, whichever side it came from.
+
+********************************************************************************************/
+#include "occupancy.h"
+#include "esp_log.h"
+#include "light_hal.h"
+#include "journal.h"
+
+static const char *TAG = "occupancy";
+
+typedef struct
+{
+    light_hal_timer_t holdTimer;
+    uint32_t holdTimeMs;
+    uint32_t generation;            /* Bumped on every arm so stale expiries can be told apart */
+    int64_t holdEndUs;              /* When the armed timer runs out */
+    occupancy_state_t state;
+} occupancy_t;
+
+static occupancy_t s_zones[ZONE_MAX];
+
+static void hold_timer_cb(void *arg)
+{
+    uint8_t zone = (uint8_t)(uintptr_t)arg;
+    light_event_t event = {
+        .type = LIGHT_EVENT_HOLD_EXPIRED,
+        .zone = zone,
+        .timestamp_us = light_hal_now_us(),
+        .value = s_zones[zone].generation,
+    };
+
+    if (!light_hal_post_event(&event))
+    {
+        ESP_LOGW(TAG, "Zone %u: event queue full, hold expiry dropped", zone);
+    }
+}
+
+static void arm_hold_timer(occupancy_t *occupancy, uint32_t holdTimeMs)
+{
+    occupancy->generation++;
+    occupancy->holdEndUs = light_hal_now_us() + (int64_t)holdTimeMs * 1000;
+    light_hal_timer_start(occupancy->holdTimer, (uint64_t)holdTimeMs * 1000);
+}
+
+static void extend_hold(occupancy_t *occupancy, uint32_t holdTimeMs)
+{
+    /* Re-arm the hold timer unless the running hold lasts longer */
+    if ((occupancy->state == OCCUPANCY_VACANT) ||
+        (light_hal_now_us() + (int64_t)holdTimeMs * 1000 >= occupancy->holdEndUs))
+    {
+        arm_hold_timer(occupancy, holdTimeMs);
+    }
+}
+
+void occupancy_add(uint8_t zone, uint32_t holdTimeMs)
+{
+    /* This function creates the one-shot hold timer of a zone */
+    s_zones[zone].holdTimeMs = holdTimeMs;
+    s_zones[zone].state = OCCUPANCY_VACANT;
+    s_zones[zone].holdTimer = light_hal_timer_create(hold_timer_cb, (void *)(uintptr_t)zone, "occupancy_hold");
+}
+
+bool occupancy_motion(uint8_t zone)
+{
+    /* This function records a motion edge and re-arms the hold timer. It returns true when the
+       zone changed from vacant, or held for a neighbour, to occupied. */
+    occupancy_t *occupancy = &s_zones[zone];
+    bool becameOccupied = (occupancy->state != OCCUPANCY_OCCUPIED);
+
+    extend_hold(occupancy, occupancy->holdTimeMs);
+    occupancy->state = OCCUPANCY_OCCUPIED;
+    return becameOccupied;
+}
+
+bool occupancy_share(uint8_t zone, uint32_t holdTimeMs)
+{
+    /* This function takes a neighbour's motion. A vacant zone is held for the neighbour's hold
+       time, a held one at least that long. It returns true when the zone was vacant. */
+    occupancy_t *occupancy = &s_zones[zone];
+    bool wasVacant = (occupancy->state == OCCUPANCY_VACANT);
+
+    extend_hold(occupancy, holdTimeMs);
+    if (wasVacant)
+    {
+        occupancy->state = OCCUPANCY_REMOTE;
+    }
+    return wasVacant;
+}
+
+bool occupancy_handle_event(const light_event_t *event)
+{
+    /* This function handles a LIGHT_EVENT_HOLD_EXPIRED. It returns true when the zone became
+       vacant. If the sensor still reports presence the hold is extended instead, and expiries
+       that were overtaken by a newer motion edge are ignored. The generation is read when the
+       timer fires, so an expiry under way while the hold was re-armed carries the new one; it
+       is told apart by its time, before the end of the running hold. */
+    occupancy_t *occupancy = &s_zones[event->zone];
+
+    if ((event->type != LIGHT_EVENT_HOLD_EXPIRED) || (event->value != occupancy->generation) ||
+        (event->timestamp_us < occupancy->holdEndUs) || (occupancy->state == OCCUPANCY_VACANT))
+    {
+        return false;
+    }
+
+    if ((occupancy->state == OCCUPANCY_OCCUPIED) && (light_hal_sensor_level(event->zone) == 1))
+    {
+        arm_hold_timer(occupancy, occupancy->holdTimeMs);
+        journal_add(JOURNAL_HOLD_EXTENDED, event->zone, 1);
+        return false;
+    }
+
+    occupancy->state = OCCUPANCY_VACANT;
+    return true;
+}
+
+void occupancy_clear(uint8_t zone)
+{
+    /* This function forces the zone vacant without waiting for the hold timer */
+    light_hal_timer_stop(s_zones[zone].holdTimer);
+    s_zones[zone].generation++;
+    s_zones[zone].state = OCCUPANCY_VACANT;
+}
+
+void occupancy_set_hold_time(uint8_t zone, uint32_t holdTimeMs)
+{
+    /* The new hold time applies from the next motion edge, a running hold is not cut short */
+    s_zones[zone].holdTimeMs = holdTimeMs;
+}
+
+uint32_t occupancy_hold_time(uint8_t zone)
+{
+    return s_zones[zone].holdTimeMs;
+}
+
+occupancy_state_t occupancy_state(uint8_t zone)
+{
+    return s_zones[zone].state;
+}
@@ -0,0 +1,24 @@
+#ifndef _OCCUPANCY_H_
+#define _OCCUPANCY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "light_events.h"
+
+typedef enum
+{
+    OCCUPANCY_VACANT,
+    OCCUPANCY_OCCUPIED,
+    OCCUPANCY_REMOTE,               /* Held for a neighbour's motion, see group.c */
+} occupancy_state_t;
+
+void occupancy_add(uint8_t zone, uint32_t holdTimeMs);
+bool occupancy_motion(uint8_t zone);
+bool occupancy_share(uint8_t zone, uint32_t holdTimeMs);
+bool occupancy_handle_event(const light_event_t *event);
+void occupancy_clear(uint8_t zone);
+void occupancy_set_hold_time(uint8_t zone, uint32_t holdTimeMs);
+uint32_t occupancy_hold_time(uint8_t zone);
+occupancy_state_t occupancy_state(uint8_t zone);
+
+#endif /* _OCCUPANCY_H_ */
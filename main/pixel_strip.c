@@ -0,0 +1,557 @@
+/*******************************************************************************************
+Pixel Strip
+
+The LED output for WS2812 (GRB) and SK6812 (GRBW) addressable strips, selected with
+CONFIG_LIGHT_OUTPUT_STRIP. Every zone owns a segment of one strip; light_hal_esp.c maps the
+zone's PWM calls onto it, so led_fade.c and the controller drive a segment exactly like a
+PWM channel and get LIGHT_EVENT_FADE_DONE at the end of each ramp.
+
+Frames are sent on the RMT peripheral, through DMA where the chip has it (ESP32-S3 and
+later; the ESP32 refills the RMT memory from its ping-pong interrupt instead). A render task
+is woken by a periodic esp_timer at CONFIG_LIGHT_STRIP_FPS, so the frame rate does not
+depend on the tick rate. There are two frame buffers: the next frame is computed into one
+while the other is still being sent, and they swap when that transmission is done.
+
+A segment's ramp is computed once per frame for the zone; the pixels replay it delayed by
+their distance from the pixel nearest the sensor, up to CONFIG_LIGHT_STRIP_SPREAD_MS at the
+far end, so the light spreads out from where the motion was seen and every pixel fades on
+its own. When nothing changes any more the frame timer is stopped; the strip latches the
+last frame and the CPU may sleep.
+
+********************************************************************************************/
+#include "pixel_strip.h"
+#include <string.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/rmt_tx.h"
+#include "driver/rmt_encoder.h"
+#include "soc/soc_caps.h"
+#include "zone.h"
+#include "light_hal.h"
+#include "power.h"
+#include "metrics_console.h"
+
+#ifdef CONFIG_LIGHT_OUTPUT_STRIP
+
+static const char *TAG = "pixel_strip";
+
+#define STRIP_RESOLUTION_HZ 10000000    /* 0.1 us per RMT tick */
+#define STRIP_RESET_TICKS 2800          /* 280 us low latches the frame */
+#define STRIP_FRAME_US (1000000 / CONFIG_LIGHT_STRIP_FPS)
+#define STRIP_SPREAD_FRAMES (CONFIG_LIGHT_STRIP_SPREAD_MS * CONFIG_LIGHT_STRIP_FPS / 1000)
+#define STRIP_HISTORY (STRIP_SPREAD_FRAMES + 1)
+#define STRIP_LEVEL_SHIFT 8             /* Zone levels are 16.8 fixed point of full scale */
+#define STRIP_LEVEL_MAX (0xFFFFu << STRIP_LEVEL_SHIFT)
+
+#define STRIP_TASK_STACK_SIZE 3072
+#define STRIP_TASK_PRIORITY 9           /* Below the lighting task, a render never delays a motion edge */
+#define STRIP_TASK_CORE 1
+
+#define STRIP_RED ((CONFIG_LIGHT_STRIP_COLOR >> 16) & 0xFF)
+#define STRIP_GREEN ((CONFIG_LIGHT_STRIP_COLOR >> 8) & 0xFF)
+#define STRIP_BLUE (CONFIG_LIGHT_STRIP_COLOR & 0xFF)
+
+/* Bit timings in RMT ticks */
+#ifdef CONFIG_LIGHT_STRIP_SK6812
+#define STRIP_TYPE_NAME "SK6812 GRBW"
+#define STRIP_BYTES_PER_PIXEL 4
+#define STRIP_T0H 3
+#define STRIP_T0L 9
+#define STRIP_T1H 6
+#define STRIP_T1L 6
+#else
+#define STRIP_TYPE_NAME "WS2812 GRB"
+#define STRIP_BYTES_PER_PIXEL 3
+#define STRIP_T0H 3
+#define STRIP_T0L 9
+#define STRIP_T1H 9
+#define STRIP_T1L 3
+#endif
+
+#if SOC_RMT_SUPPORT_DMA
+#define STRIP_WITH_DMA 1
+#define STRIP_MEM_BLOCK_SYMBOLS 1024
+#else
+#define STRIP_WITH_DMA 0
+#define STRIP_MEM_BLOCK_SYMBOLS (4 * SOC_RMT_MEM_WORDS_PER_CHANNEL)
+#endif
+
+#if (CONFIG_LIGHT_STRIP_PIXELS > PIXEL_STRIP_MAX_PIXELS)
+#error "CONFIG_LIGHT_STRIP_PIXELS is above PIXEL_STRIP_MAX_PIXELS"
+#endif
+
+/* The pixel bytes followed by the reset time, as one RMT transaction */
+typedef struct
+{
+    rmt_encoder_t base;
+    rmt_encoder_t *bytesEncoder;
+    rmt_encoder_t *copyEncoder;
+    bool pixelsDone;
+    rmt_symbol_word_t resetCode;
+} strip_encoder_t;
+
+typedef struct
+{
+    uint16_t first;
+    uint16_t count;
+    uint16_t origin;                /* Offset of the pixel nearest the sensor in the segment */
+    uint32_t delayScale;            /* Frames of delay per pixel of distance, 24.8 fixed point */
+    uint32_t maxDuty;
+    /* Shared with the lighting task, under s_lock */
+    uint32_t level;
+    uint32_t target;
+    int32_t step;                   /* Level change per frame */
+    uint32_t framesLeft;
+    bool fading;                    /* A LIGHT_EVENT_FADE_DONE is owed at the end of the ramp */
+    /* Render task only */
+    uint16_t history[STRIP_HISTORY];    /* Level of the last frames, for the delayed pixels */
+    uint16_t stillFrames;           /* Frames in a row without a level change */
+} strip_zone_t;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static strip_zone_t s_zones[ZONE_MAX];
+static bool s_running = false;      /* The frame timer runs, changed by the render task only */
+static bool s_dirty = false;        /* A zone was changed since the render task last looked */
+static uint16_t s_head = 0;         /* History slot of the current frame */
+static uint8_t s_frames[2][PIXEL_STRIP_MAX_PIXELS * STRIP_BYTES_PER_PIXEL];
+static pixel_strip_stats_t s_stats;
+
+static rmt_channel_handle_t s_channel;
+static strip_encoder_t s_encoder;
+static esp_timer_handle_t s_frame_timer;
+static TaskHandle_t s_task;
+
+static size_t strip_encode(rmt_encoder_t *encoder, rmt_channel_handle_t channel, const void *data, size_t size,
+                           rmt_encode_state_t *retState)
+{
+    strip_encoder_t *strip = __containerof(encoder, strip_encoder_t, base);
+    rmt_encode_state_t sessionState = RMT_ENCODING_RESET;
+    int state = RMT_ENCODING_RESET;
+    size_t encoded = 0;
+
+    if (!strip->pixelsDone)
+    {
+        encoded += strip->bytesEncoder->encode(strip->bytesEncoder, channel, data, size, &sessionState);
+        if (sessionState & RMT_ENCODING_COMPLETE)
+        {
+            strip->pixelsDone = true;
+        }
+        if (sessionState & RMT_ENCODING_MEM_FULL)
+        {
+            *retState = RMT_ENCODING_MEM_FULL;
+            return encoded;
+        }
+    }
+    encoded += strip->copyEncoder->encode(strip->copyEncoder, channel, &strip->resetCode, sizeof(strip->resetCode),
+                                          &sessionState);
+    if (sessionState & RMT_ENCODING_COMPLETE)
+    {
+        strip->pixelsDone = false;
+        state |= RMT_ENCODING_COMPLETE;
+    }
+    if (sessionState & RMT_ENCODING_MEM_FULL)
+    {
+        state |= RMT_ENCODING_MEM_FULL;
+    }
+    *retState = (rmt_encode_state_t)state;
+    return encoded;
+}
+
+static esp_err_t strip_encoder_reset(rmt_encoder_t *encoder)
+{
+    strip_encoder_t *strip = __containerof(encoder, strip_encoder_t, base);
+
+    rmt_encoder_reset(strip->bytesEncoder);
+    rmt_encoder_reset(strip->copyEncoder);
+    strip->pixelsDone = false;
+    return ESP_OK;
+}
+
+static esp_err_t strip_encoder_del(rmt_encoder_t *encoder)
+{
+    strip_encoder_t *strip = __containerof(encoder, strip_encoder_t, base);
+
+    rmt_del_encoder(strip->bytesEncoder);
+    rmt_del_encoder(strip->copyEncoder);
+    return ESP_OK;
+}
+
+static esp_err_t strip_encoder_init(strip_encoder_t *strip)
+{
+    rmt_bytes_encoder_config_t bytesConfig = {
+        .bit0 = { .level0 = 1, .duration0 = STRIP_T0H, .level1 = 0, .duration1 = STRIP_T0L },
+        .bit1 = { .level0 = 1, .duration0 = STRIP_T1H, .level1 = 0, .duration1 = STRIP_T1L },
+        .flags.msb_first = 1,
+    };
+    rmt_copy_encoder_config_t copyConfig = {};
+
+    strip->base.encode = strip_encode;
+    strip->base.reset = strip_encoder_reset;
+    strip->base.del = strip_encoder_del;
+    strip->pixelsDone = false;
+    strip->resetCode = (rmt_symbol_word_t) {
+        .level0 = 0, .duration0 = STRIP_RESET_TICKS / 2, .level1 = 0, .duration1 = STRIP_RESET_TICKS / 2,
+    };
+    ESP_RETURN_ON_ERROR(rmt_new_bytes_encoder(&bytesConfig, &strip->bytesEncoder), TAG, "bytes encoder");
+    ESP_RETURN_ON_ERROR(rmt_new_copy_encoder(&copyConfig, &strip->copyEncoder), TAG, "copy encoder");
+    return ESP_OK;
+}
+
+static uint32_t duty_to_level(const strip_zone_t *strip, uint32_t duty)
+{
+    return (uint32_t)(((uint64_t)duty * STRIP_LEVEL_MAX) / strip->maxDuty);
+}
+
+static uint32_t level_to_duty(const strip_zone_t *strip, uint32_t level)
+{
+    return (uint32_t)(((uint64_t)level * strip->maxDuty + STRIP_LEVEL_MAX / 2) / STRIP_LEVEL_MAX);
+}
+
+static bool mark_dirty(void)
+{
+    /* Called under s_lock after a zone changed. Returns true when the render task has to be
+       woken because the frame timer is stopped. */
+    s_dirty = true;
+    return !s_running;
+}
+
+static bool advance_zone(uint8_t zone, strip_zone_t *strip)
+{
+    /* This function moves a zone's ramp on by a frame and records the level in its history. It
+       returns true while the segment still changes, including pixels still catching up. */
+    bool done = false;
+    bool ramping;
+    int64_t doneUs = 0;
+    uint32_t level;
+
+    taskENTER_CRITICAL(&s_lock);
+    if (strip->framesLeft > 0)
+    {
+        strip->framesLeft--;
+        strip->level = (strip->framesLeft == 0) ? strip->target : (uint32_t)((int32_t)strip->level + strip->step);
+        if ((strip->framesLeft == 0) && strip->fading)
+        {
+            /* Stamped under the lock, so a stop and a new fade after it make this event stale */
+            strip->fading = false;
+            done = true;
+            doneUs = light_hal_now_us();
+        }
+    }
+    level = strip->level;
+    ramping = (strip->framesLeft > 0);
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (done)
+    {
+        light_event_t event = {
+            .type = LIGHT_EVENT_FADE_DONE,
+            .zone = zone,
+            .timestamp_us = doneUs,
+            .value = level_to_duty(strip, level),
+        };
+        if (!light_hal_post_event(&event))
+        {
+            ESP_LOGW(TAG, "Zone %u: event queue full, fade end dropped", zone);
+        }
+    }
+
+    uint16_t current = (uint16_t)(level >> STRIP_LEVEL_SHIFT);
+    uint16_t previous = strip->history[(s_head + STRIP_HISTORY - 1) % STRIP_HISTORY];
+    strip->history[s_head] = current;
+    if (current != previous)
+    {
+        strip->stillFrames = 0;
+    }
+    else if (strip->stillFrames < STRIP_HISTORY)
+    {
+        strip->stillFrames++;
+    }
+    return ramping || (strip->stillFrames < STRIP_HISTORY);
+}
+
+static void render_zone(const strip_zone_t *strip, uint8_t *frame)
+{
+    /* This function writes a segment's pixels, each from the zone level of as many frames ago
+       as its distance from the origin asks for */
+    uint8_t *pixel = &frame[strip->first * STRIP_BYTES_PER_PIXEL];
+
+    for (uint16_t i = 0; i < strip->count; i++, pixel += STRIP_BYTES_PER_PIXEL)
+    {
+        uint32_t distance = (i > strip->origin) ? (i - strip->origin) : (strip->origin - i);
+        int32_t slot = (int32_t)s_head - (int32_t)((distance * strip->delayScale) >> 8);
+        if (slot < 0)
+        {
+            slot += STRIP_HISTORY;
+        }
+        uint32_t level = strip->history[slot];
+
+        pixel[0] = (uint8_t)((level * STRIP_GREEN + 0x8000) >> 16);
+        pixel[1] = (uint8_t)((level * STRIP_RED + 0x8000) >> 16);
+        pixel[2] = (uint8_t)((level * STRIP_BLUE + 0x8000) >> 16);
+#if (STRIP_BYTES_PER_PIXEL == 4)
+        pixel[3] = (uint8_t)((level * 0xFF + 0x8000) >> 16);
+#endif
+    }
+}
+
+static bool render_frame(uint8_t *frame)
+{
+    /* This function advances every zone by a frame and renders it. It returns true while any
+       zone still changes. */
+    bool changing = false;
+
+    s_head = (s_head + 1) % STRIP_HISTORY;
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        if (advance_zone(zone, &s_zones[zone]))
+        {
+            changing = true;
+        }
+        else
+        {
+            power_fade_end(zone);
+        }
+        render_zone(&s_zones[zone], frame);
+    }
+    return changing;
+}
+
+static void transmit(const uint8_t *frame, uint16_t pixels)
+{
+    rmt_transmit_config_t config = {
+        .loop_count = 0,
+    };
+
+    ESP_ERROR_CHECK(rmt_transmit(s_channel, &s_encoder.base, frame, pixels * STRIP_BYTES_PER_PIXEL, &config));
+}
+
+static void frame_timer_cb(void *arg)
+{
+    xTaskNotifyGive(s_task);
+}
+
+static void render_task(void *arg)
+{
+    /* This task renders and sends a frame per tick of the frame timer. The frame timer is
+       started on the first change and stopped once every segment is still. */
+    uint8_t back = 0;
+
+    metrics_console_watch_task(NULL);
+    while (true)
+    {
+        uint32_t ticks = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        bool startTimer;
+
+        taskENTER_CRITICAL(&s_lock);
+        s_dirty = false;
+        startTimer = !s_running;
+        s_running = true;
+        taskEXIT_CRITICAL(&s_lock);
+        if (startTimer)
+        {
+            ESP_ERROR_CHECK(esp_timer_start_periodic(s_frame_timer, STRIP_FRAME_US));
+        }
+        else if (ticks > 1)
+        {
+            s_stats.lateFrames += ticks - 1;
+        }
+
+        int64_t start = esp_timer_get_time();
+        bool changing = render_frame(s_frames[back]);
+        int64_t renderUs = esp_timer_get_time() - start;
+        if (renderUs > s_stats.renderMaxUs)
+        {
+            s_stats.renderMaxUs = renderUs;
+        }
+
+        /* The other buffer may still be going out */
+        ESP_ERROR_CHECK(rmt_tx_wait_all_done(s_channel, -1));
+        transmit(s_frames[back], CONFIG_LIGHT_STRIP_PIXELS);
+        s_stats.frames++;
+        back ^= 1;
+
+        if (!changing)
+        {
+            bool stop;
+            taskENTER_CRITICAL(&s_lock);
+            stop = !s_dirty;
+            s_running = !stop;
+            taskEXIT_CRITICAL(&s_lock);
+            if (stop)
+            {
+                esp_timer_stop(s_frame_timer);
+            }
+        }
+    }
+}
+
+void pixel_strip_init(void)
+{
+    /* This function sets up the RMT channel on CONFIG_LIGHT_STRIP_GPIO and starts the render
+       task with the strip dark */
+    rmt_tx_channel_config_t channelConfig = {
+        .gpio_num = CONFIG_LIGHT_STRIP_GPIO,
+        .clk_src = RMT_CLK_SRC_DEFAULT,
+        .resolution_hz = STRIP_RESOLUTION_HZ,
+        .mem_block_symbols = STRIP_MEM_BLOCK_SYMBOLS,
+        .trans_queue_depth = 2,
+        .flags.with_dma = STRIP_WITH_DMA,
+    };
+    const esp_timer_create_args_t timerArgs = {
+        .callback = frame_timer_cb,
+        .name = "strip_frame",
+    };
+
+    ESP_ERROR_CHECK(rmt_new_tx_channel(&channelConfig, &s_channel));
+    ESP_ERROR_CHECK(strip_encoder_init(&s_encoder));
+    ESP_ERROR_CHECK(rmt_enable(s_channel));
+    ESP_ERROR_CHECK(esp_timer_create(&timerArgs, &s_frame_timer));
+    xTaskCreatePinnedToCore(render_task, "strip", STRIP_TASK_STACK_SIZE, NULL, STRIP_TASK_PRIORITY, &s_task,
+                            STRIP_TASK_CORE);
+    pixel_strip_clear();
+    ESP_LOGI(TAG, "%d pixel %s strip on GPIO %d, %d FPS%s", CONFIG_LIGHT_STRIP_PIXELS, STRIP_TYPE_NAME,
+             CONFIG_LIGHT_STRIP_GPIO, CONFIG_LIGHT_STRIP_FPS, STRIP_WITH_DMA ? ", DMA" : "");
+}
+
+void pixel_strip_add_segment(uint8_t zone, uint16_t first, uint16_t count, uint16_t origin, uint32_t maxDuty)
+{
+    /* This function gives a zone the pixels first to first + count - 1, dark. The light spreads
+       from pixel 'origin'. */
+    strip_zone_t *strip = &s_zones[zone];
+
+    if (first + count > CONFIG_LIGHT_STRIP_PIXELS)
+    {
+        ESP_LOGW(TAG, "Zone %u: segment past the end of the strip, cut to %d pixels", zone, CONFIG_LIGHT_STRIP_PIXELS);
+        first = (first < CONFIG_LIGHT_STRIP_PIXELS) ? first : CONFIG_LIGHT_STRIP_PIXELS;
+        count = CONFIG_LIGHT_STRIP_PIXELS - first;
+    }
+    origin = (origin < first) ? first : origin;
+    origin = ((count > 0) && (origin >= first + count)) ? (first + count - 1) : origin;
+
+    strip->first = first;
+    strip->count = count;
+    strip->origin = origin - first;
+    strip->maxDuty = maxDuty;
+
+    uint32_t farthest = (count > 0) ? (count - 1 - strip->origin) : 0;
+    farthest = (strip->origin > farthest) ? strip->origin : farthest;
+    strip->delayScale = (farthest > 0) ? ((uint32_t)STRIP_SPREAD_FRAMES << 8) / farthest : 0;
+}
+
+void pixel_strip_fade(uint8_t zone, uint32_t duty, uint32_t timeMs)
+{
+    /* This function ramps a zone linearly to 'duty' over timeMs from the next frame on and
+       posts LIGHT_EVENT_FADE_DONE when the ramp ends; the pixels away from the origin follow
+       it later */
+    strip_zone_t *strip = &s_zones[zone];
+    uint32_t frames = (timeMs * CONFIG_LIGHT_STRIP_FPS + 999) / 1000;
+    uint32_t target = duty_to_level(strip, duty);
+    bool wake;
+
+    frames = (frames == 0) ? 1 : frames;
+    power_fade_begin(zone);
+    taskENTER_CRITICAL(&s_lock);
+    strip->target = target;
+    strip->framesLeft = frames;
+    strip->step = ((int32_t)target - (int32_t)strip->level) / (int32_t)frames;
+    strip->fading = true;
+    wake = mark_dirty();
+    taskEXIT_CRITICAL(&s_lock);
+    if (wake)
+    {
+        xTaskNotifyGive(s_task);
+    }
+}
+
+uint32_t pixel_strip_stop(uint8_t zone)
+{
+    /* This function holds a zone's ramp where it is, without a LIGHT_EVENT_FADE_DONE, and
+       returns the duty reached */
+    strip_zone_t *strip = &s_zones[zone];
+    uint32_t level;
+
+    taskENTER_CRITICAL(&s_lock);
+    strip->framesLeft = 0;
+    strip->fading = false;
+    strip->target = strip->level;
+    level = strip->level;
+    taskEXIT_CRITICAL(&s_lock);
+    return level_to_duty(strip, level);
+}
+
+void pixel_strip_set(uint8_t zone, uint32_t duty)
+{
+    /* This function sets a zone to 'duty' at the next frame, cancelling its ramp */
+    strip_zone_t *strip = &s_zones[zone];
+    uint32_t level = duty_to_level(strip, duty);
+    bool wake;
+
+    power_fade_begin(zone);
+    taskENTER_CRITICAL(&s_lock);
+    strip->framesLeft = 0;
+    strip->fading = false;
+    strip->level = level;
+    strip->target = level;
+    wake = mark_dirty();
+    taskEXIT_CRITICAL(&s_lock);
+    if (wake)
+    {
+        xTaskNotifyGive(s_task);
+    }
+}
+
+void pixel_strip_get_stats(pixel_strip_stats_t *stats)
+{
+    *stats = s_stats;
+}
+
+void pixel_strip_clear(void)
+{
+    /* This function blanks both frame buffers and the longest strip, with every zone off */
+    memset(s_frames, 0, sizeof(s_frames));
+    transmit(s_frames[0], PIXEL_STRIP_MAX_PIXELS);
+    ESP_ERROR_CHECK(rmt_tx_wait_all_done(s_channel, -1));
+}
+
+int64_t pixel_strip_bench_render(uint16_t pixels)
+{
+    /* This function times the work of one frame on a zone of 'pixels' pixels whose ramp
+       runs and whose history holds a full fade, so every pixel has its own level */
+    static strip_zone_t strip;
+    int64_t start;
+
+    if (strip.count != pixels)
+    {
+        memset(&strip, 0, sizeof(strip));
+        strip.count = (pixels < PIXEL_STRIP_MAX_PIXELS) ? pixels : PIXEL_STRIP_MAX_PIXELS;
+        strip.maxDuty = 1;
+        strip.delayScale = (strip.count > 1) ? ((uint32_t)STRIP_SPREAD_FRAMES << 8) / (strip.count - 1) : 0;
+        for (uint16_t i = 0; i < STRIP_HISTORY; i++)
+        {
+            strip.history[i] = (uint16_t)((i * 0xFFFFu) / STRIP_HISTORY);
+        }
+    }
+    strip.framesLeft = UINT32_MAX;
+    strip.step = ((int32_t)STRIP_LEVEL_MAX - (int32_t)strip.level) / 0x10000;
+
+    start = esp_timer_get_time();
+    s_head = (s_head + 1) % STRIP_HISTORY;
+    advance_zone(0, &strip);
+    render_zone(&strip, s_frames[0]);
+    return esp_timer_get_time() - start;
+}
+
+int64_t pixel_strip_bench_transmit(uint16_t pixels)
+{
+    /* This function times sending one frame of 'pixels' pixels, reset time included */
+    int64_t start = esp_timer_get_time();
+
+    transmit(s_frames[0], (pixels < PIXEL_STRIP_MAX_PIXELS) ? pixels : PIXEL_STRIP_MAX_PIXELS);
+    ESP_ERROR_CHECK(rmt_tx_wait_all_done(s_channel, -1));
+    return esp_timer_get_time() - start;
+}
+
+#endif /* CONFIG_LIGHT_OUTPUT_STRIP */
@@ -0,0 +1,31 @@
+#ifndef _PIXEL_STRIP_H_
+#define _PIXEL_STRIP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Buffers are sized for the longest strip, so the benchmark can run every length */
+#define PIXEL_STRIP_MAX_PIXELS 600
+
+/* Frame counts of the strip since boot */
+typedef struct
+{
+    uint32_t frames;                /* Frames sent */
+    uint32_t lateFrames;            /* Frame ticks missed because a frame was still rendering or sending */
+    int64_t renderMaxUs;            /* Longest render of a frame */
+} pixel_strip_stats_t;
+
+void pixel_strip_init(void);
+void pixel_strip_add_segment(uint8_t zone, uint16_t first, uint16_t count, uint16_t origin, uint32_t maxDuty);
+void pixel_strip_fade(uint8_t zone, uint32_t duty, uint32_t timeMs);
+uint32_t pixel_strip_stop(uint8_t zone);
+void pixel_strip_set(uint8_t zone, uint32_t duty);
+void pixel_strip_get_stats(pixel_strip_stats_t *stats);
+void pixel_strip_clear(void);
+
+/* For strip_benchmark.c, with every zone off: render one frame of 'pixels' pixels, all of them
+   mid-fade, or send one, and return the time it took */
+int64_t pixel_strip_bench_render(uint16_t pixels);
+int64_t pixel_strip_bench_transmit(uint16_t pixels);
+
+#endif /* _PIXEL_STRIP_H_ */
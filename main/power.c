@@ -0,0 +1,438 @@
+/*******************************************************************************************
+Power
+
+Power management of the lighting firmware, chosen with CONFIG_LIGHT_POWER_MODE:
+
+- Full power: nothing is changed, the CPUs wait for interrupts at the default frequency.
+- Automatic light sleep: esp_pm scales the CPU down to CONFIG_LIGHT_POWER_MIN_FREQ_MHZ and
+  light sleeps in the idle tasks. The PIR pins are GPIO wakeup sources (motion_sensor.c), a
+  motion edge holds the CPU at full speed until the lighting task has handled it, and light
+  sleep is held off while a hardware fade segment runs. A steady lit LED keeps its PWM from
+  the low speed LEDC timer on RC_FAST, which stays powered in sleep.
+
+With CONFIG_LIGHT_DEEP_SLEEP either mode deep sleeps outside the schedule windows once all
+zones are vacant and dark, and wakes on a timer shortly before the next transition or on
+motion at an RTC-capable sensor. A motion wake is handed to the lighting task as a rising edge
+stamped with the moment of the wakeup: the wake stub reads the RTC timer, which runs through
+deep sleep, and the application start subtracts the RTC time since then from its own clock. The
+latency it logs is wake to light, ROM and bootloader included.
+
+The time spent active, in light sleep and in deep sleep is measured and kept across deep sleep
+in RTC memory. The average current reported with it is not measured: it is the residency
+weighted by the per-state figures in the configuration, datasheet values until they are
+replaced by readings from a meter on the board.
+
+********************************************************************************************/
+#include "power.h"
+#include <stddef.h>
+#include <string.h>
+#include <sys/time.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_rom_crc.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_private/esp_clk.h"
+#include "driver/rtc_io.h"
+#include "soc/rtc.h"
+#include "soc/rtc_cntl_reg.h"
+#include "light_events.h"
+#include "zone.h"
+#include "light_controller.h"
+#include "led_fade.h"
+#include "occupancy.h"
+#include "motion_sensor.h"
+#include "time_sync.h"
+#include "journal.h"
+
+static const char *TAG = "power";
+
+#define POWER_MAGIC 0x4C415057          /* "LAPW" */
+
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+#define POWER_MODE_NAME "light sleep"
+#else
+#define POWER_MODE_NAME "full power"
+#endif
+#ifdef CONFIG_LIGHT_DEEP_SLEEP
+#define POWER_DEEP_SLEEP_NAME ", deep sleep outside the schedule"
+#else
+#define POWER_DEEP_SLEEP_NAME ""
+#endif
+
+/* Residency since power-on, kept across deep sleep */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t deepSleeps;
+    int64_t awakeUs;                /* Awake time of the previous boots, light sleep included */
+    int64_t lightSleepUs;           /* Light sleep time of the previous boots */
+    int64_t deepSleepUs;
+    int64_t sleepStartUs;           /* Wall clock at the last deep sleep entry */
+    uint32_t crc;
+} power_record_t;
+
+static RTC_NOINIT_ATTR power_record_t s_record;
+#ifdef CONFIG_LIGHT_DEEP_SLEEP
+static RTC_DATA_ATTR uint64_t s_wake_rtc_ticks;    /* RTC timer when the wake stub ran */
+#endif
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t s_light_sleep_us = 0;
+static esp_timer_handle_t s_report_timer;
+
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+static esp_pm_lock_handle_t s_motion_lock;
+static esp_pm_lock_handle_t s_fade_lock;
+static uint32_t s_motion_pending = 0;   /* Motion edges holding s_motion_lock */
+static uint32_t s_fading_zones = 0;     /* Zones whose hardware fade holds s_fade_lock */
+#endif
+
+static uint32_t record_crc(const power_record_t *record)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)record, offsetof(power_record_t, crc));
+}
+
+static int64_t wall_clock_us(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+#ifdef CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+static IRAM_ATTR esp_err_t light_sleep_exit_cb(int64_t sleptUs, void *arg)
+{
+    portENTER_CRITICAL_SAFE(&s_lock);
+    s_light_sleep_us += sleptUs;
+    portEXIT_CRITICAL_SAFE(&s_lock);
+    return ESP_OK;
+}
+#endif
+
+static void configure_light_sleep(void)
+{
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+    esp_pm_config_t config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_LIGHT_POWER_MIN_FREQ_MHZ,
+        .light_sleep_enable = true,
+    };
+
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "motion", &s_motion_lock));
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "fade", &s_fade_lock));
+    ESP_ERROR_CHECK(esp_pm_configure(&config));
+
+    /* The LEDC timer of the zones runs on RC_FAST, keep it running through light sleep */
+    ESP_ERROR_CHECK(esp_sleep_pd_config(ESP_PD_DOMAIN_RC_FAST, ESP_PD_OPTION_ON));
+    ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+#ifdef CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+    esp_pm_sleep_cbs_register_config_t callbacks = {
+        .exit_cb = light_sleep_exit_cb,
+    };
+    ESP_ERROR_CHECK(esp_pm_light_sleep_register_cbs(&callbacks));
+#else
+    ESP_LOGW(TAG, "Light sleep time is not measured without CONFIG_PM_LIGHT_SLEEP_CALLBACKS");
+#endif
+#endif
+}
+
+#ifdef CONFIG_LIGHT_DEEP_SLEEP
+void RTC_IRAM_ATTR esp_wake_deep_sleep(void)
+{
+    /* This function runs from RTC memory right after the ROM on a deep sleep wake, before the
+       bootloader. It latches the RTC timer the way rtc_time_get() does, which is in flash. */
+    SET_PERI_REG_MASK(RTC_CNTL_TIME_UPDATE_REG, RTC_CNTL_TIME_UPDATE);
+    while (GET_PERI_REG_MASK(RTC_CNTL_TIME_UPDATE_REG, RTC_CNTL_TIME_VALID) == 0)
+    {
+    }
+    SET_PERI_REG_MASK(RTC_CNTL_INT_CLR_REG, RTC_CNTL_TIME_VALID_INT_CLR);
+    s_wake_rtc_ticks = READ_PERI_REG(RTC_CNTL_TIME0_REG) |
+                       ((uint64_t)READ_PERI_REG(RTC_CNTL_TIME1_REG) << 32);
+    esp_default_wake_deep_sleep();
+}
+#endif
+
+static int64_t wake_timestamp_us(void)
+{
+    /* This function returns the deep sleep wakeup on the esp_timer clock, which starts with the
+       application and so reads negative */
+#ifdef CONFIG_LIGHT_DEEP_SLEEP
+    uint64_t ticks = rtc_time_get() - s_wake_rtc_ticks;
+    return esp_timer_get_time() - (int64_t)rtc_time_slowclk_to_us(ticks, esp_clk_slowclk_cal_get());
+#else
+    return 0;
+#endif
+}
+
+static uint8_t deep_sleep_wake_zones(void)
+{
+    /* This function returns the zones whose sensor woke the chip from deep sleep as a bit mask */
+    uint64_t gpios = 0;
+    uint8_t zones = 0;
+
+    switch (esp_sleep_get_wakeup_cause())
+    {
+        case ESP_SLEEP_WAKEUP_EXT0:
+        case ESP_SLEEP_WAKEUP_EXT1:
+            gpios = esp_sleep_get_ext1_wakeup_status();
+            break;
+        default:
+            return 0;
+    }
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        gpio_num_t gpio = g_zone_table[zone].sensorGpio;
+        /* EXT0 has a single sensor and no status, every RTC-capable sensor is taken as the source */
+        if (rtc_gpio_is_valid_gpio(gpio) && ((gpios == 0) || (gpios & (1ULL << gpio))))
+        {
+            zones |= 1 << zone;
+        }
+    }
+    return zones;
+}
+
+static void restore_record(QueueHandle_t eventQueue)
+{
+    /* This function carries the residency over a deep sleep wake and, after a motion wake,
+       posts the edge that woke the chip */
+    if ((esp_reset_reason() != ESP_RST_DEEPSLEEP) || (s_record.magic != POWER_MAGIC) ||
+        (s_record.crc != record_crc(&s_record)))
+    {
+        memset(&s_record, 0, sizeof(s_record));
+        s_record.magic = POWER_MAGIC;
+        s_record.crc = record_crc(&s_record);
+        return;
+    }
+
+    int64_t sleptUs = wall_clock_us() - s_record.sleepStartUs;
+    if (sleptUs > 0)
+    {
+        s_record.deepSleepUs += sleptUs;
+        s_record.crc = record_crc(&s_record);
+    }
+
+    uint8_t zones = deep_sleep_wake_zones();
+    int64_t wakeUs = wake_timestamp_us();
+    ESP_LOGI(TAG, "Woken from deep sleep after %lld s by %s", (long long)(sleptUs / 1000000),
+             (zones != 0) ? "motion" : "the timer");
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        if (zones & (1 << zone))
+        {
+            light_event_t event = {
+                .type = LIGHT_EVENT_MOTION,
+                .zone = zone,
+                .timestamp_us = wakeUs,
+                .value = 1,
+            };
+            xQueueSend(eventQueue, &event, 0);
+        }
+    }
+}
+
+static void report_timer_cb(void *arg)
+{
+    power_report();
+}
+
+void power_init(QueueHandle_t eventQueue)
+{
+    /* This function applies the power mode before the peripherals are set up. A rising edge
+       is posted on eventQueue for every zone whose sensor woke the chip from deep sleep. */
+    const esp_timer_create_args_t timerArgs = {
+        .callback = report_timer_cb,
+        .name = "power_report",
+    };
+
+    restore_record(eventQueue);
+    configure_light_sleep();
+    ESP_LOGI(TAG, "Power mode: %s%s", POWER_MODE_NAME, POWER_DEEP_SLEEP_NAME);
+
+#ifdef CONFIG_LIGHT_DEEP_SLEEP
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        if (!rtc_gpio_is_valid_gpio(g_zone_table[zone].sensorGpio))
+        {
+            ESP_LOGW(TAG, "Zone %u: GPIO %d is not an RTC GPIO and can not wake from deep sleep",
+                     zone, g_zone_table[zone].sensorGpio);
+        }
+    }
+#endif
+
+    if (CONFIG_LIGHT_POWER_REPORT_INTERVAL_S > 0)
+    {
+        ESP_ERROR_CHECK(esp_timer_create(&timerArgs, &s_report_timer));
+        ESP_ERROR_CHECK(esp_timer_start_periodic(s_report_timer, (uint64_t)CONFIG_LIGHT_POWER_REPORT_INTERVAL_S * 1000000));
+    }
+}
+
+void power_sensor_wakeup(gpio_num_t gpio, int level)
+{
+    /* This function arms a sensor pin to wake the chip from light sleep when it leaves 'level'.
+       GPIO wakeup is level triggered, so it is re-armed for the other level on every edge. */
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+    gpio_wakeup_enable(gpio, level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+#endif
+}
+
+void IRAM_ATTR power_motion_begin(void)
+{
+    /* Called for a motion edge on its way to the lighting task, from the ISR */
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+    portENTER_CRITICAL_SAFE(&s_lock);
+    s_motion_pending++;
+    portEXIT_CRITICAL_SAFE(&s_lock);
+    esp_pm_lock_acquire(s_motion_lock);
+#endif
+}
+
+void IRAM_ATTR power_motion_end(void)
+{
+    /* Called once the edge has been handled, or dropped. Edges that did not come through
+       power_motion_begin() hold nothing and are ignored. */
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+    bool held = false;
+
+    portENTER_CRITICAL_SAFE(&s_lock);
+    if (s_motion_pending > 0)
+    {
+        s_motion_pending--;
+        held = true;
+    }
+    portEXIT_CRITICAL_SAFE(&s_lock);
+    if (held)
+    {
+        esp_pm_lock_release(s_motion_lock);
+    }
+#endif
+}
+
+void power_fade_begin(uint8_t zone)
+{
+    /* Called before a hardware fade segment is started, the fade unit does not run in sleep */
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+    bool acquire;
+
+    portENTER_CRITICAL_SAFE(&s_lock);
+    acquire = (s_fading_zones == 0);
+    s_fading_zones |= 1 << zone;
+    portEXIT_CRITICAL_SAFE(&s_lock);
+    if (acquire)
+    {
+        esp_pm_lock_acquire(s_fade_lock);
+    }
+#endif
+}
+
+void IRAM_ATTR power_fade_end(uint8_t zone)
+{
+    /* Called when a zone's fade segment ended or was cancelled, also from the fade-end ISR */
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+    bool release;
+
+    portENTER_CRITICAL_SAFE(&s_lock);
+    release = (s_fading_zones == (1U << zone));
+    s_fading_zones &= ~(1U << zone);
+    portEXIT_CRITICAL_SAFE(&s_lock);
+    if (release)
+    {
+        esp_pm_lock_release(s_fade_lock);
+    }
+#endif
+}
+
+void power_deep_sleep_if_idle(time_t now, time_t nextCheck)
+{
+    /* This function enters deep sleep, and does not return, if nothing needs the chip awake
+       before the next schedule check. Called by the lighting task with its queue empty. */
+#ifdef CONFIG_LIGHT_DEEP_SLEEP
+    uint64_t wakeMask = 0;
+    uint8_t wakeCount = 0;
+    gpio_num_t ext0Gpio = GPIO_NUM_NC;
+
+    if (!time_sync_clock_valid(now) || time_sync_pending() || journal_busy() ||
+        (nextCheck - now < CONFIG_LIGHT_DEEP_SLEEP_MIN_S))
+    {
+        return;
+    }
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        if (light_controller_zone_active(zone) || light_controller_zone_lit(zone) ||
+            (led_fade_state(zone) != LED_STATE_OFF) || (occupancy_state(zone) != OCCUPANCY_VACANT) ||
+            (motion_sensor_level(zone) != 0))
+        {
+            return;
+        }
+        gpio_num_t gpio = g_zone_table[zone].sensorGpio;
+        if (rtc_gpio_is_valid_gpio(gpio))
+        {
+            wakeMask |= 1ULL << gpio;
+            wakeCount++;
+            ext0Gpio = gpio;
+        }
+    }
+
+    int64_t sleepS = (int64_t)(nextCheck - now) - CONFIG_LIGHT_DEEP_SLEEP_WAKE_MARGIN_S;
+    if (wakeCount == 1)
+    {
+        ESP_ERROR_CHECK(esp_sleep_enable_ext0_wakeup(ext0Gpio, 1));
+    }
+    else if (wakeCount > 1)
+    {
+        ESP_ERROR_CHECK(esp_sleep_enable_ext1_wakeup(wakeMask, ESP_EXT1_WAKEUP_ANY_HIGH));
+    }
+    /* Keeps the sensor pulls of the RTC pads while asleep */
+    ESP_ERROR_CHECK(esp_sleep_pd_config(ESP_PD_DOMAIN_RTC_PERIPH, ESP_PD_OPTION_ON));
+    ESP_ERROR_CHECK(esp_sleep_enable_timer_wakeup((uint64_t)sleepS * 1000000));
+
+    power_report();
+    portENTER_CRITICAL_SAFE(&s_lock);
+    s_record.lightSleepUs += s_light_sleep_us;
+    portEXIT_CRITICAL_SAFE(&s_lock);
+    s_record.awakeUs += esp_timer_get_time();
+    s_record.deepSleeps++;
+    s_record.sleepStartUs = wall_clock_us();
+    s_record.crc = record_crc(&s_record);
+    ESP_LOGI(TAG, "Entering deep sleep for %lld s, %u sensor(s) can wake it", (long long)sleepS, wakeCount);
+    esp_deep_sleep_start();
+#endif
+}
+
+void power_report(void)
+{
+    /* This function logs the residency since power-on and the average current it implies. Only
+       the residency is measured, the current weights it by the configured per-state figures
+       and covers the chip alone. */
+    light_zone_stats_t stats;
+    int64_t lightToUs = 0;
+    int64_t lightSleepUs;
+
+    portENTER_CRITICAL_SAFE(&s_lock);
+    lightSleepUs = s_light_sleep_us;
+    portEXIT_CRITICAL_SAFE(&s_lock);
+    lightSleepUs += s_record.lightSleepUs;
+    int64_t activeMs = (s_record.awakeUs + esp_timer_get_time() - lightSleepUs) / 1000;
+    int64_t lightMs = lightSleepUs / 1000;
+    int64_t deepMs = s_record.deepSleepUs / 1000;
+    int64_t totalMs = activeMs + lightMs + deepMs;
+    int64_t averageUa = (totalMs > 0) ? (activeMs * CONFIG_LIGHT_POWER_ACTIVE_UA +
+                                         lightMs * CONFIG_LIGHT_POWER_LIGHT_SLEEP_UA +
+                                         deepMs * CONFIG_LIGHT_POWER_DEEP_SLEEP_UA) / totalMs : 0;
+
+    for (uint8_t zone = 0; zone < g_zone_count; zone++)
+    {
+        light_controller_get_stats(zone, &stats);
+        if (stats.lightMaxUs > lightToUs)
+        {
+            lightToUs = stats.lightMaxUs;
+        }
+    }
+    ESP_LOGI(TAG, "Power (%s): active %lld s, light sleep %lld s, deep sleep %lld s in %lu cycles, "
+             "estimated average %lld uA, motion to light max %lld us", POWER_MODE_NAME,
+             (long long)(activeMs / 1000), (long long)(lightMs / 1000), (long long)(deepMs / 1000),
+             (unsigned long)s_record.deepSleeps, (long long)averageUa, (long long)lightToUs);
+}
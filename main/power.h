@@ -0,0 +1,19 @@
+#ifndef _POWER_H_
+#define _POWER_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/gpio.h"
+
+void power_init(QueueHandle_t eventQueue);
+void power_sensor_wakeup(gpio_num_t gpio, int level);
+void power_motion_begin(void);
+void power_motion_end(void);
+void power_fade_begin(uint8_t zone);
+void power_fade_end(uint8_t zone);
+void power_deep_sleep_if_idle(time_t now, time_t nextCheck);
+void power_report(void);
+
+#endif /* _POWER_H_ */
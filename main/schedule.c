@@ -0,0 +1,360 @@
+/*******************************************************************************************
+Schedule
+
+Active windows for each zone, for example "Mo-Fr 06:00-08:30, 17:00-23:00; Sa,Su 08:00-23:00".
+A rule is an optional list of weekdays (Su Mo Tu We Th Fr Sa, ranges with '-') followed by one
+or more HH:MM-HH:MM windows; rules are separated by ';'. A window whose end is not after its
+start runs past midnight.
+
+The time zone is parsed once. For the current local day the windows are compiled into a sorted
+table of UTC transition instants with mktime(), which takes care of DST, and the active state is
+cached together with the interval it is valid for. schedule_is_active() is a compare against
+that interval; the table is only walked when a transition is passed and only rebuilt once a day.
+
+********************************************************************************************/
+#include "schedule.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "zone.h"
+
+static const char *TAG = "schedule";
+
+static const char *const s_day_names[7] = { "Su", "Mo", "Tu", "We", "Th", "Fr", "Sa" };
+
+typedef struct
+{
+    time_t at;
+    int8_t delta;
+} schedule_edge_t;
+
+/* Compiled windows and cached state of one zone */
+typedef struct
+{
+    schedule_window_t windows[SCHEDULE_MAX_WINDOWS];
+    uint8_t windowCount;
+
+    schedule_transition_t transitions[SCHEDULE_MAX_TRANSITIONS];
+    uint8_t transitionCount;
+    uint8_t cursor;                 /* First transition after the cached interval start */
+    bool activeAtDayStart;
+    time_t dayStart;
+    time_t dayEnd;
+
+    bool active;
+    time_t validFrom;
+    time_t validUntil;
+} schedule_t;
+
+static schedule_t s_zones[ZONE_MAX];
+
+static const char *skip_spaces(const char *p)
+{
+    while (*p == ' ')
+    {
+        p++;
+    }
+    return p;
+}
+
+static const char *parse_day(const char *p, int *day)
+{
+    for (int i = 0; i < 7; i++)
+    {
+        if (strncmp(p, s_day_names[i], 2) == 0)
+        {
+            *day = i;
+            return p + 2;
+        }
+    }
+    return NULL;
+}
+
+static const char *parse_days(const char *p, uint8_t *weekdays)
+{
+    /* Parses "Mo-Fr", "Sa,Su" or "Fr-Mo"; ranges may wrap around the end of the week */
+    *weekdays = 0;
+    while (true)
+    {
+        int first;
+        int last;
+        p = parse_day(p, &first);
+        if (p == NULL)
+        {
+            return NULL;
+        }
+        last = first;
+        if (*p == '-')
+        {
+            p = parse_day(p + 1, &last);
+            if (p == NULL)
+            {
+                return NULL;
+            }
+        }
+        for (int day = first; ; day = (day + 1) % 7)
+        {
+            *weekdays |= 1 << day;
+            if (day == last)
+            {
+                break;
+            }
+        }
+        if (*p != ',')
+        {
+            return p;
+        }
+        p++;
+    }
+}
+
+static const char *parse_time(const char *p, uint16_t *minute)
+{
+    /* Parses "HH:MM", 24:00 is accepted as the end of the day */
+    if (!isdigit((unsigned char)p[0]) || !isdigit((unsigned char)p[1]) || (p[2] != ':') ||
+        !isdigit((unsigned char)p[3]) || !isdigit((unsigned char)p[4]))
+    {
+        return NULL;
+    }
+    int hour = (p[0] - '0') * 10 + (p[1] - '0');
+    int min = (p[3] - '0') * 10 + (p[4] - '0');
+    if ((min > 59) || (hour > 24) || ((hour == 24) && (min != 0)))
+    {
+        return NULL;
+    }
+    *minute = hour * 60 + min;
+    return p + 5;
+}
+
+static bool parse_rules(const char *rules, schedule_window_t *windows, uint8_t *count)
+{
+    const char *p = skip_spaces(rules);
+    *count = 0;
+
+    while (*p != '\0')
+    {
+        uint8_t weekdays = 0x7F;
+        if (isalpha((unsigned char)*p))
+        {
+            p = parse_days(p, &weekdays);
+            if (p == NULL)
+            {
+                return false;
+            }
+            p = skip_spaces(p);
+        }
+
+        while (true)
+        {
+            schedule_window_t window = { .weekdays = weekdays };
+            p = parse_time(skip_spaces(p), &window.startMinute);
+            if ((p == NULL) || (*p != '-'))
+            {
+                return false;
+            }
+            p = parse_time(p + 1, &window.endMinute);
+            if ((p == NULL) || (window.startMinute == window.endMinute) || (*count >= SCHEDULE_MAX_WINDOWS))
+            {
+                return false;
+            }
+            windows[(*count)++] = window;
+            p = skip_spaces(p);
+            if (*p != ',')
+            {
+                break;
+            }
+            p++;
+        }
+
+        if (*p == ';')
+        {
+            p = skip_spaces(p + 1);
+        }
+        else if (*p != '\0')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static time_t local_instant(const struct tm *midnight, int dayOffset, uint16_t minute)
+{
+    struct tm local = *midnight;
+    local.tm_mday += dayOffset;
+    local.tm_hour = minute / 60;
+    local.tm_min = minute % 60;
+    local.tm_sec = 0;
+    local.tm_isdst = -1;
+    return mktime(&local);
+}
+
+static void compile_day(schedule_t *schedule, time_t now)
+{
+    /* This function builds the transition table for the local day containing 'now'. Windows of
+       the previous day that run past midnight are included. */
+    schedule_edge_t edges[2 * 2 * SCHEDULE_MAX_WINDOWS];
+    uint8_t edgeCount = 0;
+    struct tm midnight;
+
+    localtime_r(&now, &midnight);
+    int weekday = midnight.tm_wday;
+    midnight.tm_hour = 0;
+    midnight.tm_min = 0;
+    midnight.tm_sec = 0;
+    schedule->dayStart = local_instant(&midnight, 0, 0);
+    schedule->dayEnd = local_instant(&midnight, 1, 0);
+
+    for (int dayOffset = -1; dayOffset <= 0; dayOffset++)
+    {
+        int day = (weekday + 7 + dayOffset) % 7;
+        for (uint8_t i = 0; i < schedule->windowCount; i++)
+        {
+            const schedule_window_t *window = &schedule->windows[i];
+            if (!(window->weekdays & (1 << day)))
+            {
+                continue;
+            }
+            time_t start = local_instant(&midnight, dayOffset, window->startMinute);
+            time_t end = local_instant(&midnight, (window->endMinute > window->startMinute) ? dayOffset : dayOffset + 1,
+                                       window->endMinute);
+            start = (start < schedule->dayStart) ? schedule->dayStart : start;
+            end = (end > schedule->dayEnd) ? schedule->dayEnd : end;
+            if (start >= end)
+            {
+                continue;
+            }
+            edges[edgeCount++] = (schedule_edge_t){ .at = start, .delta = 1 };
+            edges[edgeCount++] = (schedule_edge_t){ .at = end, .delta = -1 };
+        }
+    }
+
+    for (uint8_t i = 1; i < edgeCount; i++)
+    {
+        schedule_edge_t edge = edges[i];
+        uint8_t j = i;
+        while ((j > 0) && (edges[j - 1].at > edge.at))
+        {
+            edges[j] = edges[j - 1];
+            j--;
+        }
+        edges[j] = edge;
+    }
+
+    int depth = 0;
+    bool active = false;
+    schedule->transitionCount = 0;
+    schedule->activeAtDayStart = false;
+    for (uint8_t i = 0; i < edgeCount; )
+    {
+        time_t at = edges[i].at;
+        while ((i < edgeCount) && (edges[i].at == at))
+        {
+            depth += edges[i++].delta;
+        }
+        if ((depth > 0) == active)
+        {
+            continue;
+        }
+        active = (depth > 0);
+        if (at == schedule->dayStart)
+        {
+            schedule->activeAtDayStart = active;
+        }
+        else if (at < schedule->dayEnd)
+        {
+            schedule->transitions[schedule->transitionCount++] =
+                (schedule_transition_t){ .at = at, .active = active };
+        }
+    }
+    schedule->cursor = 0;
+
+    ESP_LOGD(TAG, "%u transitions today, active at midnight: %s",
+             schedule->transitionCount, schedule->activeAtDayStart ? "yes" : "no");
+}
+
+static void refresh(schedule_t *schedule, time_t now)
+{
+    if ((now < schedule->dayStart) || (now >= schedule->dayEnd))
+    {
+        compile_day(schedule, now);
+    }
+    else if (now < schedule->validFrom)
+    {
+        schedule->cursor = 0;       /* Clock was set back within the day */
+    }
+
+    const schedule_transition_t *transitions = schedule->transitions;
+    while ((schedule->cursor < schedule->transitionCount) && (transitions[schedule->cursor].at <= now))
+    {
+        schedule->cursor++;
+    }
+    uint8_t cursor = schedule->cursor;
+    schedule->active = (cursor > 0) ? transitions[cursor - 1].active : schedule->activeAtDayStart;
+    schedule->validFrom = (cursor > 0) ? transitions[cursor - 1].at : schedule->dayStart;
+    schedule->validUntil = (cursor < schedule->transitionCount) ? transitions[cursor].at : schedule->dayEnd;
+}
+
+void schedule_init(const char *timezone)
+{
+    /* This function sets the local time zone once for the whole program */
+    setenv("TZ", timezone, 1);
+    tzset();
+}
+
+bool schedule_set_rules(uint8_t zone, const char *rules)
+{
+    /* This function replaces the active windows of a zone. Invalid rules are rejected and the
+       previous windows are kept. */
+    schedule_t *schedule = &s_zones[zone];
+    schedule_window_t windows[SCHEDULE_MAX_WINDOWS];
+    uint8_t count;
+
+    if (!parse_rules(rules, windows, &count))
+    {
+        ESP_LOGE(TAG, "Zone %u: invalid schedule \"%s\"", zone, rules);
+        return false;
+    }
+    memcpy(schedule->windows, windows, sizeof(windows));
+    schedule->windowCount = count;
+    schedule->dayStart = 0;
+    schedule->dayEnd = 0;
+    schedule->validFrom = 0;
+    schedule->validUntil = 0;
+    ESP_LOGI(TAG, "Zone %u: schedule \"%s\", %u windows", zone, rules, count);
+    return true;
+}
+
+bool schedule_is_active(uint8_t zone, time_t now)
+{
+    /* This function returns whether 'now' is inside an active window of the zone */
+    schedule_t *schedule = &s_zones[zone];
+
+    if ((now < schedule->validFrom) || (now >= schedule->validUntil))
+    {
+        refresh(schedule, now);
+    }
+    return schedule->active;
+}
+
+time_t schedule_next_transition(uint8_t zone, time_t now)
+{
+    /* This function returns the instant the cached state has to be re-evaluated: the next
+       transition, or the next local midnight if there is none left today */
+    schedule_is_active(zone, now);
+    return s_zones[zone].validUntil;
+}
+
+void schedule_invalidate(void)
+{
+    /* This function drops the compiled tables of all zones, for example after the clock was
+       stepped */
+    for (uint8_t zone = 0; zone < ZONE_MAX; zone++)
+    {
+        s_zones[zone].dayStart = 0;
+        s_zones[zone].dayEnd = 0;
+        s_zones[zone].validFrom = 0;
+        s_zones[zone].validUntil = 0;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _SCHEDULE_H_
+#define _SCHEDULE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SCHEDULE_MAX_WINDOWS 8
+#define SCHEDULE_MAX_TRANSITIONS (4 * SCHEDULE_MAX_WINDOWS)
+#define SCHEDULE_MAX_SLEEP_S 3600      /* Upper bound on a wait for the next transition */
+
+/* A window of local time in which the light reacts to motion */
+typedef struct
+{
+    uint8_t weekdays;               /* Bit n set for tm_wday n, bit 0 is Sunday */
+    uint16_t startMinute;           /* Minutes after local midnight */
+    uint16_t endMinute;             /* Exclusive, at or before startMinute means past midnight */
+} schedule_window_t;
+
+/* The active state changes to 'active' at the UTC instant 'at' */
+typedef struct
+{
+    time_t at;
+    bool active;
+} schedule_transition_t;
+
+void schedule_init(const char *timezone);
+bool schedule_set_rules(uint8_t zone, const char *rules);
+bool schedule_is_active(uint8_t zone, time_t now);
+time_t schedule_next_transition(uint8_t zone, time_t now);
+void schedule_invalidate(void);
+
+#endif /* _SCHEDULE_H_ */
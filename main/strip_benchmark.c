@@ -0,0 +1,59 @@
+/*******************************************************************************************
+Strip Benchmark
+
+Measures the frame rate the strip output can hold against strip length. For every length
+the time to render a frame with every pixel mid-fade and the time to send it, reset included,
+are measured. Rendering overlaps the transmission of the previous frame, so the achievable
+frame rate is set by the longer of the two.
+
+Built with CONFIG_LIGHT_STRIP_BENCHMARK; it runs from app_main() before the zones are
+attached, while the render task is idle. Lengths above CONFIG_LIGHT_STRIP_PIXELS are rendered
+and sent all the same, a shorter strip just ignores the extra pixels.
+
+********************************************************************************************/
+#include "strip_benchmark.h"
+#include <stdint.h>
+#include "esp_log.h"
+#include "pixel_strip.h"
+
+#ifdef CONFIG_LIGHT_STRIP_BENCHMARK
+
+static const char *TAG = "strip_benchmark";
+
+#define BENCH_FRAMES 100
+
+static const uint16_t s_lengths[] = { 60, 150, 300, 600 };
+
+static void run_length(uint16_t pixels)
+{
+    int64_t renderSumUs = 0;
+    int64_t renderMaxUs = 0;
+    int64_t transmitUs;
+    int64_t periodUs;
+
+    for (int frame = 0; frame < BENCH_FRAMES; frame++)
+    {
+        int64_t renderUs = pixel_strip_bench_render(pixels);
+        renderSumUs += renderUs;
+        renderMaxUs = (renderUs > renderMaxUs) ? renderUs : renderMaxUs;
+    }
+    transmitUs = pixel_strip_bench_transmit(pixels);
+
+    periodUs = (renderMaxUs > transmitUs) ? renderMaxUs : transmitUs;
+    ESP_LOGI(TAG, "%u pixels: render %lld us (max %lld us), transmit %lld us, %lld FPS achievable", pixels,
+             (long long)(renderSumUs / BENCH_FRAMES), (long long)renderMaxUs, (long long)transmitUs,
+             (long long)(1000000 / periodUs));
+}
+
+void strip_benchmark_run(void)
+{
+    /* This function measures every strip length and leaves the strip dark */
+    ESP_LOGI(TAG, "Frame render and transmit time, %d FPS configured", CONFIG_LIGHT_STRIP_FPS);
+    for (size_t i = 0; i < sizeof(s_lengths) / sizeof(s_lengths[0]); i++)
+    {
+        run_length(s_lengths[i]);
+    }
+    pixel_strip_clear();
+}
+
+#endif /* CONFIG_LIGHT_STRIP_BENCHMARK */
@@ -0,0 +1,6 @@
+#ifndef _STRIP_BENCHMARK_H_
+#define _STRIP_BENCHMARK_H_
+
+void strip_benchmark_run(void);
+
+#endif /* _STRIP_BENCHMARK_H_ */
@@ -0,0 +1,195 @@
+/*******************************************************************************************
+Time Sync
+
+Background SNTP synchronization. Wi-Fi is brought up once, then a task pinned to the PRO CPU
+connects, waits for an SNTP response, disconnects and sleeps until the next resync.
+The lighting task never waits on any of this; it runs from the RTC clock in the meantime and is
+told about every completed sync with a LIGHT_EVENT_TIME_SYNCED.
+
+With CONFIG_SNTP_TIME_SYNC_METHOD_SMOOTH a resync slews the clock with adjtime() instead of
+stepping it, so a small correction can not jump over a schedule transition.
+
+With CONFIG_LIGHT_HTTP_API the station stays connected between syncs and this task also starts
+the API server once the network stack is up. CONFIG_LIGHT_GROUP keeps it connected as well, the
+group is joined after the first connect.
+
+********************************************************************************************/
+#include "time_sync.h"
+#include <sys/time.h>
+#include "freertos/task.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_netif_sntp.h"
+#include "esp_sntp.h"
+#include "esp_timer.h"
+#include "lwip/ip_addr.h"
+#include "light_events.h"
+#include "wifi_connection.h"
+#include "http_api.h"
+#include "group.h"
+#include "fast_boot.h"
+#include "journal.h"
+#include "metrics.h"
+#include "metrics_console.h"
+
+static const char *TAG = "time_sync";
+
+#ifndef INET6_ADDRSTRLEN
+#define INET6_ADDRSTRLEN 48
+#endif
+
+#define TIME_SYNC_WAIT_MS 2000
+#define TIME_SYNC_RETRY_COUNT 15
+
+static QueueHandle_t s_event_queue;
+static volatile int64_t s_next_sync_us = 0;   /* esp_timer time of the next attempt, 0 before the first */
+
+#ifdef CONFIG_SNTP_TIME_SYNC_METHOD_CUSTOM
+void sntp_sync_time(struct timeval *tv)
+{
+    settimeofday(tv, NULL);
+    ESP_LOGI(TAG, "Time is synchronized from custom code");
+    sntp_set_sync_status(SNTP_SYNC_STATUS_COMPLETED);
+}
+#endif
+
+static void time_sync_notification_cb(struct timeval *tv)
+{
+    light_event_t event = {
+        .type = LIGHT_EVENT_TIME_SYNCED,
+        .timestamp_us = esp_timer_get_time(),
+    };
+
+    ESP_LOGI(TAG, "Notification of a time synchronization event");
+    fast_boot_record_sync(tv);
+    xQueueSend(s_event_queue, &event, 0);
+}
+
+static void print_servers(void)
+{
+    ESP_LOGI(TAG, "List of configured NTP servers:");
+
+    for (uint8_t i = 0; i < SNTP_MAX_SERVERS; ++i){
+        if (esp_sntp_getservername(i)){
+            ESP_LOGI(TAG, "server %d: %s", i, esp_sntp_getservername(i));
+        } else {
+            char buff[INET6_ADDRSTRLEN];
+            ip_addr_t const *ip = esp_sntp_getserver(i);
+            if (ipaddr_ntoa_r(ip, buff, INET6_ADDRSTRLEN) != NULL)
+                ESP_LOGI(TAG, "server %d: %s", i, buff);
+        }
+    }
+}
+
+static bool obtain_time(void)
+{
+    /* This function connects, waits for the clock to be set over SNTP and disconnects again.
+       It returns true when the clock was set. */
+    bool synced;
+
+    if (wifi_connect(CONFIG_LIGHT_WIFI_CONNECT_TIMEOUT_MS) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Network connection failed");
+        return false;
+    }
+    ESP_LOGI(TAG, "Initializing and starting SNTP");
+    int64_t startUs = esp_timer_get_time();
+
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_SNTP_TIME_SERVER);
+    config.sync_cb = time_sync_notification_cb;
+#ifdef CONFIG_SNTP_TIME_SYNC_METHOD_SMOOTH
+    config.smooth_sync = true;
+#endif
+    esp_netif_sntp_init(&config);
+
+    print_servers();
+
+    int retry = 0;
+    esp_err_t ret;
+    while ((ret = esp_netif_sntp_sync_wait(pdMS_TO_TICKS(TIME_SYNC_WAIT_MS))) == ESP_ERR_TIMEOUT &&
+           ++retry < TIME_SYNC_RETRY_COUNT) {
+        ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry, TIME_SYNC_RETRY_COUNT);
+    }
+    /* In smooth mode the clock is still being slewed when the response has been received */
+    synced = (ret == ESP_OK) || (ret == ESP_ERR_NOT_FINISHED);
+    if (synced)
+    {
+        uint32_t syncMs = (uint32_t)((esp_timer_get_time() - startUs) / 1000);
+        metrics_record(METRIC_SNTP_SYNC_MS, syncMs);
+        journal_add(JOURNAL_TIME_SYNC, 0, syncMs);
+    }
+
+    esp_netif_sntp_deinit();
+    wifi_disconnect();
+    return synced;
+}
+
+static void time_sync_task(void *arg)
+{
+    /* This task keeps the clock in sync. A failed attempt is retried sooner than a regular resync. */
+    uint32_t delayS = fast_boot_sync_delay_s(CONFIG_LIGHT_TIME_RESYNC_INTERVAL_MIN * 60);
+
+    metrics_console_watch_task(NULL);
+    init_wifi();
+#if defined(CONFIG_LIGHT_HTTP_API) || defined(CONFIG_LIGHT_GROUP)
+    /* The API and the group need the station up all the time, not only for the syncs */
+    wifi_connection_stay_connected(true);
+    http_api_start();
+    wifi_connect(CONFIG_LIGHT_WIFI_CONNECT_TIMEOUT_MS);
+    group_start();
+#endif
+    if (!time_sync_clock_valid(time(NULL)))
+    {
+        ESP_LOGI(TAG, "Time is not set yet. Connecting to WiFi and getting time over NTP.");
+    }
+    else if (delayS > 0)
+    {
+        /* Trusted warm boot, the clock kept running through the reset */
+        ESP_LOGI(TAG, "Clock trusted, next sync in %lu s", (unsigned long)delayS);
+        s_next_sync_us = esp_timer_get_time() + (int64_t)delayS * 1000000;
+        vTaskDelay(pdMS_TO_TICKS(delayS * 1000));
+    }
+
+    while (true)
+    {
+        s_next_sync_us = 0;
+        if (obtain_time())
+        {
+            metrics_count(METRIC_TIME_SYNCS);
+            delayS = CONFIG_LIGHT_TIME_RESYNC_INTERVAL_MIN * 60;
+        }
+        else
+        {
+            metrics_count(METRIC_TIME_SYNC_FAILURES);
+            journal_add(JOURNAL_TIME_SYNC_FAILED, 0, 0);
+            ESP_LOGW(TAG, "Time sync failed, retrying in %d s", CONFIG_LIGHT_TIME_RETRY_INTERVAL_S);
+            delayS = CONFIG_LIGHT_TIME_RETRY_INTERVAL_S;
+        }
+        s_next_sync_us = esp_timer_get_time() + (int64_t)delayS * 1000000;
+        vTaskDelay(pdMS_TO_TICKS(delayS * 1000));
+    }
+}
+
+void time_sync_start(QueueHandle_t eventQueue)
+{
+    /* This function starts the background sync task on the core opposite the lighting task */
+    s_event_queue = eventQueue;
+    xTaskCreatePinnedToCore(time_sync_task, "time_sync", TIME_SYNC_TASK_STACK_SIZE, NULL,
+                            TIME_SYNC_TASK_PRIORITY, NULL, TIME_SYNC_TASK_CORE);
+}
+
+bool time_sync_clock_valid(time_t now)
+{
+    /* The RTC keeps the time across resets other than power-on, so a set clock is trusted even
+       before the first sync of this boot */
+    return now >= TIME_SYNC_VALID_EPOCH;
+}
+
+bool time_sync_pending(void)
+{
+    /* This function returns true while a sync is due or in progress, including before the
+       task has decided when the first one runs */
+    int64_t next = s_next_sync_us;
+    return (next == 0) || (esp_timer_get_time() >= next);
+}
@@ -0,0 +1,20 @@
+#ifndef _TIME_SYNC_H_
+#define _TIME_SYNC_H_
+
+#include <stdbool.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#define TIME_SYNC_TASK_STACK_SIZE 4096
+#define TIME_SYNC_TASK_PRIORITY 5
+#define TIME_SYNC_TASK_CORE 0           /* PRO CPU, together with the Wi-Fi stack */
+
+/* Earliest wall clock time that is taken as set, 2016-01-01 00:00:00 UTC */
+#define TIME_SYNC_VALID_EPOCH 1451606400
+
+void time_sync_start(QueueHandle_t eventQueue);
+bool time_sync_clock_valid(time_t now);
+bool time_sync_pending(void);
+
+#endif /* _TIME_SYNC_H_ */
@@ -6,106 +6,328 @@
    software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
    CONDITIONS OF ANY KIND, either express or implied.
 */
+/*******************************************************************************************
+Wi-Fi Connection Manager
+
+The station is brought up once by init_wifi(); every wifi_connect() after that tries a directed
+fast connect first, using the BSSID and channel of the last good association (and, if enabled,
+its IP lease) cached in NVS. Only if that fails does it fall back to a full scan, retried with
+exponential backoff until the caller's timeout. No call waits forever.
+
+Normally the station is only up while somebody needs it: time_sync.c connects for a sync and
+disconnects after it. With wifi_connection_stay_connected() (the HTTP API, the group)
+wifi_disconnect() leaves the association alone and a lost one is re-established by a reconnect
+task, which runs the same fast connect and full scans with backoff as wifi_connect(). The group
+also turns the modem power save off, see wifi_connect().
+
+Credentials come from NVS (see wifi_connection_set_credentials()) and default to the values
+set in menuconfig. A station without any waits in wifi_connect() for them to be entered: as
+"<ssid> <password>" on stdin with CONFIG_LIGHT_WIFI_CREDENTIALS_FROM_STDIN, with the "wifi"
+command of the console (metrics_console.c) otherwise.
+
+********************************************************************************************/
 #include <string.h>
 #include "wifi_connection.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
+#include "nvs.h"
+#include "metrics.h"
+#ifdef CONFIG_LIGHT_WIFI_CREDENTIALS_FROM_STDIN
+#include "driver/uart.h"
+#endif
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
 
-/* The examples use WiFi configuration that you can set via project configuration menu
+#define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WPA_PSK
+#define ESP_WIFI_SAE_MODE WPA3_SAE_PWE_BOTH     /* H2E or hunt-and-peck, whichever the AP offers */
 
-   If you'd rather not, just change the below entries to strings with
-   the config you want - ie #define EXAMPLE_WIFI_SSID "mywifissid"
-*/
-#define EXAMPLE_ESP_WIFI_SSID      "SoltaAndPeppa"
-#define EXAMPLE_ESP_WIFI_PASS      "Chandl3r"
-#define EXAMPLE_ESP_MAXIMUM_RETRY  5
+#define WIFI_NVS_NAMESPACE "wifi_cm"
+#define WIFI_NVS_KEY_SSID "ssid"
+#define WIFI_NVS_KEY_PASS "pass"
+#define WIFI_NVS_KEY_CACHE "cache"
 
-#define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WPA_PSK
-#define ESP_WIFI_SAE_MODE WPA3_SAE_PWE_HASH_TO_ELEMENT
-#define EXAMPLE_H2E_IDENTIFIER CONFIG_ESP_WIFI_PW_ID
-
-// #if CONFIG_ESP_WPA3_SAE_PWE_HUNT_AND_PECK
-// #define ESP_WIFI_SAE_MODE WPA3_SAE_PWE_HUNT_AND_PECK
-// #define EXAMPLE_H2E_IDENTIFIER ""
-
-// #elif CONFIG_ESP_WPA3_SAE_PWE_HASH_TO_ELEMENT
-#define ESP_WIFI_SAE_MODE WPA3_SAE_PWE_HASH_TO_ELEMENT
-#define EXAMPLE_H2E_IDENTIFIER CONFIG_ESP_WIFI_PW_ID
-
-// #elif CONFIG_ESP_WPA3_SAE_PWE_BOTH
-// #define ESP_WIFI_SAE_MODE WPA3_SAE_PWE_BOTH
-// #define EXAMPLE_H2E_IDENTIFIER CONFIG_ESP_WIFI_PW_ID
-// #endif
-// #if CONFIG_ESP_WIFI_AUTH_OPEN
-// #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_OPEN
-// #elif CONFIG_ESP_WIFI_AUTH_WEP
-// #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WEP
-// #elif CONFIG_ESP_WIFI_AUTH_WPA_PSK
-// #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WPA_PSK
-// #elif CONFIG_ESP_WIFI_AUTH_WPA2_PSK
-// #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WPA2_PSK
-// #elif CONFIG_ESP_WIFI_AUTH_WPA_WPA2_PSK
-// #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WPA_WPA2_PSK
-// #elif CONFIG_ESP_WIFI_AUTH_WPA3_PSK
-// #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WPA3_PSK
-// #elif CONFIG_ESP_WIFI_AUTH_WPA2_WPA3_PSK
-// #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WPA2_WPA3_PSK
-// #elif CONFIG_ESP_WIFI_AUTH_WAPI_PSK
-// #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WAPI_PSK
-// #endif
+#define WIFI_FAST_CONNECT_TIMEOUT_MS 1500
+#define WIFI_FULL_SCAN_TIMEOUT_MS 10000
+#define WIFI_DISCONNECT_WAIT_MS 500     /* For the event of an attempt given up */
+#define WIFI_BACKOFF_MIN_MS 250
+#define WIFI_BACKOFF_MAX_MS 8000
+#define WIFI_STDIN_POLL_MS 100
+
+#define WIFI_RECONNECT_TASK_STACK_SIZE 3072
+#define WIFI_RECONNECT_TASK_PRIORITY 5
+#define WIFI_RECONNECT_TASK_CORE 0      /* PRO CPU, with the Wi-Fi stack */
+
+#ifdef CONFIG_LIGHT_WIFI_REUSE_LEASE
+#define WIFI_REUSE_LEASE true
+#else
+#define WIFI_REUSE_LEASE false
+#endif
 
 /* FreeRTOS event group to signal when we are connected*/
 static EventGroupHandle_t s_wifi_event_group;
 
-/* The event group allows multiple bits for each event, but we only care about two events:
+/* The event group allows multiple bits for each event, we care about three events:
  * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
+ * - the association attempt failed
+ * - credentials were stored */
+#define WIFI_CONNECTED_BIT   BIT0
+#define WIFI_FAIL_BIT        BIT1
+#define WIFI_CREDENTIALS_BIT BIT2
 
 static const char *TAG = "wifi station";
 
-static int s_retry_num = 0;
+/* Last good association, kept in NVS across reboots */
+typedef struct
+{
+    uint8_t bssid[6];
+    uint8_t channel;
+    esp_netif_ip_info_t ipInfo;
+    esp_netif_dns_info_t dns;
+} wifi_cache_t;
+
+static esp_netif_t *s_sta_netif = NULL;
+static SemaphoreHandle_t s_connect_lock;    /* One connect at a time, the caller's or the reconnect task's */
+static TaskHandle_t s_reconnect_task = NULL;
+static wifi_cache_t s_cache;
+static bool s_cache_valid = false;
+static bool s_use_cached_lease = false;     /* Set for the attempt in progress */
+static bool s_started = false;
+static bool s_stay_connected = false;
+static bool s_connected = false;            /* wifi_connect() succeeded and nobody disconnected */
+static wifi_connection_metrics_t s_metrics;
+
+static void load_cache(void)
+{
+    nvs_handle_t handle;
+    size_t size = sizeof(s_cache);
+
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    s_cache_valid = (nvs_get_blob(handle, WIFI_NVS_KEY_CACHE, &s_cache, &size) == ESP_OK) &&
+                    (size == sizeof(s_cache));
+    nvs_close(handle);
+}
+
+static void store_cache(const wifi_cache_t *cache)
+{
+    /* This function saves the association to NVS, only when it changed to spare the flash */
+    nvs_handle_t handle;
+
+    if (s_cache_valid && (memcmp(cache, &s_cache, sizeof(s_cache)) == 0)) {
+        return;
+    }
+    s_cache = *cache;
+    s_cache_valid = true;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(handle, WIFI_NVS_KEY_CACHE, &s_cache, sizeof(s_cache)) == ESP_OK) {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
+
+static void load_credentials(wifi_config_t *wifi_config)
+{
+    /* NVS credentials take precedence over the menuconfig defaults */
+    nvs_handle_t handle;
+    size_t size;
+
+    strlcpy((char *)wifi_config->sta.ssid, CONFIG_LIGHT_WIFI_SSID, sizeof(wifi_config->sta.ssid));
+    strlcpy((char *)wifi_config->sta.password, CONFIG_LIGHT_WIFI_PASSWORD, sizeof(wifi_config->sta.password));
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    size = sizeof(wifi_config->sta.ssid);
+    if (nvs_get_str(handle, WIFI_NVS_KEY_SSID, (char *)wifi_config->sta.ssid, &size) == ESP_OK) {
+        size = sizeof(wifi_config->sta.password);
+        if (nvs_get_str(handle, WIFI_NVS_KEY_PASS, (char *)wifi_config->sta.password, &size) != ESP_OK) {
+            wifi_config->sta.password[0] = '\0';
+        }
+    }
+    nvs_close(handle);
+}
 
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        if (s_use_cached_lease) {
+            /* Skip DHCP and reuse the last lease, the got-ip event follows from set_ip_info */
+            esp_netif_dhcpc_stop(s_sta_netif);
+            esp_netif_set_dns_info(s_sta_netif, ESP_NETIF_DNS_MAIN, &s_cache.dns);
+            esp_netif_set_ip_info(s_sta_netif, &s_cache.ipInfo);
+        }
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "retry to connect to the AP");
-        } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+        if (s_stay_connected && s_connected) {
+            /* Lost an association that is meant to stay, not an attempt of wifi_connect() */
+            s_connected = false;
+            xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+            ESP_LOGI(TAG, "connection lost, reconnecting");
+            xTaskNotifyGive(s_reconnect_task);
+            return;
         }
-        ESP_LOGI(TAG,"connect to the AP fail");
+        xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-        s_retry_num = 0;
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
 
+static bool connect_attempt(wifi_config_t *wifi_config, bool fast, uint32_t timeoutMs)
+{
+    /* This function runs one association attempt, directed at the cached AP when 'fast' is set */
+    if (fast) {
+        memcpy(wifi_config->sta.bssid, s_cache.bssid, sizeof(wifi_config->sta.bssid));
+        wifi_config->sta.bssid_set = true;
+        wifi_config->sta.channel = s_cache.channel;
+        wifi_config->sta.scan_method = WIFI_FAST_SCAN;
+    } else {
+        wifi_config->sta.bssid_set = false;
+        wifi_config->sta.channel = 0;
+        wifi_config->sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    }
+    s_use_cached_lease = fast && WIFI_REUSE_LEASE;
+    if (!s_use_cached_lease) {
+        esp_err_t ret = esp_netif_dhcpc_start(s_sta_netif);
+        if (ret != ESP_OK && ret != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STARTED) {
+            ESP_LOGW(TAG, "DHCP client start failed: %s", esp_err_to_name(ret));
+        }
+    }
+
+    xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, wifi_config) );
+    if (esp_wifi_connect() != ESP_OK) {
+        return false;
+    }
+
+    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or the attempt
+     * failed (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
+    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
+            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
+            pdFALSE,
+            pdFALSE,
+            pdMS_TO_TICKS(timeoutMs));
+
+    if (bits & WIFI_CONNECTED_BIT) {
+        return true;
+    }
+    /* The disconnect event of the attempt given up comes later; left alone it would fail the
+     * next attempt right after that one cleared the bits */
+    xEventGroupClearBits(s_wifi_event_group, WIFI_FAIL_BIT);
+    if (esp_wifi_disconnect() == ESP_OK) {
+        xEventGroupWaitBits(s_wifi_event_group, WIFI_FAIL_BIT, pdTRUE, pdFALSE,
+                            pdMS_TO_TICKS(WIFI_DISCONNECT_WAIT_MS));
+    }
+    xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
+    return false;
+}
+
+#ifdef CONFIG_LIGHT_WIFI_CREDENTIALS_FROM_STDIN
+static bool ask_credentials(int64_t deadlineUs)
+{
+    /* This function asks for "<ssid> <password>" on the console UART, as the example this code
+       started from did, and stores the answer. It gives up at deadlineUs. */
+    char line[sizeof(((wifi_config_t *)0)->sta.ssid) + sizeof(((wifi_config_t *)0)->sta.password) + 1];
+    size_t length = 0;
+    bool complete = false;
+
+    if (!uart_is_driver_installed(CONFIG_ESP_CONSOLE_UART_NUM)) {
+        ESP_ERROR_CHECK(uart_driver_install(CONFIG_ESP_CONSOLE_UART_NUM, 256, 0, 0, NULL, 0));
+    }
+    ESP_LOGI(TAG, "Please input ssid password:");
+    while (!complete && (esp_timer_get_time() < deadlineUs)) {
+        uint8_t c;
+        if (uart_read_bytes(CONFIG_ESP_CONSOLE_UART_NUM, &c, 1, pdMS_TO_TICKS(WIFI_STDIN_POLL_MS)) != 1) {
+            continue;
+        }
+        if ((c == '\r') || (c == '\n')) {
+            complete = (length > 0);
+        } else if (length < sizeof(line) - 1) {
+            line[length++] = (char)c;
+        }
+    }
+    if (!complete) {
+        return false;
+    }
+    line[length] = '\0';
+
+    /* The SSID ends at the first space, the rest of the line is the password */
+    char *password = strchr(line, ' ');
+    if (password != NULL) {
+        *password++ = '\0';
+    }
+    return wifi_connection_set_credentials(line, (password != NULL) ? password : "") == ESP_OK;
+}
+#endif
+
+static bool wait_credentials(int64_t deadlineUs)
+{
+    /* This function waits for the credentials of a station that has none. It returns false if
+       none were entered by deadlineUs. */
+#if defined(CONFIG_LIGHT_WIFI_CREDENTIALS_FROM_STDIN)
+    return ask_credentials(deadlineUs);
+#elif defined(CONFIG_LIGHT_CONSOLE)
+    int64_t leftMs = (deadlineUs - esp_timer_get_time()) / 1000;
+
+    ESP_LOGI(TAG, "No Wi-Fi credentials, enter \"wifi <ssid> <password>\" on the console");
+    return (leftMs > 0) &&
+           (xEventGroupWaitBits(s_wifi_event_group, WIFI_CREDENTIALS_BIT, pdTRUE, pdFALSE,
+                                pdMS_TO_TICKS(leftMs)) & WIFI_CREDENTIALS_BIT);
+#else
+    return false;
+#endif
+}
+
+static void reconnect_task(void *arg)
+{
+    /* This task re-establishes a lost association of a station that is to stay connected. Each
+       round is a wifi_connect(), the directed attempt and then full scans with backoff; a round
+       that times out is followed by another one after the longest backoff. */
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (wifi_connect(CONFIG_LIGHT_WIFI_CONNECT_TIMEOUT_MS) != ESP_OK) {
+            vTaskDelay(pdMS_TO_TICKS(WIFI_BACKOFF_MAX_MS));
+        }
+    }
+}
+
+static void remember_association(void)
+{
+    wifi_ap_record_t ap;
+    wifi_cache_t cache = { 0 };
+
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+        return;
+    }
+    memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+    cache.channel = ap.primary;
+    esp_netif_get_ip_info(s_sta_netif, &cache.ipInfo);
+    esp_netif_get_dns_info(s_sta_netif, ESP_NETIF_DNS_MAIN, &cache.dns);
+    store_cache(&cache);
+}
+
 void wifi_init_sta(void)
 {
     s_wifi_event_group = xEventGroupCreate();
+    s_connect_lock = xSemaphoreCreateMutex();
 
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    s_sta_netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -123,10 +345,37 @@ void wifi_init_sta(void)
                                                         NULL,
                                                         &instance_got_ip));
 
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+    load_cache();
+
+    ESP_LOGI(TAG, "wifi_init_sta finished, %s", s_cache_valid ? "fast connect cache loaded" : "no fast connect cache");
+}
+
+void init_wifi(void)
+{
+    //Initialize NVS
+    ESP_LOGI(TAG, "In init_wifi()..");
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+      ESP_ERROR_CHECK(nvs_flash_erase());
+      ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
+
+    ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
+    wifi_init_sta();
+}
+
+static esp_err_t connect_station(uint32_t timeoutMs)
+{
+    int64_t startUs = esp_timer_get_time();
+    int64_t deadlineUs = startUs + (int64_t)timeoutMs * 1000;
+    uint32_t backoffMs = WIFI_BACKOFF_MIN_MS;
+    bool connected = false;
+    bool fast = false;
     wifi_config_t wifi_config = {
         .sta = {
-            .ssid = EXAMPLE_ESP_WIFI_SSID,
-            .password = EXAMPLE_ESP_WIFI_PASS,
             /* Authmode threshold resets to WPA2 as default if password matches WPA2 standards (pasword len => 8).
              * If you want to connect the device to deprecated WEP/WPA networks, Please set the threshold value
              * to WIFI_AUTH_WEP/WIFI_AUTH_WPA_PSK and set the password with length and format matching to
@@ -134,47 +383,144 @@ void wifi_init_sta(void)
              */
             .threshold.authmode = ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD,
             .sae_pwe_h2e = ESP_WIFI_SAE_MODE,
-            .sae_h2e_identifier = EXAMPLE_H2E_IDENTIFIER,
         },
     };
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
-    ESP_ERROR_CHECK(esp_wifi_start() );
 
-    ESP_LOGI(TAG, "wifi_init_sta finished.");
+    if (s_connected && (xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT)) {
+        return ESP_OK;
+    }
+    s_connected = false;
+    load_credentials(&wifi_config);
+    if (wifi_config.sta.ssid[0] == '\0') {
+        if (!wait_credentials(deadlineUs)) {
+            ESP_LOGW(TAG, "No Wi-Fi credentials");
+            return ESP_ERR_TIMEOUT;
+        }
+        load_credentials(&wifi_config);
+    }
+    if (!s_started) {
+        ESP_ERROR_CHECK(esp_wifi_start() );
+#ifdef CONFIG_LIGHT_GROUP
+        /* In modem sleep the AP holds multicast frames until the next DTIM beacon, a few
+           hundred ms; the group's packets are taken as they come instead */
+        ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
+#endif
+        s_started = true;
+    }
+    s_metrics.attempts++;
 
-    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-     * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
+    if (s_cache_valid) {
+        fast = true;
+        connected = connect_attempt(&wifi_config, true, WIFI_FAST_CONNECT_TIMEOUT_MS);
+        if (!connected) {
+            ESP_LOGI(TAG, "Fast connect to channel %u failed, scanning", s_cache.channel);
+        }
+    }
 
-    /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-     * happened. */
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "connected to ap SSID:%s password:%s",
-                 EXAMPLE_ESP_WIFI_SSID, EXAMPLE_ESP_WIFI_PASS);
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s",
-                 EXAMPLE_ESP_WIFI_SSID, EXAMPLE_ESP_WIFI_PASS);
-    } else {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
+    while (!connected) {
+        int64_t leftMs = (deadlineUs - esp_timer_get_time()) / 1000;
+        if (leftMs <= 0) {
+            break;
+        }
+        fast = false;
+        s_metrics.fullScans++;
+        connected = connect_attempt(&wifi_config, false,
+                                    (leftMs < WIFI_FULL_SCAN_TIMEOUT_MS) ? leftMs : WIFI_FULL_SCAN_TIMEOUT_MS);
+        if (!connected) {
+            leftMs = (deadlineUs - esp_timer_get_time()) / 1000;
+            uint32_t delayMs = (leftMs < backoffMs) ? ((leftMs > 0) ? leftMs : 0) : backoffMs;
+            ESP_LOGI(TAG, "retry to connect to the AP in %lu ms", (unsigned long)delayMs);
+            vTaskDelay(pdMS_TO_TICKS(delayMs));
+            backoffMs = (backoffMs * 2 > WIFI_BACKOFF_MAX_MS) ? WIFI_BACKOFF_MAX_MS : backoffMs * 2;
+        }
+    }
+
+    uint32_t elapsedMs = (uint32_t)((esp_timer_get_time() - startUs) / 1000);
+    if (!connected) {
+        s_metrics.failures++;
+        metrics_count(METRIC_WIFI_FAILURES);
+        ESP_LOGW(TAG, "Failed to connect to SSID:%s within %lu ms", wifi_config.sta.ssid, (unsigned long)timeoutMs);
+        return ESP_ERR_TIMEOUT;
     }
+
+    if (fast) {
+        s_metrics.fastConnects++;
+    }
+    s_metrics.lastConnectMs = elapsedMs;
+    metrics_count(METRIC_WIFI_CONNECTS);
+    metrics_record(METRIC_WIFI_CONNECT_MS, elapsedMs);
+    if (elapsedMs > s_metrics.maxConnectMs) {
+        s_metrics.maxConnectMs = elapsedMs;
+    }
+    remember_association();
+    s_connected = true;
+    ESP_LOGI(TAG, "connected to ap SSID:%s in %lu ms (%s)", wifi_config.sta.ssid,
+             (unsigned long)elapsedMs, fast ? "fast connect" : "full scan");
+    return ESP_OK;
 }
 
-void init_wifi(void)
+esp_err_t wifi_connect(uint32_t timeoutMs)
 {
-    //Initialize NVS
-    ESP_LOGI(TAG, "In init_wifi()..");
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-      ESP_ERROR_CHECK(nvs_flash_erase());
-      ret = nvs_flash_init();
+    /* This function connects the station and returns ESP_OK once it has an IP, or
+       ESP_ERR_TIMEOUT if that did not happen within timeoutMs. A connect of the reconnect task
+       under way is waited for first. */
+    xSemaphoreTake(s_connect_lock, portMAX_DELAY);
+    esp_err_t ret = connect_station(timeoutMs);
+    xSemaphoreGive(s_connect_lock);
+    return ret;
+}
+
+void wifi_disconnect(void)
+{
+    /* This function drops the association and turns the radio off until the next connect. It
+       does nothing while the station is to stay connected. */
+    if (!s_started || s_stay_connected) {
+        return;
     }
-    ESP_ERROR_CHECK(ret);
+    s_connected = false;
+    esp_wifi_disconnect();
+    esp_wifi_stop();
+    s_started = false;
+}
 
-    ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
-    wifi_init_sta();
+esp_err_t wifi_connection_set_credentials(const char *ssid, const char *password)
+{
+    /* This function stores new credentials in NVS, for the next connect. The fast connect cache
+       belongs to the old network and is dropped. */
+    nvs_handle_t handle;
+    esp_err_t ret = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &handle);
+
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = nvs_set_str(handle, WIFI_NVS_KEY_SSID, ssid);
+    if (ret == ESP_OK) {
+        ret = nvs_set_str(handle, WIFI_NVS_KEY_PASS, password);
+    }
+    if (ret == ESP_OK) {
+        nvs_erase_key(handle, WIFI_NVS_KEY_CACHE);
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    s_cache_valid = false;
+    if ((ret == ESP_OK) && (s_wifi_event_group != NULL)) {
+        xEventGroupSetBits(s_wifi_event_group, WIFI_CREDENTIALS_BIT);
+    }
+    return ret;
+}
+
+void wifi_connection_stay_connected(bool stay)
+{
+    /* This function keeps the station associated between wifi_connect() calls, for services
+       that have to be reachable. It is set before the first connect. */
+    s_stay_connected = stay;
+    if (stay && (s_reconnect_task == NULL)) {
+        xTaskCreatePinnedToCore(reconnect_task, "wifi_reconnect", WIFI_RECONNECT_TASK_STACK_SIZE, NULL,
+                                WIFI_RECONNECT_TASK_PRIORITY, &s_reconnect_task, WIFI_RECONNECT_TASK_CORE);
+    }
+}
+
+void wifi_connection_get_metrics(wifi_connection_metrics_t *metrics)
+{
+    *metrics = s_metrics;
 }
@@ -2,7 +2,27 @@
 #ifndef _WIFI_CONNECTION_H_
 #define _WIFI_CONNECTION_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/* Connect statistics since boot */
+typedef struct
+{
+    uint32_t attempts;              /* wifi_connect() calls */
+    uint32_t fastConnects;          /* Connected on the directed attempt with the cached BSSID */
+    uint32_t fullScans;             /* Full scan attempts, including retries */
+    uint32_t failures;              /* wifi_connect() calls that timed out */
+    uint32_t lastConnectMs;
+    uint32_t maxConnectMs;
+} wifi_connection_metrics_t;
+
 void wifi_init_sta(void);
 void init_wifi(void);
+esp_err_t wifi_connect(uint32_t timeoutMs);
+void wifi_disconnect(void);
+void wifi_connection_stay_connected(bool stay);
+esp_err_t wifi_connection_set_credentials(const char *ssid, const char *password);
+void wifi_connection_get_metrics(wifi_connection_metrics_t *metrics);
 
 #endif /* _WIFI_CONNECTION_H_ */
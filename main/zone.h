@@ -0,0 +1,41 @@
+#ifndef _ZONE_H_
+#define _ZONE_H_
+
+#include <stdint.h>
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+
+/* One zone per LEDC channel of the speed mode in use */
+#define ZONE_MAX 8
+
+/* LEDC speed mode and clock of the zones. Only a low speed timer on RC_FAST keeps running in
+   light sleep, so that is what the light sleep power mode uses. */
+#ifdef CONFIG_LIGHT_POWER_LIGHT_SLEEP
+#define ZONE_LEDC_SPEED_MODE LEDC_LOW_SPEED_MODE
+#define ZONE_LEDC_CLK LEDC_USE_RC_FAST_CLK
+#else
+#define ZONE_LEDC_SPEED_MODE LEDC_HIGH_SPEED_MODE
+#define ZONE_LEDC_CLK LEDC_AUTO_CLK
+#endif
+
+/* A fixture: one PIR sensor driving one PWM LED channel, or a segment of the addressable strip
+   with CONFIG_LIGHT_OUTPUT_STRIP */
+typedef struct
+{
+    gpio_num_t sensorGpio;
+    gpio_num_t ledGpio;
+    ledc_channel_t channel;
+    ledc_timer_t timer;
+    uint32_t holdTimeMs;
+    uint32_t maxDuty;               /* Full-scale duty at the channel's duty resolution */
+    uint8_t brightness;             /* Perceptual level when lit, 0 to BRIGHTNESS_MAX */
+    const char *schedule;           /* Schedule rules, NULL for CONFIG_LIGHT_SCHEDULE */
+    uint16_t stripFirst;            /* Strip output: first pixel of the segment */
+    uint16_t stripCount;            /* Strip output: pixels in the segment */
+    uint16_t stripOrigin;           /* Strip output: pixel nearest the sensor, the light spreads from it */
+} zone_config_t;
+
+extern const zone_config_t g_zone_table[];
+extern const uint8_t g_zone_count;
+
+#endif /* _ZONE_H_ */
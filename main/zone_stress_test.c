@@ -0,0 +1,107 @@
+/*******************************************************************************************
+Zone Stress Test
+
+Fires motion in all zones at once and measures how the single lighting task keeps up. The test
+task runs on the lighting core above the lighting task, so a burst of edges for every zone is
+queued before the first one is dispatched, which is the worst case of all sensors tripping in
+the same instant. Each phase fires STRESS_ROUNDS bursts over 1, 2, 4 and finally all zones and
+reports the edge-to-dispatch latency per zone and for the last zone of a burst, which waits for
+all the others.
+
+Built with CONFIG_LIGHT_ZONE_STRESS_TEST, which also fills the zone table up to ZONE_MAX.
+
+********************************************************************************************/
+#include "zone_stress_test.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "zone.h"
+#include "light_events.h"
+#include "light_controller.h"
+
+static const char *TAG = "zone_stress";
+
+#define STRESS_TASK_STACK_SIZE 3072
+#define STRESS_TASK_PRIORITY 11         /* Above the lighting task */
+#define STRESS_TASK_CORE 1
+#define STRESS_START_DELAY_MS 3000
+#define STRESS_ROUNDS 50
+#define STRESS_ROUND_PERIOD_MS 20
+#define STRESS_MAX_DISPATCH_US 2000     /* Budget for the last zone of a full burst */
+
+static QueueHandle_t s_event_queue;
+
+static bool run_phase(uint8_t zoneCount)
+{
+    uint32_t dropped = 0;
+    uint32_t motionEvents = 0;
+    int64_t dispatchSumUs = 0;
+    int64_t dispatchMaxUs = 0;
+    int64_t lightMaxUs = 0;
+
+    light_controller_reset_stats();
+    for (int round = 0; round < STRESS_ROUNDS; round++)
+    {
+        int64_t now = esp_timer_get_time();
+        for (uint8_t zone = 0; zone < zoneCount; zone++)
+        {
+            light_event_t event = {
+                .type = LIGHT_EVENT_MOTION,
+                .zone = zone,
+                .timestamp_us = now,
+                .value = 1,
+            };
+            if (xQueueSend(s_event_queue, &event, 0) != pdTRUE)
+            {
+                dropped++;
+            }
+        }
+        vTaskDelay(pdMS_TO_TICKS(STRESS_ROUND_PERIOD_MS));
+    }
+
+    for (uint8_t zone = 0; zone < zoneCount; zone++)
+    {
+        light_zone_stats_t stats;
+        light_controller_get_stats(zone, &stats);
+        motionEvents += stats.motionEvents;
+        dispatchSumUs += stats.dispatchSumUs;
+        dispatchMaxUs = (stats.dispatchMaxUs > dispatchMaxUs) ? stats.dispatchMaxUs : dispatchMaxUs;
+        lightMaxUs = (stats.lightMaxUs > lightMaxUs) ? stats.lightMaxUs : lightMaxUs;
+    }
+
+    ESP_LOGI(TAG, "%u zone(s): %lu edges, %lu dropped, dispatch mean %lld us max %lld us, light max %lld us",
+             zoneCount, (unsigned long)motionEvents, (unsigned long)dropped,
+             (motionEvents > 0) ? dispatchSumUs / motionEvents : 0, dispatchMaxUs, lightMaxUs);
+
+    return (dropped == 0) && (motionEvents == (uint32_t)zoneCount * STRESS_ROUNDS) &&
+           (dispatchMaxUs <= STRESS_MAX_DISPATCH_US);
+}
+
+static void zone_stress_task(void *arg)
+{
+    bool passed = true;
+
+    vTaskDelay(pdMS_TO_TICKS(STRESS_START_DELAY_MS));
+    for (uint8_t zoneCount = 1; ; zoneCount *= 2)
+    {
+        if (zoneCount > g_zone_count)
+        {
+            zoneCount = g_zone_count;
+        }
+        passed &= run_phase(zoneCount);
+        if (zoneCount == g_zone_count)
+        {
+            break;
+        }
+    }
+
+    ESP_LOGI(TAG, "Zone stress test %s", passed ? "PASSED" : "FAILED");
+    vTaskDelete(NULL);
+}
+
+void zone_stress_test_start(QueueHandle_t eventQueue)
+{
+    s_event_queue = eventQueue;
+    xTaskCreatePinnedToCore(zone_stress_task, "zone_stress", STRESS_TASK_STACK_SIZE, NULL,
+                            STRESS_TASK_PRIORITY, NULL, STRESS_TASK_CORE);
+}
@@ -0,0 +1,9 @@
+#ifndef _ZONE_STRESS_TEST_H_
+#define _ZONE_STRESS_TEST_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+void zone_stress_test_start(QueueHandle_t eventQueue);
+
+#endif /* _ZONE_STRESS_TEST_H_ */
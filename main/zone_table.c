@@ -0,0 +1,55 @@
+/*******************************************************************************************
+Zone Table
+
+The fixtures on this board. Every row is serviced by the same lighting task; add a row per
+sensor/LED pair, up to ZONE_MAX. All zones share the LEDC timer configured in configure_LED(),
+so every zone needs its own channel. With CONFIG_LIGHT_OUTPUT_STRIP every zone drives the strip
+pixels stripFirst to stripFirst + stripCount - 1 instead; along a corridor, give each sensor
+the segment it overlooks and the light follows whoever walks it.
+
+********************************************************************************************/
+#include "zone.h"
+#include "brightness.h"
+
+#define ZONE_HOLD_MS (CONFIG_LIGHT_OCCUPANCY_HOLD_TIME_S * 1000)
+#define ZONE_MAX_DUTY 0x3FF             /* Full scale at LEDC_TIMER_10_BIT */
+#define ZONE_BRIGHTNESS BRIGHTNESS_FROM_PERCENT(CONFIG_LIGHT_BRIGHTNESS_PERCENT)
+#ifdef CONFIG_LIGHT_OUTPUT_STRIP
+#define ZONE_STRIP_PIXELS CONFIG_LIGHT_STRIP_PIXELS
+#else
+#define ZONE_STRIP_PIXELS 0
+#endif
+
+const zone_config_t g_zone_table[] = {
+    { .sensorGpio = GPIO_NUM_17, .ledGpio = GPIO_NUM_2,  .channel = LEDC_CHANNEL_0, .timer = LEDC_TIMER_0,
+      .holdTimeMs = ZONE_HOLD_MS, .maxDuty = ZONE_MAX_DUTY, .brightness = ZONE_BRIGHTNESS,
+      .schedule = NULL, .stripFirst = 0, .stripCount = ZONE_STRIP_PIXELS, .stripOrigin = 0 },
+#ifdef CONFIG_LIGHT_ZONE_STRESS_TEST
+    /* Every high speed channel in use, for the dispatcher stress test */
+    { .sensorGpio = GPIO_NUM_16, .ledGpio = GPIO_NUM_4,  .channel = LEDC_CHANNEL_1, .timer = LEDC_TIMER_0,
+      .holdTimeMs = ZONE_HOLD_MS, .maxDuty = ZONE_MAX_DUTY, .brightness = ZONE_BRIGHTNESS,
+      .schedule = NULL },
+    { .sensorGpio = GPIO_NUM_25, .ledGpio = GPIO_NUM_5,  .channel = LEDC_CHANNEL_2, .timer = LEDC_TIMER_0,
+      .holdTimeMs = ZONE_HOLD_MS, .maxDuty = ZONE_MAX_DUTY, .brightness = ZONE_BRIGHTNESS,
+      .schedule = NULL },
+    { .sensorGpio = GPIO_NUM_26, .ledGpio = GPIO_NUM_18, .channel = LEDC_CHANNEL_3, .timer = LEDC_TIMER_0,
+      .holdTimeMs = ZONE_HOLD_MS, .maxDuty = ZONE_MAX_DUTY, .brightness = ZONE_BRIGHTNESS,
+      .schedule = NULL },
+    { .sensorGpio = GPIO_NUM_27, .ledGpio = GPIO_NUM_19, .channel = LEDC_CHANNEL_4, .timer = LEDC_TIMER_0,
+      .holdTimeMs = ZONE_HOLD_MS, .maxDuty = ZONE_MAX_DUTY, .brightness = ZONE_BRIGHTNESS,
+      .schedule = NULL },
+    { .sensorGpio = GPIO_NUM_13, .ledGpio = GPIO_NUM_21, .channel = LEDC_CHANNEL_5, .timer = LEDC_TIMER_0,
+      .holdTimeMs = ZONE_HOLD_MS, .maxDuty = ZONE_MAX_DUTY, .brightness = ZONE_BRIGHTNESS,
+      .schedule = NULL },
+    { .sensorGpio = GPIO_NUM_32, .ledGpio = GPIO_NUM_22, .channel = LEDC_CHANNEL_6, .timer = LEDC_TIMER_0,
+      .holdTimeMs = ZONE_HOLD_MS, .maxDuty = ZONE_MAX_DUTY, .brightness = ZONE_BRIGHTNESS,
+      .schedule = NULL },
+    { .sensorGpio = GPIO_NUM_33, .ledGpio = GPIO_NUM_23, .channel = LEDC_CHANNEL_7, .timer = LEDC_TIMER_0,
+      .holdTimeMs = ZONE_HOLD_MS, .maxDuty = ZONE_MAX_DUTY, .brightness = ZONE_BRIGHTNESS,
+      .schedule = NULL },
+#endif
+};
+
+const uint8_t g_zone_count = sizeof(g_zone_table) / sizeof(g_zone_table[0]);
+
+_Static_assert(sizeof(g_zone_table) / sizeof(g_zone_table[0]) <= ZONE_MAX, "Too many zones");
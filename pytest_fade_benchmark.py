@@ -0,0 +1,21 @@
+# SPDX-License-Identifier: Apache-2.0
+
+import logging
+
+import pytest
+from pytest_embedded import Dut
+
+
+@pytest.mark.esp32
+@pytest.mark.generic
+@pytest.mark.parametrize('config', ['fade_benchmark'], indirect=True)
+def test_fade_benchmark(dut: Dut) -> None:
+    results = {}
+    for name in ('Linear loop', 'Perceptual steps', 'Fade engine'):
+        line = dut.expect(r'{}: (\d+) updates, (\d+) us CPU, (\d+) ms'.format(name), timeout=30)
+        results[name] = tuple(int(line[i].decode()) for i in range(1, 4))
+        logging.info('{}: {} updates, {} us CPU, {} ms'.format(name, *results[name]))
+
+    assert results['Linear loop'][0] == 2 * 1023 + 1
+    assert results['Fade engine'][0] <= 2 * 32
+    assert results['Fade engine'][1] < results['Linear loop'][1]
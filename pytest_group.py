@@ -0,0 +1,49 @@
+# SPDX-License-Identifier: Apache-2.0
+
+import logging
+import time
+from typing import Tuple
+
+import pytest
+from pytest_embedded import Dut
+
+
+@pytest.mark.linux
+@pytest.mark.host_test
+@pytest.mark.parametrize('count, config', [(2, 'group|group')], indirect=True)
+def test_group(dut: Tuple[Dut, Dut]) -> None:
+    # Two instances of the linux target, a group on the loopback interface
+    sender, receiver = dut
+    for board in dut:
+        board.expect(r'Node ([0-9a-f]{8}) in group 1', timeout=30)
+
+    # A pulse on the sender, then three more within 1.4 s of it. The first one is sent, the
+    # others fall inside CONFIG_LIGHT_GROUP_MIN_INTERVAL_MS (2000 ms) of it and are not. The
+    # burst goes out before waiting on the receiver, whose pre-light fade takes ~3 s.
+    sender.write('motion 0 1')
+    time.sleep(0.2)
+    sender.write('motion 0 0')
+    for _ in range(3):
+        time.sleep(0.2)
+        sender.write('motion 0 1')
+        time.sleep(0.2)
+        sender.write('motion 0 0')
+
+    # The first pulse pre-lights both zones of the receiver
+    match = receiver.expect(r'Motion from [0-9a-f]{8} zone 0, (\d+) us on the way', timeout=5)
+    latency_us = int(match.group(1))
+    logging.info('Motion propagated in {} us'.format(latency_us))
+    assert latency_us < 100000
+    receiver.expect(r'Zone 0 LED is on', timeout=15)
+    receiver.expect(r'Zone 1 LED is on', timeout=15)
+
+    sender.write('group')
+    match = sender.expect(r'Group: (\d+) sent, (\d+) rate limited', timeout=5)
+    assert int(match.group(1)) == 1
+    assert int(match.group(2)) == 3
+
+    # Every packet is sent twice, the repeat is dropped
+    receiver.write('group')
+    match = receiver.expect(r'Group: \d+ sent, \d+ rate limited, (\d+) received, (\d+) duplicates', timeout=5)
+    assert int(match.group(1)) == 1
+    assert int(match.group(2)) == 1
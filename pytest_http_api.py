@@ -0,0 +1,86 @@
+# SPDX-License-Identifier: Apache-2.0
+
+import json
+import logging
+import threading
+import time
+import urllib.error
+import urllib.parse
+import urllib.request
+from typing import Any, Dict, List, Tuple
+
+import pytest
+from pytest_embedded import Dut
+
+# CONFIG_LIGHT_HTTP_PORT in sdkconfig.ci.http_api
+BASE_URL = 'http://127.0.0.1:8080'
+
+
+def get_json(path: str) -> Dict[str, Any]:
+    with urllib.request.urlopen(BASE_URL + path, timeout=5) as response:
+        return json.load(response)
+
+
+def post_zone(**fields: Any) -> Dict[str, Any]:
+    body = urllib.parse.urlencode(fields).encode()
+    with urllib.request.urlopen(BASE_URL + '/api/zone', data=body, timeout=5) as response:
+        return json.load(response)
+
+
+def read_events(events: List[Tuple[str, Dict[str, Any]]], count: int, opened: threading.Event) -> None:
+    with urllib.request.urlopen(BASE_URL + '/api/events', timeout=30) as response:
+        opened.set()
+        name = ''
+        for raw in response:
+            line = raw.decode().rstrip('\n')
+            if line.startswith('event: '):
+                name = line[len('event: '):]
+            elif line.startswith('data: '):
+                events.append((name, json.loads(line[len('data: '):])))
+                if len(events) == count:
+                    return
+
+
+@pytest.mark.linux
+@pytest.mark.host_test
+@pytest.mark.parametrize('config', ['http_api'], indirect=True)
+def test_http_api(dut: Dut) -> None:
+    dut.expect(r'HTTP API listening on port (\d+)', timeout=30)
+
+    state = get_json('/api/state')
+    assert [zone['zone'] for zone in state['zones']] == [0, 1]
+    assert not state['zones'][0]['lit']
+
+    # Runtime changes, answered with the state after them
+    zone = post_zone(zone=0, schedule='00:00-24:00', hold_s=2, brightness=60)['zones'][0]
+    assert zone['schedule'] == '00:00-24:00'
+    assert zone['hold_s'] == 2
+    assert zone['brightness'] == 60
+    assert zone['active']
+    for fields in ({'zone': 0, 'schedule': '25:00-26:00'}, {'zone': 0, 'brightness': 0}, {'zone': 7}):
+        with pytest.raises(urllib.error.HTTPError) as error:
+            post_zone(**fields)
+        assert error.value.code == 400
+    assert get_json('/api/state')['zones'][0]['schedule'] == '00:00-24:00'
+
+    # Motion on zone 0 is streamed as it happens, then the 2 s hold runs out
+    events: List[Tuple[str, Dict[str, Any]]] = []
+    opened = threading.Event()
+    reader = threading.Thread(target=read_events, args=(events, 4, opened), daemon=True)
+    reader.start()
+    assert opened.wait(5)
+    time.sleep(0.5)
+    start = time.monotonic()
+    dut.write('motion 0 1')
+    while not events and time.monotonic() - start < 5:
+        time.sleep(0.01)
+    logging.info('First event after {:.0f} ms'.format((time.monotonic() - start) * 1000))
+    assert get_json('/api/state')['zones'][0]['lit']
+    dut.write('motion 0 0')
+    reader.join(15)
+    assert [name for name, _ in events] == ['occupied', 'light_on', 'vacant', 'light_off']
+    assert all(data['zone'] == 0 and data['time_valid'] for _, data in events)
+
+    metrics = get_json('/api/metrics')
+    assert metrics['counters']['light_ups'] == 1
+    assert metrics['histograms']['edge_to_duty']['count'] == 1
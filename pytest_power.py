@@ -0,0 +1,30 @@
+# SPDX-License-Identifier: Apache-2.0
+
+import logging
+
+import pytest
+from pytest_embedded import Dut
+
+
+@pytest.mark.esp32
+@pytest.mark.generic
+@pytest.mark.parametrize('config', ['light_sleep'], indirect=True)
+def test_power_light_sleep(dut: Dut) -> None:
+    dut.expect_exact('Power mode: light sleep', timeout=30)
+    pattern = (r'Power \(light sleep\): active (\d+) s, light sleep (\d+) s, deep sleep (\d+) s in (\d+) cycles, '
+               r'estimated average (\d+) uA')
+    # The first reports may fall into the boot time sync, the residency is taken between the next two.
+    # Only the residency is measured, the current in the line is an estimate from the configuration.
+    dut.expect(pattern, timeout=30)
+    dut.expect(pattern, timeout=30)
+    reports = []
+    for _ in range(2):
+        line = dut.expect(pattern, timeout=30)
+        reports.append([int(line[i].decode()) for i in range(1, 6)])
+    active, light, deep, cycles = (reports[1][i] - reports[0][i] for i in range(4))
+    logging.info('Over {} s: active {} s, light sleep {} s, estimated {} uA'.format(active + light, active, light,
+                                                                                   reports[1][4]))
+
+    assert deep == 0 and cycles == 0
+    # An idle board with no fade running spends most of its time in light sleep
+    assert light * 2 > active + light
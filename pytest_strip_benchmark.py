@@ -0,0 +1,25 @@
+# SPDX-License-Identifier: Apache-2.0
+
+import logging
+
+import pytest
+from pytest_embedded import Dut
+
+
+@pytest.mark.esp32
+@pytest.mark.generic
+@pytest.mark.parametrize('config', ['strip_benchmark'], indirect=True)
+def test_strip_benchmark(dut: Dut) -> None:
+    results = {}
+    for pixels in (60, 150, 300, 600):
+        line = dut.expect(r'{} pixels: render (\d+) us \(max (\d+) us\), transmit (\d+) us, (\d+) FPS achievable'
+                          .format(pixels), timeout=30)
+        results[pixels] = tuple(int(line[i].decode()) for i in range(1, 5))
+        logging.info('{} pixels: render {} us (max {} us), transmit {} us, {} FPS'.format(pixels, *results[pixels]))
+
+    # 24 bits at 1.2 us per pixel plus the reset time
+    assert results[600][2] >= 600 * 24 * 12 // 10
+    # Rendering stays well inside the transmission it overlaps with
+    assert results[600][1] < results[600][2]
+    assert results[60][3] >= 60
+    assert results[600][3] >= 40
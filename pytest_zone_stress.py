@@ -0,0 +1,20 @@
+# SPDX-License-Identifier: Apache-2.0
+
+import logging
+
+import pytest
+from pytest_embedded import Dut
+
+
+@pytest.mark.esp32
+@pytest.mark.generic
+@pytest.mark.parametrize('config', ['zone_stress'], indirect=True)
+def test_zone_stress(dut: Dut) -> None:
+    dut.expect('8 zone\\(s\\) configured')
+    for zones in (1, 2, 4, 8):
+        line = dut.expect(r'{} zone\(s\): (\d+) edges, (\d+) dropped, dispatch mean (\d+) us max (\d+) us'.format(zones),
+                          timeout=30)
+        edges, dropped, mean_us, max_us = (int(line[i].decode()) for i in range(1, 5))
+        logging.info('{} zones: {} edges, mean {} us, max {} us'.format(zones, edges, mean_us, max_us))
+        assert dropped == 0
+    dut.expect('Zone stress test PASSED', timeout=30)